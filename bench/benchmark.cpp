@@ -0,0 +1,582 @@
+//Base library
+#include <iostream>
+#include <math.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sys/resource.h>
+
+//
+#include "extern_stb_image.h"
+
+//Project files
+#include "utils.h"
+#include "objects.h"
+#include "camera.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "denoiser.h"
+
+//Namespaces
+using namespace std;
+
+
+
+/*
+** Benchmark utilities
+ */
+
+struct bench_options{
+    vector<string> scenes = {"random", "cornell", "textured", "noise", "volume"};
+    vector<int> spheres = {1000};
+    vector<int> threads;
+    int width = 256;
+    int height = 256;
+    int spp = 4;
+    int depth = 8;
+    int frames = 0;       //Animation frames of the bouncing scene, 0 skips the animation run
+    int primary = 0;      //Cached camera subsamples per pixel, 0 traces every camera ray
+    int quality = 0;      //Samples per pixel of the time to quality run, 0 skips it
+    bool guide = false;   //Path guiding, trained during every render
+    int photons = 0;      //Caustic photons per pass, 0 leaves caustics to the paths
+    bool micro = true;
+    bool render = true;
+    bool arena = true;    //Build scenes in their arena, --heap allocates every object on its own
+    string json_path;
+    string cost_path;
+    string trace_path;
+    string denoise_path;
+    string exr_path;
+    aov_mask aovs = 0;
+};
+
+struct bench_result{
+    string name;
+    int spheres;      //Requested sphere (or light) count, random, bouncing and lights scenes only
+    int threads;
+    double build_seconds;
+    double render_seconds;
+    uint64_t rays;
+    double peak_mb;
+};
+
+struct micro_result{
+    string name;
+    uint64_t calls;
+    double seconds;
+};
+
+//Keeps the optimizer from dropping the measured work
+volatile double bench_sink = 0.0;
+
+
+static double seconds_since(std::chrono::steady_clock::time_point begin){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static double peak_memory_mb(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+///Path with a suffix added before the extension
+static string suffixed(const string& path, const string& suffix){
+    string out = path;
+    size_t dot = out.rfind('.');
+    out.insert(dot == string::npos ? out.size() : dot, suffix);
+    return out;
+}
+
+///Gamma corrected png of an rgb buffer holding sums over samples
+static void write_png(const string& path, const double* pixels, int width, int height, int samples){
+    vector<uint32_t> packed(width * height);
+    film_resolver::standard().resolve(pixels, width, 0, height, 1.0 / samples, packed.data());
+    vector<unsigned char> data(width * height * 3);
+    for (int i = 0; i < width * height; i++){
+        for (int c = 0; c < 3; c++){data[i*3+c] = (unsigned char)(packed[i] >> (8*c));}
+    }
+    stbi_flip_vertically_on_write(1);
+    stbi_write_png(path.c_str(), width, height, 3, data.data(), width * 3);
+}
+
+static vector<int> parse_list(const string& s){
+    vector<int> out;
+    size_t start = 0;
+    while (start <= s.size()){
+        size_t end = s.find(',', start);
+        if (end == string::npos) end = s.size();
+        if (end > start) out.push_back((int)atof(s.substr(start, end-start).c_str()));
+        start = end + 1;
+    }
+    return out;
+}
+
+static vector<string> parse_names(const string& s){
+    vector<string> out;
+    size_t start = 0;
+    while (start <= s.size()){
+        size_t end = s.find(',', start);
+        if (end == string::npos) end = s.size();
+        if (end > start) out.push_back(s.substr(start, end-start));
+        start = end + 1;
+    }
+    return out;
+}
+
+
+
+
+/*
+** Scenes
+ */
+
+///Builds a fixed-seed scene and its camera, returns false on unknown names
+static bool build_scene(const string& name, int spheres, double aspect, scene* world, camera** cam){
+    random_seed(0);
+    point3 lookfrom(0, 2, 10), lookat(0, 2, 0);
+    double fov = 29.0;
+
+    if (name == "random"){random_scene(world, spheres); lookfrom = point3(13, 2, 3); lookat = point3(0, 0, 0); fov = 20.0;}
+    else if (name == "cornell"){cornell_box(world);}
+    else if (name == "textured"){textured_scene(world); lookfrom = point3(0, 2, 9); lookat = point3(0, 1, 0); fov = 30.0;}
+    else if (name == "noise"){noise_scene(world); lookfrom = point3(0, 2, 10); lookat = point3(0, 1, 0); fov = 35.0;}
+    else if (name == "volume"){volume_scene(world);}
+    else if (name == "smoke"){smoke_scene(world);}
+    else if (name == "lights"){lights_scene(world, spheres); lookfrom = point3(0, 14, 40); lookat = point3(0, 0, 0); fov = 45.0;}
+    else if (name == "sky"){sky_scene(world); lookfrom = point3(0, 1.5, 9); lookat = point3(0, 1, 0); fov = 35.0;}
+    else if (name == "caustics"){caustics_scene(world);}
+    else if (name == "bouncing"){animation still; bouncing_scene(world, still, spheres); lookfrom = point3(0, 4, 14); lookat = point3(0, 1, 0); fov = 35.0;}
+    else return false;
+
+    *cam = new camera(lookfrom, lookat, vec3(0, 1, 0), fov, aspect, 0.0, 10.0);
+    return true;
+}
+
+
+
+
+/*
+** Animation
+ */
+
+///Renders frames of the bouncing scene through the pipeline and compares the per-frame overhead with a full rebuild
+static void run_animation_benchmark(const bench_options& opt, int spheres){
+    const double FPS = 24.0;
+    const double aspect = (double)opt.width / opt.height;
+
+    //What restarting per frame used to pay, the pipeline builds its two copies at once
+    auto build_begin = std::chrono::steady_clock::now();
+    animation_pipeline pipeline([spheres](scene* world, animation& anim){bouncing_scene(world, anim, spheres);});
+    const double build_seconds = seconds_since(build_begin) / 2;
+
+    film pixels(opt.width, opt.height);
+    double render_seconds = 0.0, update_seconds = 0.0;
+    int refits = 0, rebuilds = 0;
+    const double waited = pipeline.run(0, opt.frames, FPS, [&](const scene& world, int frame, double time, const frame_update& update){
+        //Turntable camera, once around every 8 seconds
+        const double angle = 2*pi * time / 8.0;
+        camera cam(point3(14*sin(angle), 4, 14*cos(angle)), point3(0, 1, 0), vec3(0, 1, 0), 35.0, aspect, 0.0, 10.0);
+        pixels.clear();
+        render_info info = renderScene(pixels, world, cam, opt.spp, opt.depth);
+        render_seconds += info.seconds;
+        update_seconds += update.seconds;
+        refits += update.refits;
+        rebuilds += update.rebuilds;
+    });
+
+    const int n = opt.frames;
+    printf("bouncing  spheres:%-9d frames:%-4d build:%8.3fs render:%8.3fs/frame  update:%8.3fms/frame  exposed:%8.3fms/frame  refits:%d rebuilds:%d\n",
+           spheres, n, build_seconds, render_seconds / n, update_seconds * 1e3 / n, waited * 1e3 / n, refits, rebuilds);
+}
+
+
+///Relative MSE of a render against a reference, both row major rgb sums
+static double relative_mse(const vector<double>& sums, int spp, const vector<double>& reference, int reference_spp){
+    double error = 0.0;
+    for (size_t k = 0; k < sums.size(); k++){
+        const double x = sums[k] / spp, r = reference[k] / reference_spp;
+        error += (x - r) * (x - r) / (r * r + 1e-2);
+    }
+    return error / sums.size();
+}
+
+///Error against render time of progressive passes (1, 1, 2, 4... spp, the guide's training iterations),
+///the reference has 4 times the samples and leaves the caustics to the paths
+static void run_quality_benchmark(const bench_options& opt, const string& name, const scene& world, const camera& cam){
+    const int REFERENCE_SPP = 4 * opt.quality;
+    film pixels(opt.width, opt.height);
+    vector<double> reference(opt.width * opt.height * 3), sums(reference.size());
+    if (world.photons){world.photons->restart();}
+    render_control unmapped;
+    unmapped.photon_pass = false;
+    render_pass = 0;
+    renderScene(pixels, world, cam, REFERENCE_SPP, opt.depth, nullptr, nullptr, &unmapped);
+    pixels.export_sums(reference.data());
+
+    if (world.guide){world.guide->restart();}
+    if (world.photons){world.photons->restart();}
+    pixels.clear();
+    render_pass = 0;
+    const string tag = string(opt.guide ? " guided" : "") + (opt.photons > 0 ? " photons" : "");
+    double seconds = 0.0;
+    for (int spp = 0, pass = 1; spp < opt.quality; pass = spp){
+        pass = std::min(std::max(pass, 1), opt.quality - spp);
+        seconds += renderScene(pixels, world, cam, pass, opt.depth).seconds;
+        spp += pass;
+        pixels.export_sums(sums.data());
+        printf("%-9s quality spp:%-6d render:%8.3fs  relMSE:%10.6f%s\n", name.c_str(), spp, seconds,
+               relative_mse(sums, spp, reference, REFERENCE_SPP), tag.c_str());
+    }
+    if (world.guide){printf("%-9s guide cells:%zu iterations:%d\n", name.c_str(), world.guide->cells(), world.guide->iterations_done());}
+    if (world.photons){printf("%-9s photons stored:%zu radius:%.4f memory:%.1f MB\n", name.c_str(), world.photons->stored(),
+                              world.photons->gather_radius(), world.photons->bytes() / (1024.0 * 1024.0));}
+}
+
+
+
+/*
+** Microbenchmarks
+ */
+
+template<typename F>
+static micro_result run_micro(const string& name, uint64_t calls, F&& body){
+    auto begin = std::chrono::steady_clock::now();
+    double acc = 0.0;
+    for (uint64_t i = 0; i < calls; i++){acc += body(i);}
+    bench_sink = bench_sink + acc;
+    return {name, calls, seconds_since(begin)};
+}
+
+static vector<micro_result> run_micro_benchmarks(){
+    vector<micro_result> results;
+    random_seed(1);
+
+    //Random rays around the origin
+    const int RAYS = 1 << 16;
+    vector<ray> rays;
+    for (int i = 0; i < RAYS; i++){rays.push_back(ray(vec3::random(-4, 4), unit_vector(vec3::random(-1, 1))));}
+
+    //Primitives
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    sphere sph(point3(0, 0, 0), 1.0, mat);
+    results.push_back(run_micro("sphere::hit", 1 << 24, [&](uint64_t i){
+        hit_record rec;
+        return sph.hit(rays[i & (RAYS-1)], 0.001, infinity, rec) ? rec.t : 0.0;
+    }));
+    results.push_back(run_micro("sphere::occluded", 1 << 24, [&](uint64_t i){
+        return sph.occluded(rays[i & (RAYS-1)], 0.001, infinity) ? 1.0 : 0.0;
+    }));
+
+    aabb box(point3(-1, -1, -1), point3(1, 1, 1));
+    results.push_back(run_micro("aabb::hit", 1 << 24, [&](uint64_t i){
+        return box.hit(rays[i & (RAYS-1)], 0.001, infinity) ? 1.0 : 0.0;
+    }));
+
+    //BVH traversal over the same random spheres
+    hittable_list list;
+    static_objects statics;
+    for (int i = 0; i < 10000; i++){
+        point3 c = vec3::random(-4, 4);
+        double r = random_double(0.02, 0.1);
+        list.add(make_shared<sphere>(c, r, mat));
+        statics.add(sphere(c, r, mat));
+    }
+    random_seed(5);
+    bvh_node bvh(list);
+    statics.build();
+    results.push_back(run_micro("bvh_node::hit", 1 << 20, [&](uint64_t i){
+        hit_record rec;
+        return bvh.hit(rays[i & (RAYS-1)], 0.001, infinity, rec) ? rec.t : 0.0;
+    }));
+
+    //Same tree with its nodes and spheres packed in an arena, after the heap got fragmented by the first one
+    {
+        arena_scope scope(make_shared<scene_arena>());
+        hittable_list packed;
+        for (const auto& object : list.objects){packed.add(make_arena_shared<sphere>(*static_pointer_cast<sphere>(object)));}
+        random_seed(5);
+        bvh_node packed_bvh(packed);
+        results.push_back(run_micro("bvh_node::hit (arena)", 1 << 20, [&](uint64_t i){
+            hit_record rec;
+            return packed_bvh.hit(rays[i & (RAYS-1)], 0.001, infinity, rec) ? rec.t : 0.0;
+        }));
+    }
+    results.push_back(run_micro("hittable_static::hit", 1 << 20, [&](uint64_t i){
+        hit_record rec;
+        return statics.hit(rays[i & (RAYS-1)], 0.001, infinity, rec) ? rec.t : 0.0;
+    }));
+    results.push_back(run_micro("hittable_static::occluded", 1 << 20, [&](uint64_t i){
+        return statics.occluded(rays[i & (RAYS-1)], 0.001, infinity) ? 1.0 : 0.0;
+    }));
+
+    //Quantized against binary nodes on a scene too big for the caches
+    for (bool quantized : {true, false}){
+        random_seed(2);
+        static_objects large;
+        large.quantized = quantized;
+        for (int i = 0; i < 1000000; i++){large.add(sphere(vec3::random(-4, 4), random_double(0.002, 0.01), mat));}
+        large.build();
+
+        const string name = string("hittable_static::hit 1e6 ") + (quantized ? "(quantized)" : "(binary)");
+        const uint64_t visited = thread_stats.nodes_visited;
+        results.push_back(run_micro(name, 1 << 18, [&](uint64_t i){
+            hit_record rec;
+            return large.hit(rays[i & (RAYS-1)], 0.001, infinity, rec) ? rec.t : 0.0;
+        }));
+        printf("%-36s %8.2f MB nodes", name.c_str(), large.node_bytes() / 1e6);
+#ifdef TRACCIA_STATS
+        const double per_ray = (thread_stats.nodes_visited - visited) / (double)(1 << 18);
+        printf(", %.1f nodes/ray, %.0f node bytes/ray", per_ray, per_ray * large.node_bytes() / large.node_count());
+#else
+        (void)visited;
+#endif
+        printf("\n");
+    }
+
+    //Material scatter on a fixed hit
+    hit_record rec;
+    ray incoming(point3(0, 0, 3), vec3(0.1, -0.2, -1));
+    sph.hit(incoming, 0.001, infinity, rec);
+    vector<pair<string, shared_ptr<material>>> materials = {
+        {"lambertian::scatter", make_shared<lambertian>(color(0.5, 0.5, 0.5))},
+        {"lambertian(noise)::scatter", make_shared<lambertian>(make_shared<texture_noise>(4))},
+        {"metal::scatter", make_shared<metal>(color(0.7, 0.6, 0.5), 0.3)},
+        {"dielectric::scatter", make_shared<dielectric>(1.5)},
+        {"material_isotropic::scatter", make_shared<material_isotropic>(color(0.5, 0.5, 0.5))},
+        {"material_light::scatter", make_shared<material_light>(color(4, 4, 4))},
+    };
+    for (auto& m : materials){
+        results.push_back(run_micro(m.first, 1 << 22, [&](uint64_t i){
+            color attenuation;
+            ray scattered;
+            m.second->scatter(incoming, rec, attenuation, scattered);
+            return attenuation.x() + scattered.direction().x();
+        }));
+    }
+
+    return results;
+}
+
+
+
+
+/*
+** Output
+ */
+
+static void write_json(const string& path, const bench_options& opt, const vector<bench_result>& renders, const vector<micro_result>& micros){
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f){std::cerr << "ERROR: Could not open '" << path << "' for writing.\n"; return;}
+
+    fprintf(f, "{\n  \"width\": %d, \"height\": %d, \"spp\": %d, \"max_depth\": %d,\n", opt.width, opt.height, opt.spp, opt.depth);
+    fprintf(f, "  \"renders\": [\n");
+    for (size_t i = 0; i < renders.size(); i++){
+        const auto& r = renders[i];
+        fprintf(f, "    {\"scene\": \"%s\", \"spheres\": %d, \"threads\": %d, \"build_s\": %.6f, \"render_s\": %.6f, "
+                   "\"rays\": %llu, \"mrays_per_s\": %.4f, \"ns_per_ray\": %.3f, \"peak_mb\": %.1f}%s\n",
+                r.name.c_str(), r.spheres, r.threads, r.build_seconds, r.render_seconds, (unsigned long long)r.rays,
+                r.rays / r.render_seconds * 1e-6, r.render_seconds * 1e9 / r.rays, r.peak_mb, (i+1 < renders.size()) ? "," : "");
+    }
+    fprintf(f, "  ],\n  \"micro\": [\n");
+    for (size_t i = 0; i < micros.size(); i++){
+        const auto& m = micros[i];
+        fprintf(f, "    {\"name\": \"%s\", \"calls\": %llu, \"seconds\": %.6f, \"ns_per_call\": %.3f}%s\n",
+                m.name.c_str(), (unsigned long long)m.calls, m.seconds, m.seconds * 1e9 / m.calls, (i+1 < micros.size()) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    cout << "Results written to '" << path << "'." << endl;
+}
+
+
+
+
+int main(int argc, char* argv[]){
+    TRACE_THREAD_NAME("main");
+    bench_options opt;
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        string next = (i+1 < argc) ? argv[i+1] : "";
+        if      (arg == "--scenes"){opt.scenes = parse_names(next); i++;}
+        else if (arg == "--spheres"){opt.spheres = parse_list(next); i++;}
+        else if (arg == "--threads"){opt.threads = parse_list(next); i++;}
+        else if (arg == "--size"){opt.width = opt.height = atoi(next.c_str()); i++;}
+        else if (arg == "--spp"){opt.spp = atoi(next.c_str()); i++;}
+        else if (arg == "--depth"){opt.depth = atoi(next.c_str()); i++;}
+        else if (arg == "--frames"){opt.frames = atoi(next.c_str()); i++;}
+        else if (arg == "--primary-cache"){opt.primary = atoi(next.c_str()); i++;}
+        else if (arg == "--quality"){opt.quality = atoi(next.c_str()); i++;}
+        else if (arg == "--guide"){opt.guide = true;}
+        else if (arg == "--photons"){opt.photons = atoi(next.c_str()); i++;}
+        else if (arg == "--sampler"){
+            const auto it = std::find(sampler_names, sampler_names + sampler_types, next);
+            if (it == sampler_names + sampler_types){std::cerr << "ERROR: Unknown sampler '" << next << "'.\n"; return 1;}
+            active_sampler = (sampler_type)(it - sampler_names);
+            i++;
+        }
+        else if (arg == "--order"){
+            const auto it = std::find(trace_order_names, trace_order_names + trace_orders, next);
+            if (it == trace_order_names + trace_orders){std::cerr << "ERROR: Unknown trace order '" << next << "'.\n"; return 1;}
+            active_trace_order = (trace_order)(it - trace_order_names);
+            i++;
+        }
+        else if (arg == "--affinity"){
+            const auto it = std::find(thread_affinity_names, thread_affinity_names + thread_affinities, next);
+            if (it == thread_affinity_names + thread_affinities){std::cerr << "ERROR: Unknown affinity '" << next << "'.\n"; return 1;}
+            render_threads.affinity = (thread_affinity)(it - thread_affinity_names);
+            i++;
+        }
+        else if (arg == "--replicate"){render_threads.replicate = true;}
+        else if (arg == "--json"){opt.json_path = next; i++;}
+        else if (arg == "--cost"){opt.cost_path = next; i++;}
+        else if (arg == "--trace"){opt.trace_path = next; i++;}
+        else if (arg == "--denoise"){opt.denoise_path = next; i++;}
+        else if (arg == "--aovs"){opt.aovs = parse_aov_mask(next); i++;}
+        else if (arg == "--exr"){opt.exr_path = next; i++;}
+        else if (arg == "--heap"){opt.arena = false;}
+        else if (arg == "--no-light-sampling"){light_sampling = false;}
+        else if (arg == "--no-micro"){opt.micro = false;}
+        else if (arg == "--micro-only"){opt.render = false;}
+        else{
+            cout << "Usage: benchmark [--scenes random,cornell,textured,noise,volume,smoke,sky,lights,caustics,bouncing] [--spheres 1e3,1e5,...]\n"
+                    "                 [--threads 1,2,4] [--size 256] [--spp 4] [--depth 8] [--json out.json] [--frames 24]\n"
+                    "                 [--sampler random|sobol|halton|blue_noise] [--order depth_first|wavefront|sorted]\n"
+                    "                 [--cost heatmap.png] [--trace trace.json] [--denoise out.png]\n"
+                    "                 [--aovs all|depth,normal,albedo,emission,direct,indirect,object_id,material_id] [--exr out.exr]\n"
+                    "                 [--affinity none|compact|spread] [--replicate] [--no-light-sampling] [--heap]\n"
+                    "                 [--primary-cache 4] [--guide] [--photons 131072] [--quality 256]\n"
+                    "                 [--no-micro] [--micro-only]" << endl;
+            return 1;
+        }
+    }
+
+    //Default thread counts, powers of two up to the machine
+    if (opt.threads.empty()){
+        for (int t = 1; t < omp_get_max_threads(); t *= 2){opt.threads.push_back(t);}
+        opt.threads.push_back(omp_get_max_threads());
+    }
+
+    vector<bench_result> renders;
+    if (opt.render){
+        const cpu_topology& topology = cpu_topology::system();
+        printf("numa nodes:%d cpus:%d affinity:%s%s\n", topology.nodes(), topology.cpus(),
+               thread_affinity_names[render_threads.affinity], render_threads.replicate ? " replicated" : "");
+        for (const auto& name : opt.scenes){
+            //Only the random, bouncing and lights scenes scale with the sphere count
+            vector<int> counts = (name == "random" || name == "bouncing" || name == "lights") ? opt.spheres : vector<int>{0};
+            for (int count : counts){
+                scene* world = new scene();
+                if (!opt.arena){world->arena = nullptr;}
+                camera* cam = nullptr;
+                auto build_begin = std::chrono::steady_clock::now();
+                bool built;
+                {
+                    TRACE_SCOPE("scene build");
+                    built = build_scene(name, count, (double)opt.width / opt.height, world, &cam);
+                }
+                if (!built){
+                    std::cerr << "ERROR: Unknown scene '" << name << "'.\n";
+                    delete world;
+                    continue;
+                }
+                const double build_seconds = seconds_since(build_begin);
+                if (opt.guide){world->guide = make_shared<path_guide>();}
+                if (opt.photons > 0){world->photons = make_shared<photon_map>(); world->photons->photons = opt.photons;}
+                if (render_threads.replicate){replicate_per_node(*world);}
+
+                film pixels(opt.width, opt.height);
+                vector<double> cost(opt.cost_path.empty() ? 0 : opt.width * opt.height);
+                aov_buffers aovs;
+                aovs.resize(opt.width, opt.height, opt.aovs | (opt.denoise_path.empty() ? 0 : aov_denoise));
+                primary_cache primary;
+                primary.subsamples = opt.primary;
+                render_control control;
+                control.primary = opt.primary > 0 ? &primary : nullptr;
+                for (int threads : opt.threads){
+                    render_threads.threads = threads;
+                    apply_thread_config();
+                    pixels.clear();
+                    std::fill(cost.begin(), cost.end(), 0.0);
+                    aovs.clear();
+                    primary.invalidate();
+                    if (world->guide){world->guide->restart();}
+                    if (world->photons){world->photons->restart();}
+                    render_pass = 0;
+                    render_info info = renderScene(pixels, *world, *cam, opt.spp, opt.depth,
+                                                   cost.empty() ? nullptr : cost.data(), aovs.mask ? &aovs : nullptr, &control);
+
+                    bench_result r = {name, count, threads, build_seconds, info.seconds, info.rays, peak_memory_mb()};
+                    printf("%-9s spheres:%-9d threads:%-3d build:%8.3fs render:%8.3fs  %8.3f Mrays/s  %8.1f ns/ray  peak:%8.1f MB\n",
+                           name.c_str(), count, threads, build_seconds, info.seconds, info.rays / info.seconds * 1e-6,
+                           info.seconds * 1e9 / info.rays, r.peak_mb);
+                    renders.push_back(r);
+                }
+
+                //Error against time of progressive passes, with the last thread count
+                if (opt.quality > 0){run_quality_benchmark(opt, name, *world, *cam);}
+
+                //Cost heatmap of the last render, named after the scene
+                const string tag = "_" + name + (count ? "_" + std::to_string(count) : "");
+                if (!cost.empty()){
+                    string path = suffixed(opt.cost_path, tag);
+                    write_cost_heatmap(path.c_str(), cost.data(), opt.width, opt.height);
+                    cout << "Cost heatmap '" << path << "' saved." << endl;
+                }
+
+                //Noisy and denoised versions of the last render
+                vector<double> sums;
+                if (!opt.denoise_path.empty() || !opt.exr_path.empty()){
+                    sums.resize(opt.width * opt.height * 3);
+                    pixels.export_sums(sums.data());
+                }
+                if (!opt.denoise_path.empty()){
+                    denoiser filter;
+                    vector<double> denoised(sums.size());
+                    auto denoise_begin = std::chrono::steady_clock::now();
+                    filter.run(sums.data(), aovs, opt.spp, opt.width, opt.height, denoised.data());
+                    printf("%-9s denoise: %8.3fs\n", name.c_str(), seconds_since(denoise_begin));
+                    write_png(suffixed(opt.denoise_path, tag + "_noisy"), sums.data(), opt.width, opt.height, opt.spp);
+                    write_png(suffixed(opt.denoise_path, tag + "_denoised"), denoised.data(), opt.width, opt.height, 1);
+                }
+
+                //Beauty and every requested output in one file
+                if (!opt.exr_path.empty()){
+                    string path = suffixed(opt.exr_path, tag);
+                    if (write_aovs(path.c_str(), sums.data(), aovs, opt.spp)){cout << "AOVs '" << path << "' saved." << endl;}
+                }
+
+                delete cam;
+                delete world;
+            }
+        }
+    }
+
+    //Bouncing scene animation, once per sphere count
+    if (opt.render && opt.frames > 0){
+        for (int count : opt.spheres){run_animation_benchmark(opt, count);}
+    }
+
+    vector<micro_result> micros;
+    if (opt.micro){
+        micros = run_micro_benchmarks();
+        for (const auto& m : micros){
+            printf("%-36s %10.2f ns/call\n", m.name.c_str(), m.seconds * 1e9 / m.calls);
+        }
+    }
+
+    if (!opt.json_path.empty()){write_json(opt.json_path, opt, renders, micros);}
+    if (!opt.trace_path.empty()){
+#ifdef TRACCIA_TRACE
+        if (trace_dump(opt.trace_path.c_str())){cout << "Trace written to '" << opt.trace_path << "'." << endl;}
+#else
+        std::cerr << "WARNING: Tracing is compiled out, rebuild with TRACE=1.\n";
+#endif
+    }
+    return 0;
+}
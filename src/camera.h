@@ -25,7 +25,9 @@ class camera{
     }
 
     ray get_ray(double s, double t) const{
-        vec3 rd = lens_radius * random_in_unit_disk();
+        double lu, lv;
+        sample_2d(lu, lv);
+        vec3 rd = lens_radius * warp_disk(lu, lv);
         vec3 offset = u * rd.x() + v * rd.y();
         return ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset);
     }
@@ -39,4 +41,39 @@ class camera{
     double lens_radius;
 };
 
+
+
+
+/*
+** Camera pose
+**
+** Position plus yaw/pitch around the world up, what the interactive navigation edits.
+** A yaw of 0 looks towards -z.
+ */
+
+struct camera_pose{
+    point3 position;
+    double yaw = 0.0;
+    double pitch = 0.0;
+
+    static camera_pose looking_at(const point3& from, const point3& at){
+        const vec3 d = unit_vector(at - from);
+        camera_pose pose;
+        pose.position = from;
+        pose.pitch = asin(clamp(d.y(), -1.0, 1.0));
+        pose.yaw = atan2(d.x(), -d.z());
+        return pose;
+    }
+
+    vec3 forward() const {return vec3(sin(yaw)*cos(pitch), sin(pitch), -cos(yaw)*cos(pitch));}
+    vec3 right() const {return vec3(cos(yaw), 0, sin(yaw));}
+    point3 target() const {return position + forward();}
+
+    ///Turns by the given angles in radians, pitch stays short of straight up/down
+    void rotate(double d_yaw, double d_pitch){
+        yaw += d_yaw;
+        pitch = clamp(pitch + d_pitch, -1.55, 1.55);
+    }
+};
+
 #endif // __CAMERA_H_
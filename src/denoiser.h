@@ -0,0 +1,183 @@
+#ifndef __DENOISER_H_
+#define __DENOISER_H_
+
+#include <vector>
+#include <math.h>
+
+//Include OpemMP for multithreading
+#include <omp.h>
+
+#include "renderer.h"
+
+
+/*
+** Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010)
+**
+** The noisy color is divided by the first hit albedo so only the illumination gets blurred,
+** then filtered with a 5x5 B3 spline kernel whose taps are spread 1, 2, 4, ... pixels apart.
+** Each tap is weighted by how similar its luminance (relative to the local standard deviation,
+** as in SVGF), normal, depth and albedo are to the center.
+** Buffers are planar floats so the inner loop over a row vectorizes.
+ */
+
+struct denoise_settings{
+    int iterations = 5;
+    float sigma_color = 4.0f;    //In local standard deviations of the compressed luminance
+    float sigma_normal = 0.3f;
+    float sigma_depth = 0.05f;   //Relative to the center depth
+    float sigma_albedo = 0.15f;
+};
+
+
+class denoiser{
+  public:
+    ///Filters the accumulated color (sums over samples) into out, an averaged rgb buffer of the same layout,
+    ///aovs must hold the aov_denoise layers
+    void run(const double* color_acc, const aov_buffers& aovs, int samples, int width, int height, double* out, const denoise_settings& settings = denoise_settings());
+
+  private:
+    int w = 0, h = 0;
+    std::vector<float> illum[3], next[3];
+    std::vector<float> luminance, deviation;
+    std::vector<float> albedo[3], normal[3], depth;
+
+    void resize(int width, int height);
+    void filter_pass(int step, const denoise_settings& settings);
+};
+
+
+void denoiser::resize(int width, int height){
+    if (width == w && height == h) return;
+    w = width; h = height;
+    const size_t n = (size_t)w * h;
+    for (int c=0; c<3; c++){
+        illum[c].assign(n, 0.0f); next[c].assign(n, 0.0f);
+        albedo[c].assign(n, 0.0f); normal[c].assign(n, 0.0f);
+    }
+    luminance.assign(n, 0.0f); deviation.assign(n, 0.0f);
+    depth.assign(n, 0.0f);
+}
+
+
+void denoiser::run(const double* color_acc, const aov_buffers& aovs, int samples, int width, int height, double* out, const denoise_settings& settings){
+    TRACE_SCOPE("denoise");
+    resize(width, height);
+    const int n = w * h;
+    const double inv = 1.0 / (samples > 0 ? samples : 1);
+    const float eps = 1e-3f;
+    const double* in_albedo = aovs.get(aov_albedo);
+    const double* in_normal = aovs.get(aov_normal);
+    const double* in_depth = aovs.get(aov_depth);
+
+    //Average the sums and demodulate the albedo
+    #pragma omp parallel for
+    for (int p=0; p<n; p++){
+        for (int c=0; c<3; c++){
+            albedo[c][p] = (float)(in_albedo[p*3+c] * inv);
+            normal[c][p] = (float)(in_normal[p*3+c] * inv);
+            illum[c][p] = (float)(color_acc[p*3+c] * inv) / (albedo[c][p] + eps);
+        }
+        depth[p] = (float)(in_depth[p] * inv);
+    }
+
+    //Wavelet passes, the color tolerance follows the noise left after each one
+    for (int i=0; i<settings.iterations; i++){filter_pass(1 << i, settings);}
+
+    //Put the albedo back
+    #pragma omp parallel for
+    for (int p=0; p<n; p++){
+        for (int c=0; c<3; c++){out[p*3+c] = illum[c][p] * (albedo[c][p] + eps);}
+    }
+}
+
+
+void denoiser::filter_pass(int step, const denoise_settings& settings){
+    const int n = w * h;
+    static const float kernel[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+    const float inv_normal = 1.0f / (settings.sigma_normal * settings.sigma_normal);
+    const float inv_albedo = 1.0f / (settings.sigma_albedo * settings.sigma_albedo);
+    const float inv_depth = 1.0f / settings.sigma_depth;
+
+    //Edge stopping on compressed luminance, so bright lights don't swallow every other difference
+    #pragma omp parallel for
+    for (int p=0; p<n; p++){
+        const float l = 0.2126f*illum[0][p] + 0.7152f*illum[1][p] + 0.0722f*illum[2][p];
+        luminance[p] = l / (1.0f + l);
+    }
+
+    //Standard deviation of the luminance in a 3x3 window, scaled by the color sigma
+    #pragma omp parallel for
+    for (int y=0; y<h; y++){
+        for (int x=0; x<w; x++){
+            float sum = 0.0f, sum2 = 0.0f;
+            for (int dy=-1; dy<=1; dy++){
+                for (int dx=-1; dx<=1; dx++){
+                    const float l = luminance[std::min(std::max(y+dy, 0), h-1)*w + std::min(std::max(x+dx, 0), w-1)];
+                    sum += l; sum2 += l*l;
+                }
+            }
+            const float mean = sum / 9.0f;
+            deviation[y*w+x] = 1.0f / (settings.sigma_color * sqrtf(fmaxf(sum2 / 9.0f - mean*mean, 0.0f)) + 1e-4f);
+        }
+    }
+
+    #pragma omp parallel
+    {
+        std::vector<float> sum_r(w), sum_g(w), sum_b(w), sum_w(w);
+
+        #pragma omp for
+        for (int y=0; y<h; y++){
+            std::fill(sum_r.begin(), sum_r.end(), 0.0f); std::fill(sum_g.begin(), sum_g.end(), 0.0f);
+            std::fill(sum_b.begin(), sum_b.end(), 0.0f); std::fill(sum_w.begin(), sum_w.end(), 0.0f);
+            const int row = y * w;
+
+            for (int ky=-2; ky<=2; ky++){
+                const int yy = std::min(std::max(y + ky*step, 0), h-1);
+                const int tap_row = yy * w;
+
+                for (int kx=-2; kx<=2; kx++){
+                    const float hk = kernel[ky+2] * kernel[kx+2];
+                    const int dx = kx * step;
+
+                    #pragma omp simd
+                    for (int x=0; x<w; x++){
+                        const int p = row + x;
+                        const int q = tap_row + std::min(std::max(x + dx, 0), w-1);
+
+                        const float dl = fabsf(luminance[p] - luminance[q]);
+                        const float nx = normal[0][p] - normal[0][q];
+                        const float ny = normal[1][p] - normal[1][q];
+                        const float nz = normal[2][p] - normal[2][q];
+                        const float ar = albedo[0][p] - albedo[0][q];
+                        const float ag = albedo[1][p] - albedo[1][q];
+                        const float ab = albedo[2][p] - albedo[2][q];
+                        const float dd = fabsf(depth[p] - depth[q]) / (depth[p] + 1e-3f);
+
+                        const float e = dl * deviation[p] + (nx*nx + ny*ny + nz*nz) * inv_normal
+                                      + (ar*ar + ag*ag + ab*ab) * inv_albedo + dd * inv_depth;
+                        const float wgt = hk * expf(-e);
+
+                        sum_r[x] += wgt * illum[0][q];
+                        sum_g[x] += wgt * illum[1][q];
+                        sum_b[x] += wgt * illum[2][q];
+                        sum_w[x] += wgt;
+                    }
+                }
+            }
+
+            //The center tap always has a positive weight
+            for (int x=0; x<w; x++){
+                const float inv = 1.0f / sum_w[x];
+                next[0][row+x] = sum_r[x] * inv;
+                next[1][row+x] = sum_g[x] * inv;
+                next[2][row+x] = sum_b[x] * inv;
+            }
+        }
+    }
+
+    for (int c=0; c<3; c++){illum[c].swap(next[c]);}
+}
+
+
+
+#endif // __DENOISER_H_
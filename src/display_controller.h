@@ -9,12 +9,26 @@
 #include <SDL2/SDL.h>
 #endif
 
+#include <atomic>
+#include <string.h>
+
+#include "camera.h"
+#include "render_resolve.h"
+
 
 
 
 const int SCREEN_FPS = 30;
 const int SCREEN_TICKS_PER_FRAME = 1000/SCREEN_FPS;
 
+//Camera navigation speeds, units and radians per second (degrees per pixel for the mouse)
+const double CAMERA_MOVE_SPEED = 2.0;
+const double CAMERA_TURN_SPEED = 1.0;
+const double CAMERA_MOUSE_DEGREES = 0.2;
+
+//Exposure change per second while -/= are held, in stops
+const double EXPOSURE_SPEED = 2.0;
+
 
 class Scene;
 
@@ -36,16 +50,27 @@ class DisplayController{
 
         //Features
         uint32_t* getPixelDataPtr();
+        bool denoiseEnabled() const {return _denoise.load(std::memory_order_relaxed);}
+        const resolve_settings& getResolveSettings() const {return _resolve;}
+        bool consumeResolveChanged(){bool changed = _resolveChanged; _resolveChanged = false; return changed;}
+
+        //Camera navigation
+        void setCameraPose(const camera_pose& pose){_cameraPose = pose;}
+        const camera_pose& getCameraPose() const {return _cameraPose;}
+        bool consumeCameraMoved(){bool moved = _cameraMoved; _cameraMoved = false; return moved;}
+        bool navigationPending(const uint8_t* keyStates) const;
 
         //Input events
         //void keyPressed(const KeyCode k);
         void onKeyDown(const uint8_t* keyStates);
+        void onMouseMove(int dx, int dy);
         //void onMousePress(const MouseButtonEvent& button);
         //void onScrollWheel(float offset);
         //point2 getMouseScreenPosition();
 
         //Rendering Events
         void draw();
+        void draw(int firstRow, int rowCount);
         void drawImGui();
         void beginFrame();
         void endFrame();
@@ -60,6 +85,16 @@ class DisplayController{
 
         int _res_width;
         int _res_height;
+
+        std::atomic<bool> _denoise{false};   //Read by the render worker
+
+        resolve_settings _resolve;
+        bool _resolveChanged = false;
+
+        camera_pose _cameraPose;
+        bool _cameraMoved = false;
+        Uint32 _lastTicks = 0;
+        double _frameSeconds = 0.0;
 };
 
 
@@ -84,7 +119,7 @@ void DisplayController::init(int w, int h){
 
 
     _renderer = SDL_CreateRenderer(_window, 0, 0);
-    _renderTexture = SDL_CreateTexture(_renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STATIC, _res_width, _res_height);
+    _renderTexture = SDL_CreateTexture(_renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, _res_width, _res_height);
 
     _pixelData = new uint32_t[_res_width*_res_height];
 
@@ -94,6 +129,10 @@ void DisplayController::init(int w, int h){
 }
 
 void DisplayController::update(){
+    //Time since the last update, movement is scaled by it and capped so a slow pass doesn't teleport the camera
+    const Uint32 now = SDL_GetTicks();
+    _frameSeconds = _lastTicks ? fmin((now - _lastTicks) / 1000.0, 0.1) : 0.0;
+    _lastTicks = now;
 }
 
 void DisplayController::close(){
@@ -119,7 +158,60 @@ uint32_t* DisplayController::getPixelDataPtr(){
 */
 
 void DisplayController::onKeyDown(const uint8_t *keyStates){
+    //N shows the denoised image, B goes back to the raw accumulation
+    if (keyStates[SDL_SCANCODE_N]){_denoise = true;}
+    if (keyStates[SDL_SCANCODE_B]){_denoise = false;}
+
+    //1-3 pick the tonemap operator, 4/5 gamma 2 or sRGB output, -/= change the exposure, 0 resets it
+    resolve_settings resolve = _resolve;
+    if (keyStates[SDL_SCANCODE_1]){resolve.tonemap = tonemap_clamp;}
+    if (keyStates[SDL_SCANCODE_2]){resolve.tonemap = tonemap_reinhard;}
+    if (keyStates[SDL_SCANCODE_3]){resolve.tonemap = tonemap_aces;}
+    if (keyStates[SDL_SCANCODE_4]){resolve.transfer = transfer_gamma2;}
+    if (keyStates[SDL_SCANCODE_5]){resolve.transfer = transfer_srgb;}
+    if (keyStates[SDL_SCANCODE_MINUS]){resolve.exposure -= EXPOSURE_SPEED * _frameSeconds;}
+    if (keyStates[SDL_SCANCODE_EQUALS]){resolve.exposure += EXPOSURE_SPEED * _frameSeconds;}
+    if (keyStates[SDL_SCANCODE_0]){resolve.exposure = 0.0;}
+    if (resolve.tonemap != _resolve.tonemap || resolve.transfer != _resolve.transfer || resolve.exposure != _resolve.exposure){
+        _resolve = resolve;
+        _resolveChanged = true;
+    }
 
+    //WASD to move, Q/E down and up, arrows to look around, shift to go faster
+    const double move = CAMERA_MOVE_SPEED * _frameSeconds * (keyStates[SDL_SCANCODE_LSHIFT] ? 4.0 : 1.0);
+    const double turn = CAMERA_TURN_SPEED * _frameSeconds;
+    vec3 dir(0,0,0);
+    if (keyStates[SDL_SCANCODE_W]){dir += _cameraPose.forward();}
+    if (keyStates[SDL_SCANCODE_S]){dir += -_cameraPose.forward();}
+    if (keyStates[SDL_SCANCODE_D]){dir += _cameraPose.right();}
+    if (keyStates[SDL_SCANCODE_A]){dir += -_cameraPose.right();}
+    if (keyStates[SDL_SCANCODE_E]){dir += vec3(0,1,0);}
+    if (keyStates[SDL_SCANCODE_Q]){dir += -vec3(0,1,0);}
+    double yaw = 0.0, pitch = 0.0;
+    if (keyStates[SDL_SCANCODE_RIGHT]){yaw += turn;}
+    if (keyStates[SDL_SCANCODE_LEFT]){yaw -= turn;}
+    if (keyStates[SDL_SCANCODE_UP]){pitch += turn;}
+    if (keyStates[SDL_SCANCODE_DOWN]){pitch -= turn;}
+
+    if (navigationPending(keyStates)){
+        _cameraPose.position += move * dir;
+        _cameraPose.rotate(yaw, pitch);
+        _cameraMoved = true;
+    }
+}
+
+///Right mouse drag looks around
+void DisplayController::onMouseMove(int dx, int dy){
+    _cameraPose.rotate(deg_to_rad(dx * CAMERA_MOUSE_DEGREES), deg_to_rad(-dy * CAMERA_MOUSE_DEGREES));
+    _cameraMoved = true;
+}
+
+///True while any navigation key is held
+bool DisplayController::navigationPending(const uint8_t* keyStates) const{
+    static const int keys[] = {SDL_SCANCODE_W, SDL_SCANCODE_A, SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Q, SDL_SCANCODE_E,
+                               SDL_SCANCODE_LEFT, SDL_SCANCODE_RIGHT, SDL_SCANCODE_UP, SDL_SCANCODE_DOWN};
+    for (int k : keys){if (keyStates[k]) return true;}
+    return false;
 }
 
 
@@ -131,7 +223,22 @@ void DisplayController::onKeyDown(const uint8_t *keyStates){
  */
 
 void DisplayController::draw(){
-    SDL_UpdateTexture(_renderTexture, NULL, _pixelData, _res_width*sizeof(uint32_t));
+    draw(0, _res_height);
+}
+
+///Uploads only rows [firstRow, firstRow+rowCount) of the pixel data, then presents the whole texture
+void DisplayController::draw(int firstRow, int rowCount){
+    if (rowCount > 0){
+        SDL_Rect rect = {0, firstRow, _res_width, rowCount};
+        void* texels;
+        int pitch;
+        if (SDL_LockTexture(_renderTexture, &rect, &texels, &pitch) == 0){
+            for (int j=0; j<rowCount; j++){
+                memcpy((uint8_t*)texels + j*pitch, _pixelData + (firstRow+j)*_res_width, _res_width*sizeof(uint32_t));
+            }
+            SDL_UnlockTexture(_renderTexture);
+        }
+    }
 
     SDL_RenderClear(_renderer);
     SDL_RenderCopyEx(_renderer, _renderTexture, NULL, NULL, 0, NULL, SDL_FLIP_VERTICAL);
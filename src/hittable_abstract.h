@@ -18,17 +18,18 @@ class material;
 struct hit_record{
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
+    const material* mat_ptr;    //Owned by the hit object, copying a record never touches a refcount
     double t;
     double u,v;
     bool front_face;
+    uint32_t object_id;
 
     inline void set_face_normal(const ray& r, const vec3& n){
         this->front_face = dot(r.direction(), n) < 0;
         this->normal = this->front_face ? n : -n;
     }
 
-    inline void write_data(const ray& r, double t, const point3& point, const vec3& outward_normal, shared_ptr<material> material, double u, double v){
+    inline void write_data(const ray& r, double t, const point3& point, const vec3& outward_normal, const material* material, double u, double v){
         //Set point and time
         this->p = point;
         this->t = t;
@@ -52,17 +53,103 @@ inline std::ostream& operator<<(std::ostream &out, const hit_record& r) {
 
 
 
+/*
+** Ray intervals
+ */
+
+///Disjoint [enter, exit] spans of a ray inside closed objects, sorted by t
+struct interval_list{
+    static const int capacity = 8;
+    double enter[capacity];
+    double exit[capacity];
+    int count = 0;
+
+    inline void clear(){count = 0;}
+    inline void add(double t0, double t1);
+};
+
+
+///Adds a span merging the ones it overlaps, when full the closest span grows to cover it
+inline void interval_list::add(double t0, double t1){
+    if (t1 <= t0) return;
+
+    //Spans [first, last) overlap the new one
+    int first = 0;
+    while (first < count && exit[first] < t0){first++;}
+    int last = first;
+    while (last < count && enter[last] <= t1){t0 = fmin(t0, enter[last]); t1 = fmax(t1, exit[last]); last++;}
+
+    if (first == last && count == capacity){
+        if (first == count){exit[count-1] = t1;}
+        else {enter[first] = t0;}
+        return;
+    }
+
+    //Replace them with the merged span
+    const int shift = 1 - (last - first);
+    if (shift > 0){for (int i=count-1; i>=last; i--){enter[i+shift] = enter[i]; exit[i+shift] = exit[i];}}
+    else if (shift < 0){for (int i=last; i<count; i++){enter[i+shift] = enter[i]; exit[i+shift] = exit[i];}}
+    enter[first] = t0;
+    exit[first] = t1;
+    count += shift;
+}
+
+
+
+
 /*
 ** Hittable abstract class
  */
 
+///Ids in creation order, so they are stable across runs of the same scene
+inline std::atomic<uint32_t> next_object_id(1);
+
 class hittable{
   public:
+    //Written into the hit record by primitives, copies keep the id of the original
+    uint32_t object_id = next_object_id++;
+
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
     virtual bool bounding_box(aabb& output_box) const = 0;
+
+    ///Any hit in [t_min, t_max], stops at the first one and never writes surface data.
+    ///The default pays for a full hit(), every primitive and container overrides it
+    virtual bool occluded(const ray& r, double t_min, double t_max) const {hit_record rec; return hit(r, t_min, t_max, rec);}
+
+    ///Fraction of light that crosses [t_min, t_max]. Surfaces block all of it or none, so the default
+    ///is occluded(), participating media and the containers that can hold them override it
+    virtual double transmittance(const ray& r, double t_min, double t_max) const {return occluded(r, t_min, t_max) ? 0.0 : 1.0;}
+
+    ///Adds the spans of [t_min, t_max] inside the object to out, returns true if there were any.
+    ///The default walks the crossings with hit(), front faces enter and back faces exit,
+    ///primitives and containers override it to find every span in one traversal
+    virtual bool intervals(const ray& r, double t_min, double t_max, interval_list& out) const;
+
+    ///True when hit() draws random numbers (participating media), the same ray can hit elsewhere next time
+    virtual bool random_hits() const {return false;}
 };
 
 
+bool hittable::intervals(const ray& r, double t_min, double t_max, interval_list& out) const{
+    const int max_crossings = 2 * interval_list::capacity;
+    hit_record rec;
+    double t = t_min, entered = t_min;
+    bool inside = false, found = false;
+
+    int crossings = 0;
+    for (; crossings<max_crossings && hit(r, t, t_max, rec); crossings++){
+        if (rec.front_face){entered = rec.t; inside = true;}
+        else {out.add(inside ? entered : (crossings == 0 ? t_min : rec.t), rec.t); found = true; inside = false;}
+        t = rec.t + 0.0001;
+    }
+
+    //Open at the end of the segment, or the whole segment is inside when the next crossing leaves
+    if (inside){out.add(entered, t_max); found = true;}
+    else if (crossings == 0 && hit(r, t_max, infinity, rec) && !rec.front_face){out.add(t_min, t_max); found = true;}
+    return found;
+}
+
+
 
 
 
@@ -83,6 +170,12 @@ class hittable_list : public hittable{
     //Hittable methods
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+    virtual bool intervals(const ray& r, double t_min, double t_max, interval_list& out) const override;
+    virtual bool random_hits() const override{
+        return std::any_of(objects.begin(), objects.end(), [](const shared_ptr<hittable>& o){return o->random_hits();});
+    }
 
   public:
     vector<shared_ptr<hittable>> objects;
@@ -107,6 +200,34 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 }
 
 
+///Any hit check for hittable lists
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+    for (const auto& object : objects){
+        if (object->occluded(r, t_min, t_max)) return true;
+    }
+    return false;
+}
+
+
+///Product of the objects' transmittances, stops at the first one that blocks
+double hittable_list::transmittance(const ray& r, double t_min, double t_max) const {
+    double transmitted = 1.0;
+    for (const auto& object : objects){
+        transmitted *= object->transmittance(r, t_min, t_max);
+        if (transmitted <= 0.0) return 0.0;
+    }
+    return transmitted;
+}
+
+
+///Union of the spans of every object
+bool hittable_list::intervals(const ray& r, double t_min, double t_max, interval_list& out) const{
+    bool found = false;
+    for (const auto& object : objects){found |= object->intervals(r, t_min, t_max, out);}
+    return found;
+}
+
+
 ///Bounding box for hittable list
 bool hittable_list::bounding_box(aabb &output_box) const{
     if (objects.empty()) return false;
@@ -139,33 +260,75 @@ bool hittable_list::bounding_box(aabb &output_box) const{
 class bvh_node : public hittable{
   public:
     //Constructors
-    bvh_node();
+    bvh_node() {}
     bvh_node(const hittable_list& list) : bvh_node(list.objects, 0, list.objects.size()) {}
     bvh_node(const vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end);
 
     //Hittable methods
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+    virtual bool intervals(const ray& r, double t_min, double t_max, interval_list& out) const override;
+    virtual bool random_hits() const override {return left->random_hits() || right->random_hits();}
 
   public:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
     aabb box;
+
+  private:
+    void build(vector<shared_ptr<hittable>>& objects, size_t start, size_t end);
 };
 
 
 ///Hit check for BVH
 bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     //Check first if the ray hit the bounding box
+    STAT_INC(nodes_visited);
+    STAT_INC(box_tests);
     if (!box.hit(r, t_min, t_max)) return false;
 
     //Check wether the ray hits the left node or right node
     bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = left->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
     return hit_left || hit_right;
 }
 
 
+///Any hit check for BVH
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+    STAT_INC(nodes_visited);
+    STAT_INC(box_tests);
+    if (!box.hit(r, t_min, t_max)) return false;
+    return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
+}
+
+
+///Transmittance through both children, a single leaf is stored on both sides
+double bvh_node::transmittance(const ray& r, double t_min, double t_max) const {
+    STAT_INC(nodes_visited);
+    STAT_INC(box_tests);
+    if (!box.hit(r, t_min, t_max)) return 1.0;
+
+    const double transmitted = left->transmittance(r, t_min, t_max);
+    if (transmitted <= 0.0 || right == left) return transmitted;
+    return transmitted * right->transmittance(r, t_min, t_max);
+}
+
+
+///Spans of both children, a single leaf is stored on both sides
+bool bvh_node::intervals(const ray& r, double t_min, double t_max, interval_list& out) const{
+    STAT_INC(nodes_visited);
+    STAT_INC(box_tests);
+    if (!box.hit(r, t_min, t_max)) return false;
+
+    bool found = left->intervals(r, t_min, t_max, out);
+    if (right != left){found |= right->intervals(r, t_min, t_max, out);}
+    return found;
+}
+
+
 ///Bounding box for BVH
 bool bvh_node::bounding_box(aabb &output_box) const{
     output_box = box;
@@ -183,9 +346,15 @@ bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b)
 
 ///BVH Constructor
 bvh_node::bvh_node(const vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end){
-    //Create a modifiable version of the src objects
+    TRACE_SCOPE("bvh_node build");
+
+    //Create a modifiable version of the src objects, shared by the whole recursion
     auto objects = src_objects;
+    build(objects, start, end);
+}
 
+///Recursive BVH build, sorts the objects span in place
+void bvh_node::build(vector<shared_ptr<hittable>>& objects, size_t start, size_t end){
     int axis = random_int(0,2);
     auto comparator = (axis == 0) ? box_x_compare : ((axis == 1) ? box_y_compare : box_z_compare);
     size_t object_span = end - start;
@@ -200,8 +369,12 @@ bvh_node::bvh_node(const vector<shared_ptr<hittable>>& src_objects, size_t start
         //Sort the objects and recursively create other BVH nodes
         std::sort(objects.begin()+start, objects.begin()+end, comparator);
         auto mid = start + object_span/2;
-        left  = make_shared<bvh_node>(objects, start, mid);
-        right = make_shared<bvh_node>(objects, mid, end);
+        auto left_node  = make_arena_shared<bvh_node>();
+        auto right_node = make_arena_shared<bvh_node>();
+        left_node->build(objects, start, mid);
+        right_node->build(objects, mid, end);
+        left = left_node;
+        right = right_node;
     }
 
     //Check that both leaves have a valid bounding box
@@ -0,0 +1,113 @@
+#ifndef __HITTABLE_BOX_H_
+#define __HITTABLE_BOX_H_
+
+
+#include "hittable_abstract.h"
+#include "utils.h"
+
+class material;
+
+class hittable_box : public hittable{
+  public:
+    //Constructors
+    hittable_box() {}
+    hittable_box(const point3& p0, const point3& p1, shared_ptr<material> m) : box_min(p0), box_max(p1), mat_ptr(m) {};
+
+    //Hittable methods
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual bool intervals(const ray& r, double t_min, double t_max, interval_list& out) const override;
+
+  private:
+    point3 box_min, box_max;
+    shared_ptr<material> mat_ptr;
+
+    inline bool slabs(const ray& r, double& t_enter, double& t_exit, int& axis_enter, int& axis_exit) const;
+};
+
+
+///Entry and exit of the infinite line through the box, with the axis of the face crossed at each
+inline bool hittable_box::slabs(const ray& r, double& t_enter, double& t_exit, int& axis_enter, int& axis_exit) const {
+    t_enter = -infinity; t_exit = infinity;
+    axis_enter = axis_exit = 0;
+    for (int a=0; a<3; a++){
+        const double inv = 1.0 / r.direction()[a];
+        double t0 = (box_min[a] - r.origin()[a]) * inv;
+        double t1 = (box_max[a] - r.origin()[a]) * inv;
+        if (inv < 0.0) std::swap(t0, t1);
+        if (t0 > t_enter){t_enter = t0; axis_enter = a;}
+        if (t1 < t_exit){t_exit = t1; axis_exit = a;}
+    }
+    return t_enter < t_exit;
+}
+
+
+bool hittable_box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    STAT_PRIM(stat_prim_box);
+    double t_enter, t_exit;
+    int axis_enter, axis_exit;
+    if (!slabs(r, t_enter, t_exit, axis_enter, axis_exit)) return false;
+
+    //Nearest face in range, the far one when the ray starts inside
+    double t = t_enter;
+    int a = axis_enter;
+    if (t < t_min || t_max < t){
+        t = t_exit; a = axis_exit;
+        if (t < t_min || t_max < t) return false;
+    }
+
+    //Outward normal of the crossed face, uv across the other two axes
+    point3 p = r.at(t);
+    vec3 normal(0,0,0);
+    normal[a] = (p[a] - box_min[a] < box_max[a] - p[a]) ? -1.0 : 1.0;
+    const int a1 = (a + 1) % 3, a2 = (a + 2) % 3;
+    const double u = (p[a1] - box_min[a1]) / (box_max[a1] - box_min[a1]);
+    const double v = (p[a2] - box_min[a2]) / (box_max[a2] - box_min[a2]);
+    rec.write_data(r, t, p, normal, mat_ptr.get(), u, v);
+    rec.object_id = object_id;
+    return true;
+}
+
+
+///Either face in range
+bool hittable_box::occluded(const ray& r, double t_min, double t_max) const {
+    STAT_PRIM(stat_prim_box);
+    double t_enter, t_exit;
+    int axis_enter, axis_exit;
+    if (!slabs(r, t_enter, t_exit, axis_enter, axis_exit)) return false;
+    return (t_min <= t_enter && t_enter <= t_max) || (t_min <= t_exit && t_exit <= t_max);
+}
+
+
+///The slab span clipped to the segment
+bool hittable_box::intervals(const ray& r, double t_min, double t_max, interval_list& out) const {
+    STAT_PRIM(stat_prim_box);
+    double t_enter, t_exit;
+    int axis_enter, axis_exit;
+    if (!slabs(r, t_enter, t_exit, axis_enter, axis_exit)) return false;
+
+    t_enter = fmax(t_enter, t_min);
+    t_exit = fmin(t_exit, t_max);
+    if (t_exit <= t_enter) return false;
+    out.add(t_enter, t_exit);
+    return true;
+}
+
+
+///Bounding box for box
+bool hittable_box::bounding_box(aabb &output_box) const{
+    output_box = aabb(box_min, box_max);
+    return true;
+}
+
+
+
+
+
+
+
+
+
+
+#endif // __HITTABLE_BOX_H_
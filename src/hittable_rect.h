@@ -29,6 +29,16 @@ class hittable_rect : public hittable{
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(aabb& output_box) const override;
 
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+    //Rects have no inside
+    virtual bool intervals(const ray& r, double t_min, double t_max, interval_list& out) const override {return false;}
+
+    //Animation, moves the rect keeping its size and axis
+    point3 get_corner() const {return a;}
+    point3 get_opposite_corner() const {return b;}
+    void set_corner(const point3& corner){b = corner + (b - a); a = corner;}
+    const material* get_material() const {return mat_ptr.get();}
 
   private:
     point3 a, b;
@@ -41,6 +51,7 @@ class hittable_rect : public hittable{
 
 
 bool hittable_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    STAT_PRIM(stat_prim_rect);
     //Check if ray interesct rect between the aligned axis
     double k = a[ax_k];
     auto t = (k - r.origin()[ax_k]) / r.direction()[ax_k];
@@ -55,11 +66,24 @@ bool hittable_rect::hit(const ray& r, double t_min, double t_max, hit_record& re
     double u = (v1 - a[ax_1])/(b[ax_1]-a[ax_1]);
     double v = (v2 - a[ax_2])/(b[ax_2]-a[ax_2]);
     vec3 normal = vec3((int)(ax == axis_yz), (int)(ax == axis_xz), (int)(ax == axis_xy));
-    rec.write_data(r, t, r.at(t), normal, this->mat_ptr, u, v);
+    rec.write_data(r, t, r.at(t), normal, this->mat_ptr.get(), u, v);
+    rec.object_id = object_id;
     return true;
 }
 
 
+///Plane crossing inside the rect, without the record
+bool hittable_rect::occluded(const ray& r, double t_min, double t_max) const {
+    STAT_PRIM(stat_prim_rect);
+    auto t = (a[ax_k] - r.origin()[ax_k]) / r.direction()[ax_k];
+    if (t < t_min || t > t_max) return false;
+
+    auto v1 = r.origin()[ax_1] + t*r.direction()[ax_1];
+    auto v2 = r.origin()[ax_2] + t*r.direction()[ax_2];
+    return !(v1 < a[ax_1] || v1 > b[ax_1] || v2 < a[ax_2] || v2 > b[ax_2]);
+}
+
+
 ///Bounding box for sphere
 bool hittable_rect::bounding_box(aabb &output_box) const{
     const vec3 epsilon = vec3(0.0001, 0.0001, 0.0001);
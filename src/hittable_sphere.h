@@ -16,6 +16,15 @@ class sphere : public hittable{
     //Hittable methods
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual bool intervals(const ray& r, double t_min, double t_max, interval_list& out) const override;
+
+    //Animation
+    point3 get_center() const {return center;}
+    void set_center(const point3& c){center = c;}
+    double get_radius() const {return radius;}
+    void set_radius(double r){radius = r;}
+    const material* get_material() const {return mat_ptr.get();}
 
     //Utilites
     static uv get_sphere_uv(const point3& p){
@@ -32,6 +41,7 @@ class sphere : public hittable{
 
 
 bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    STAT_PRIM(stat_prim_sphere);
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -53,8 +63,46 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     point3 p = r.at(root);
     point3 normal = (p-center)/radius;
     uv coords = get_sphere_uv(normal);
-    rec.write_data(r, root, p, normal, mat_ptr, coords.u, coords.v);
+    rec.write_data(r, root, p, normal, mat_ptr.get(), coords.u, coords.v);
+    rec.object_id = object_id;
+
+    return true;
+}
+
+
+///Any root in range, without the uv and the record
+bool sphere::occluded(const ray& r, double t_min, double t_max) const {
+    STAT_PRIM(stat_prim_sphere);
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius*radius;
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    auto root = (-half_b - sqrtd) / a;
+    if (t_min <= root && root <= t_max) return true;
+    root = (-half_b + sqrtd) / a;
+    return t_min <= root && root <= t_max;
+}
+
+
+///Both roots at once, the span between them clipped to the segment
+bool sphere::intervals(const ray& r, double t_min, double t_max, interval_list& out) const {
+    STAT_PRIM(stat_prim_sphere);
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius*radius;
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
 
+    const double t0 = fmax((-half_b - sqrtd) / a, t_min);
+    const double t1 = fmin((-half_b + sqrtd) / a, t_max);
+    if (t1 <= t0) return false;
+    out.add(t0, t1);
     return true;
 }
 
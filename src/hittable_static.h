@@ -0,0 +1,546 @@
+#ifndef __HITTABLE_STATIC_H_
+#define __HITTABLE_STATIC_H_
+
+#include <tuple>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+#include "hittable_abstract.h"
+#include "utils.h"
+
+
+/*
+** Statically typed hittable container
+**
+** Primitives are stored by value in one array per type and indexed by a flat BVH.
+** Leaves dispatch on the type index at compile time and call T::hit non virtually,
+** so the intersection code of every primitive type gets inlined in the traversal loop.
+**
+** Primitives can be edited in place through get() once the scene is built, update() then refits
+** the node bounds in O(n) and only rebuilds when the tree got too loose (see rebuild_ratio).
+**
+** The tree is built binary, then (unless quantized is off) collapsed into 4-wide quantized_nodes:
+** one 64 byte cache line holding the bounds of four children in 8 bit steps of their parent box,
+** against 56 bytes per child of the binary nodes. Leaves are stored in their parent's slots.
+** Quantized bounds are rounded outwards, so a ray can enter a child it then misses but never skips
+** one it hits.
+ */
+
+template<typename... Ts>
+class hittable_static : public hittable{
+  public:
+    //Constructors
+    hittable_static() {}
+
+    //Functionality
+    template<typename T> size_t add(const T& object);
+    template<typename T> T& get(size_t index){return std::get<type_index<0, T>()>(arrays)[index];}
+    template<typename T> const T& get(size_t index) const {return std::get<type_index<0, T>()>(arrays)[index];}
+    template<typename T> size_t count() const {return std::get<type_index<0, T>()>(arrays).size();}
+    void build();
+    size_t size() const {return refs.size();}
+
+    //Animation, the number of primitives must stay the same between builds
+    void refit();
+    bool update();
+    double sah_cost() const;
+
+    //Rebuild once the SAH cost of the refitted tree grows past this ratio of the built one
+    double rebuild_ratio = 1.5;
+
+    //Collapse the tree into quantized 4-wide nodes, read by build()
+    bool quantized = true;
+
+    ///Memory used by the tree nodes
+    size_t node_bytes() const {return nodes.size()*sizeof(flat_node) + qnodes.size()*sizeof(quantized_node);}
+    size_t node_count() const {return nodes.size() + qnodes.size();}
+
+    //Hittable methods
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual bool intervals(const ray& r, double t_min, double t_max, interval_list& out) const override;
+
+  private:
+    static const int leaf_size = 4;
+
+    struct prim_ref{
+        uint32_t type;
+        uint32_t index;
+    };
+
+    struct flat_node{
+        aabb box;
+        uint32_t start;   //First ref for leaves, right child for inner nodes (left child is always the next node)
+        uint32_t count;   //Number of refs, 0 for inner nodes
+    };
+
+    static const int quantized_width = 4;
+
+    struct alignas(64) quantized_node{
+        float origin[3];                        //Corner of the quantization grid, at or below the node's min
+        int8_t exponent[3];                     //The grid step is 2^exponent on each axis
+        uint8_t children;                       //Used child slots
+        uint8_t lo[3][quantized_width];         //Child bounds in grid steps, rounded outwards
+        uint8_t hi[3][quantized_width];
+        uint32_t child[quantized_width];        //Node index of inner children, first ref of leaves
+        uint8_t count[quantized_width];         //Number of refs of leaf children, 0 for inner ones
+    };
+    static_assert(sizeof(quantized_node) == 64, "quantized_node should fill one cache line");
+
+    std::tuple<std::vector<Ts>...> arrays;
+    std::vector<prim_ref> refs;
+    std::vector<flat_node> nodes;           //Binary tree, empty once collapsed
+    std::vector<quantized_node> qnodes;     //Quantized tree, children are always stored after their parent
+    aabb bounds;
+    double built_cost = 0.0;
+
+    //Compile time dispatch helpers
+    template<typename T> static inline bool hit_one(const T& obj, const ray& r, double t_min, double t_max, hit_record& rec){
+        return obj.T::hit(r, t_min, t_max, rec);
+    }
+
+    template<size_t... I>
+    inline bool hit_ref(const prim_ref& ref, const ray& r, double t_min, double t_max, hit_record& rec, std::index_sequence<I...>) const{
+        bool hit = false;
+        ((ref.type == I && (hit = hit_one(std::get<I>(arrays)[ref.index], r, t_min, t_max, rec))), ...);
+        return hit;
+    }
+
+    template<size_t... I>
+    inline bool occluded_ref(const prim_ref& ref, const ray& r, double t_min, double t_max, std::index_sequence<I...>) const{
+        bool hit = false;
+        ((ref.type == I && (hit = std::get<I>(arrays)[ref.index].std::tuple_element_t<I, std::tuple<Ts...>>::occluded(r, t_min, t_max))), ...);
+        return hit;
+    }
+
+    template<size_t... I>
+    inline bool intervals_ref(const prim_ref& ref, const ray& r, double t_min, double t_max, interval_list& out, std::index_sequence<I...>) const{
+        bool found = false;
+        ((ref.type == I && (found = std::get<I>(arrays)[ref.index].std::tuple_element_t<I, std::tuple<Ts...>>::intervals(r, t_min, t_max, out))), ...);
+        return found;
+    }
+
+    template<size_t... I>
+    inline aabb ref_box(const prim_ref& ref, std::index_sequence<I...>) const{
+        aabb box;
+        ((ref.type == I && std::get<I>(arrays)[ref.index].bounding_box(box)), ...);
+        return box;
+    }
+
+    template<size_t I, typename T> static constexpr size_t type_index(){
+        if constexpr (I == sizeof...(Ts)) {static_assert(I < sizeof...(Ts), "Type not stored in this hittable_static"); return I;}
+        else if constexpr (std::is_same<T, std::tuple_element_t<I, std::tuple<Ts...>>>::value) return I;
+        else return type_index<I+1, T>();
+    }
+
+    inline aabb leaf_box(uint32_t start, uint32_t count) const{
+        aabb box = ref_box(refs[start], std::index_sequence_for<Ts...>{});
+        for (uint32_t i=start+1; i<start+count; ++i){box = box_including(box, ref_box(refs[i], std::index_sequence_for<Ts...>{}));}
+        return box;
+    }
+
+    static inline double grid_step(int exponent){
+        const uint64_t bits = (uint64_t)(exponent + 1023) << 52;
+        double step;
+        memcpy(&step, &bits, sizeof(step));
+        return step;
+    }
+
+    uint32_t build_node(std::vector<aabb>& boxes, uint32_t start, uint32_t end);
+    uint32_t collapse_node(uint32_t binary);
+    static void quantize(quantized_node& node, const aabb* boxes);
+    template<typename F> void traverse(const ray& r, double t_min, const double& t_max, F visit_leaf) const;
+};
+
+
+///Add a primitive to the array of its type, returns its index for get<T>()
+template<typename... Ts>
+template<typename T>
+size_t hittable_static<Ts...>::add(const T& object){
+    constexpr size_t I = type_index<0, T>();
+    auto& arr = std::get<I>(arrays);
+    refs.push_back({(uint32_t)I, (uint32_t)arr.size()});
+    arr.push_back(object);
+    return arr.size() - 1;
+}
+
+
+///Builds the flat BVH over every primitive added so far
+template<typename... Ts>
+void hittable_static<Ts...>::build(){
+    TRACE_SCOPE("hittable_static build");
+    nodes.clear();
+    qnodes.clear();
+    if (refs.empty()) return;
+
+    std::vector<aabb> boxes(refs.size());
+    for (size_t i=0; i<refs.size(); ++i){boxes[i] = ref_box(refs[i], std::index_sequence_for<Ts...>{});}
+
+    nodes.reserve(2 * refs.size() / leaf_size + 1);
+    build_node(boxes, 0, refs.size());
+    bounds = nodes[0].box;
+
+    if (quantized){
+        qnodes.reserve(nodes.size() / (2 * (quantized_width - 1)) + 1);
+        collapse_node(0);
+        nodes.clear();
+        nodes.shrink_to_fit();
+    }
+    built_cost = sah_cost();
+}
+
+
+///Collapses the binary subtree at node binary into 4-wide nodes, opening the largest inner child until the slots are full
+template<typename... Ts>
+uint32_t hittable_static<Ts...>::collapse_node(uint32_t binary){
+    const uint32_t index = qnodes.size();
+    qnodes.push_back(quantized_node());
+
+    //A leaf root is a single slot
+    uint32_t slots[quantized_width] = {binary};
+    int used = 1;
+    if (nodes[binary].count == 0){
+        slots[0] = binary + 1;
+        slots[1] = nodes[binary].start;
+        used = 2;
+    }
+    while (used < quantized_width){
+        int open = -1;
+        for (int i=0; i<used; i++){
+            if (nodes[slots[i]].count == 0 && (open < 0 || nodes[slots[i]].box.surface_area() > nodes[slots[open]].box.surface_area())){open = i;}
+        }
+        if (open < 0) break;
+        const flat_node& inner = nodes[slots[open]];
+        slots[used++] = inner.start;
+        slots[open] = slots[open] + 1;
+    }
+
+    //Children are collapsed first, they can grow qnodes
+    aabb boxes[quantized_width];
+    uint32_t child[quantized_width];
+    uint8_t count[quantized_width];
+    for (int i=0; i<used; i++){
+        const flat_node& node = nodes[slots[i]];
+        boxes[i] = node.box;
+        count[i] = node.count;
+        child[i] = node.count > 0 ? node.start : collapse_node(slots[i]);
+    }
+
+    quantized_node& node = qnodes[index];
+    node.children = used;
+    for (int i=0; i<used; i++){node.child[i] = child[i]; node.count[i] = count[i];}
+    quantize(node, boxes);
+    return index;
+}
+
+
+///Grid of the node over the union of its children, child bounds rounded outwards on it
+template<typename... Ts>
+void hittable_static<Ts...>::quantize(quantized_node& node, const aabb* boxes){
+    aabb parent = boxes[0];
+    for (int c=1; c<node.children; c++){parent = box_including(parent, boxes[c]);}
+
+    for (int a=0; a<3; a++){
+        float origin = (float)parent.min()[a];
+        if (origin > parent.min()[a]){origin = nextafterf(origin, -std::numeric_limits<float>::infinity());}
+
+        //Smallest power of two step that spans the parent in 255 steps
+        int exponent = -126;
+        const double extent = parent.max()[a] - origin;
+        if (extent > 0.0){frexp(extent / 255.0, &exponent);}
+        exponent = std::min(std::max(exponent, -126), 127);
+        node.origin[a] = origin;
+        node.exponent[a] = exponent;
+
+        const double step = grid_step(exponent);
+        for (int c=0; c<node.children; c++){
+            int lo = (int)floor((boxes[c].min()[a] - origin) / step);
+            int hi = (int)ceil((boxes[c].max()[a] - origin) / step);
+            lo = std::min(std::max(lo, 0), 255);
+            hi = std::min(std::max(hi, 0), 255);
+            while (lo > 0 && origin + lo*step > boxes[c].min()[a]){lo--;}
+            while (hi < 255 && origin + hi*step < boxes[c].max()[a]){hi++;}
+            node.lo[a][c] = lo;
+            node.hi[a][c] = hi;
+        }
+    }
+}
+
+
+///Recomputes every node box from the primitives, keeping the topology
+template<typename... Ts>
+void hittable_static<Ts...>::refit(){
+    TRACE_SCOPE("hittable_static refit");
+
+    //Children are always stored after their parent, so a reverse walk sees them first
+    if (!qnodes.empty()){
+        std::vector<aabb> exact(qnodes.size());
+        for (size_t n=qnodes.size(); n-- > 0;){
+            quantized_node& node = qnodes[n];
+            aabb boxes[quantized_width];
+            for (int c=0; c<node.children; c++){
+                boxes[c] = node.count[c] > 0 ? leaf_box(node.child[c], node.count[c]) : exact[node.child[c]];
+                exact[n] = c == 0 ? boxes[c] : box_including(exact[n], boxes[c]);
+            }
+            quantize(node, boxes);
+        }
+        bounds = exact[0];
+        return;
+    }
+
+    for (size_t n=nodes.size(); n-- > 0;){
+        flat_node& node = nodes[n];
+        if (node.count > 0){
+            node.box = leaf_box(node.start, node.count);
+        }else{
+            node.box = box_including(nodes[n+1].box, nodes[node.start].box);
+        }
+    }
+    if (!nodes.empty()){bounds = nodes[0].box;}
+}
+
+
+///Refits after the primitives moved, rebuilds if the tree degraded, returns true on rebuilds
+template<typename... Ts>
+bool hittable_static<Ts...>::update(){
+    if (nodes.empty() && qnodes.empty()){build(); return true;}
+    refit();
+    if (sah_cost() <= rebuild_ratio * built_cost) return false;
+    build();
+    return true;
+}
+
+
+///Expected cost of a random ray through the tree, node visits plus primitive tests weighted by area
+template<typename... Ts>
+double hittable_static<Ts...>::sah_cost() const{
+    if (nodes.empty() && qnodes.empty()) return 0.0;
+    const double root_area = bounds.surface_area();
+    if (root_area <= 0.0) return 0.0;
+
+    double cost = 0.0;
+    for (const flat_node& node : nodes){cost += node.box.surface_area() * (node.count > 0 ? node.count : 1);}
+
+    //Quantized children are weighted by their rounded boxes, what the traversal actually tests
+    for (const quantized_node& node : qnodes){
+        for (int c=0; c<node.children; c++){
+            vec3 d;
+            for (int a=0; a<3; a++){d[a] = (node.hi[a][c] - node.lo[a][c]) * grid_step(node.exponent[a]);}
+            const double area = 2.0 * (d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+            cost += area * (node.count[c] > 0 ? node.count[c] : 1);
+        }
+    }
+    return cost / root_area;
+}
+
+
+///Median split along the longest axis of the centroids
+template<typename... Ts>
+uint32_t hittable_static<Ts...>::build_node(std::vector<aabb>& boxes, uint32_t start, uint32_t end){
+    const uint32_t node_index = nodes.size();
+    nodes.push_back(flat_node());
+
+    //Bounds of the node and of its centroids
+    aabb box = boxes[start];
+    point3 cmin = 0.5*(boxes[start].min() + boxes[start].max()), cmax = cmin;
+    for (uint32_t i=start; i<end; ++i){
+        box = box_including(box, boxes[i]);
+        point3 c = 0.5*(boxes[i].min() + boxes[i].max());
+        for (int a=0; a<3; a++){cmin[a] = fmin(cmin[a], c[a]); cmax[a] = fmax(cmax[a], c[a]);}
+    }
+    nodes[node_index].box = box;
+
+    //Leaf
+    if (end - start <= (uint32_t)leaf_size){
+        nodes[node_index].start = start;
+        nodes[node_index].count = end - start;
+        return node_index;
+    }
+
+    //Sort refs and boxes together around the median
+    vec3 extent = cmax - cmin;
+    int axis = (extent.x() > extent.y() && extent.x() > extent.z()) ? 0 : ((extent.y() > extent.z()) ? 1 : 2);
+    std::vector<uint32_t> order(end - start);
+    for (uint32_t i=0; i<order.size(); ++i){order[i] = start + i;}
+    const uint32_t mid = start + (end - start)/2;
+    std::nth_element(order.begin(), order.begin() + (mid - start), order.end(), [&](uint32_t a, uint32_t b){
+        return boxes[a].min()[axis] + boxes[a].max()[axis] < boxes[b].min()[axis] + boxes[b].max()[axis];
+    });
+    std::vector<prim_ref> sorted_refs(order.size());
+    std::vector<aabb> sorted_boxes(order.size());
+    for (uint32_t i=0; i<order.size(); ++i){sorted_refs[i] = refs[order[i]]; sorted_boxes[i] = boxes[order[i]];}
+    std::copy(sorted_refs.begin(), sorted_refs.end(), refs.begin() + start);
+    std::copy(sorted_boxes.begin(), sorted_boxes.end(), boxes.begin() + start);
+
+    //Children, the left one is always stored right after its parent
+    build_node(boxes, start, mid);
+    const uint32_t right = build_node(boxes, mid, end);
+    nodes[node_index].start = right;
+    nodes[node_index].count = 0;
+    return node_index;
+}
+
+
+///Visits the leaves whose boxes the ray crosses between t_min and t_max, visit_leaf(start, count) returns false to stop.
+///t_max is read again after every leaf, so a closest hit search can shrink it on the way
+template<typename... Ts>
+template<typename F>
+void hittable_static<Ts...>::traverse(const ray& r, double t_min, const double& t_max, F visit_leaf) const {
+    uint32_t stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    if (qnodes.empty()){
+        while (stack_size > 0){
+            const flat_node& node = nodes[stack[--stack_size]];
+            STAT_INC(nodes_visited);
+            STAT_INC(box_tests);
+            if (!node.box.hit(r, t_min, t_max)) continue;
+
+            if (node.count > 0){
+                if (!visit_leaf(node.start, node.count)) return;
+            }else{
+                const uint32_t left = (&node - nodes.data()) + 1;
+                stack[stack_size++] = node.start;
+                stack[stack_size++] = left;
+            }
+        }
+        return;
+    }
+
+    const vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    while (stack_size > 0){
+        const quantized_node& node = qnodes[stack[--stack_size]];
+        STAT_INC(nodes_visited);
+
+        //Slab distances of the grid, child bounds are then one multiply-add away
+        double base[3], step[3];
+        for (int a=0; a<3; a++){
+            base[a] = (node.origin[a] - r.origin()[a]) * inv_dir[a];
+            step[a] = grid_step(node.exponent[a]) * inv_dir[a];
+        }
+
+        //Children hit, sorted near to far
+        int order[quantized_width];
+        double entry[quantized_width];
+        int hits = 0;
+        for (int c=0; c<node.children; c++){
+            STAT_INC(box_tests);
+            double t_near = t_min, t_far = t_max;
+            for (int a=0; a<3; a++){
+                double t0 = base[a] + node.lo[a][c] * step[a];
+                double t1 = base[a] + node.hi[a][c] * step[a];
+                if (step[a] < 0.0) std::swap(t0, t1);
+                t_near = (t0 > t_near) ? t0 : t_near;
+                t_far = (t1 < t_far) ? t1 : t_far;
+            }
+            if (t_far < t_near) continue;
+
+            int i = hits++;
+            while (i > 0 && entry[i-1] > t_near){order[i] = order[i-1]; entry[i] = entry[i-1]; i--;}
+            order[i] = c;
+            entry[i] = t_near;
+        }
+
+        //Leaves right away, then inner children pushed so the nearest is popped first
+        for (int i=0; i<hits; i++){
+            const int c = order[i];
+            if (node.count[c] > 0 && !visit_leaf(node.child[c], node.count[c])) return;
+        }
+        for (int i=hits; i-- > 0;){
+            const int c = order[i];
+            if (node.count[c] == 0 && entry[i] <= t_max){stack[stack_size++] = node.child[c];}
+        }
+    }
+}
+
+
+///Hit check, brute force until the BVH is built
+template<typename... Ts>
+bool hittable_static<Ts...>::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    bool hit_anything = false;
+    double closest_so_far = t_max;
+
+    if (nodes.empty() && qnodes.empty()){
+        for (const auto& ref : refs){
+            if (hit_ref(ref, r, t_min, closest_so_far, rec, std::index_sequence_for<Ts...>{})){
+                hit_anything = true;
+                closest_so_far = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    traverse(r, t_min, closest_so_far, [&](uint32_t start, uint32_t count){
+        for (uint32_t i=start; i<start+count; ++i){
+            if (hit_ref(refs[i], r, t_min, closest_so_far, rec, std::index_sequence_for<Ts...>{})){
+                hit_anything = true;
+                closest_so_far = rec.t;
+            }
+        }
+        return true;
+    });
+    return hit_anything;
+}
+
+
+///Any hit check, returns at the first primitive hit
+template<typename... Ts>
+bool hittable_static<Ts...>::occluded(const ray& r, double t_min, double t_max) const {
+    if (nodes.empty() && qnodes.empty()){
+        for (const auto& ref : refs){
+            if (occluded_ref(ref, r, t_min, t_max, std::index_sequence_for<Ts...>{})) return true;
+        }
+        return false;
+    }
+
+    bool blocked = false;
+    traverse(r, t_min, t_max, [&](uint32_t start, uint32_t count){
+        for (uint32_t i=start; i<start+count; ++i){
+            if (occluded_ref(refs[i], r, t_min, t_max, std::index_sequence_for<Ts...>{})){blocked = true; return false;}
+        }
+        return true;
+    });
+    return blocked;
+}
+
+
+///Spans of every primitive along the segment, one traversal visiting every leaf the segment crosses
+template<typename... Ts>
+bool hittable_static<Ts...>::intervals(const ray& r, double t_min, double t_max, interval_list& out) const {
+    bool found = false;
+    if (nodes.empty() && qnodes.empty()){
+        for (const auto& ref : refs){found |= intervals_ref(ref, r, t_min, t_max, out, std::index_sequence_for<Ts...>{});}
+        return found;
+    }
+
+    traverse(r, t_min, t_max, [&](uint32_t start, uint32_t count){
+        for (uint32_t i=start; i<start+count; ++i){
+            found |= intervals_ref(refs[i], r, t_min, t_max, out, std::index_sequence_for<Ts...>{});
+        }
+        return true;
+    });
+    return found;
+}
+
+
+///Bounding box of all the stored primitives
+template<typename... Ts>
+bool hittable_static<Ts...>::bounding_box(aabb &output_box) const{
+    if (refs.empty()) return false;
+    if (!nodes.empty() || !qnodes.empty()){output_box = bounds; return true;}
+
+    output_box = ref_box(refs[0], std::index_sequence_for<Ts...>{});
+    for (const auto& ref : refs){output_box = box_including(output_box, ref_box(ref, std::index_sequence_for<Ts...>{}));}
+    return true;
+}
+
+
+
+
+
+#endif // __HITTABLE_STATIC_H_
@@ -19,6 +19,16 @@ class hittable_translated : public hittable{
     //Hittable methods
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override{
+        return ptr->occluded(ray(r.origin() - offset, r.direction()), t_min, t_max);
+    }
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override{
+        return ptr->transmittance(ray(r.origin() - offset, r.direction()), t_min, t_max);
+    }
+    virtual bool intervals(const ray& r, double t_min, double t_max, interval_list& out) const override{
+        return ptr->intervals(ray(r.origin() - offset, r.direction()), t_min, t_max, out);
+    }
+    virtual bool random_hits() const override {return ptr->random_hits();}
 
   public:
     shared_ptr<hittable> ptr;
@@ -57,9 +67,22 @@ class hittable_rotated : public hittable{
     hittable_rotated() {}
     hittable_rotated(shared_ptr<hittable> object, axis a, double ang);
 
+    //Animation
+    void set_angle(double ang);
+
     //Hittable methods
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override{
+        return ptr->occluded(rotate(r), t_min, t_max);
+    }
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override{
+        return ptr->transmittance(rotate(r), t_min, t_max);
+    }
+    virtual bool intervals(const ray& r, double t_min, double t_max, interval_list& out) const override{
+        return ptr->intervals(rotate(r), t_min, t_max, out);
+    }
+    virtual bool random_hits() const override {return ptr->random_hits();}
 
   public:
     shared_ptr<hittable> ptr;
@@ -68,10 +91,19 @@ class hittable_rotated : public hittable{
     bool hasbox;
     aabb bbox;
     axis ax;
+
+  private:
+    ray rotate(const ray& r) const;
 };
 
 
 hittable_rotated::hittable_rotated(shared_ptr<hittable> object, axis a, double ang) : ptr(object), ax(a){
+    set_angle(ang);
+}
+
+
+///Changes the angle and the bounding box, the wrapped object can be animated too
+void hittable_rotated::set_angle(double ang){
     //Cache the sin and cos of the angle
     double rads = deg_to_rad(ang);
     this->sin_theta = sin(rads);
@@ -122,8 +154,8 @@ hittable_rotated::hittable_rotated(shared_ptr<hittable> object, axis a, double a
 }
 
 
-///Hit check for hittable rotateds
-bool hittable_rotated::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+///World ray in the space of the rotated object
+ray hittable_rotated::rotate(const ray& r) const {
     int AX_1 = (this->ax == axis_x) ? 1 : ((this->ax == axis_y) ? 0 : 0);
     int AX_2 = (this->ax == axis_x) ? 2 : ((this->ax == axis_y) ? 2 : 1);
 
@@ -134,9 +166,17 @@ bool hittable_rotated::hit(const ray& r, double t_min, double t_max, hit_record&
     origin[AX_2]    = sin_theta*r.origin()[AX_1]    + cos_theta*r.origin()[AX_2];
     direction[AX_1] = cos_theta*r.direction()[AX_1] - sin_theta*r.direction()[AX_2];
     direction[AX_2] = sin_theta*r.direction()[AX_1] + cos_theta*r.direction()[AX_2];
+    return ray(origin, direction);
+}
+
+
+///Hit check for hittable rotateds
+bool hittable_rotated::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    int AX_1 = (this->ax == axis_x) ? 1 : ((this->ax == axis_y) ? 0 : 0);
+    int AX_2 = (this->ax == axis_x) ? 2 : ((this->ax == axis_y) ? 2 : 1);
 
     //Recreate the rotated ray and re-test
-    ray rotated_r(origin, direction);
+    ray rotated_r = rotate(r);
     if (!ptr->hit(rotated_r, t_min, t_max, rec)) return false;
 
     //Update the hit record data with the correct one
@@ -8,6 +8,7 @@
 #include "material_abstract.h"
 #include "material_isotropic.h"
 #include "utils.h"
+#include "utils_density_grid.h"
 
 class material;
 
@@ -15,56 +16,84 @@ class hittable_constant_medium : public hittable{
   public:
     //Constructors
     hittable_constant_medium() {}
-    hittable_constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a) : boundary(b), neg_inv_density(-1.0/d), phase_function(make_shared<material_isotropic>(a)) {};
-    hittable_constant_medium(shared_ptr<hittable> b, double d, color c) : boundary(b), neg_inv_density(-1.0/d), phase_function(make_shared<material_isotropic>(c)) {};
+    hittable_constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a) : boundary(b), neg_inv_density(-1.0/d), phase_function(make_arena_shared<material_isotropic>(a)) {};
+    hittable_constant_medium(shared_ptr<hittable> b, double d, color c) : boundary(b), neg_inv_density(-1.0/d), phase_function(make_arena_shared<material_isotropic>(c)) {};
 
     //Hittable methods
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+    virtual bool random_hits() const override {return true;}
 
   private:
     shared_ptr<hittable> boundary;
     double neg_inv_density;
     shared_ptr<material> phase_function;
+
+    bool sample_collision(const ray& r, double t_min, double t_max, double& t) const;
 };
 
 
-//ASSUMES convex shapes, TODO improve for every shape
-bool hittable_constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record rec1, rec2;
-    if (!boundary->hit(r, -infinity, infinity, rec1)) return false;
-    if (!boundary->hit(r, rec1.t+0.0001, infinity, rec2)) return false;
+///The free flight distance is spent across the spans inside the boundary, so concave shapes work too
+bool hittable_constant_medium::sample_collision(const ray& r, double t_min, double t_max, double& t) const {
+    interval_list inside;
+    if (!boundary->intervals(r, t_min, t_max, inside)) return false;
 
+    const double ray_length = r.direction().length();
+    double hit_distance = neg_inv_density * log(random_double());
+    for (int span = 0; span < inside.count; span++){
+        const double length = (inside.exit[span] - inside.enter[span]) * ray_length;
+        if (hit_distance <= length){
+            t = inside.enter[span] + hit_distance / ray_length;
+            return true;
+        }
+        hit_distance -= length;
+    }
+    return false;
+}
 
-    if (rec1.t < t_min) rec1.t = t_min;
-    if (rec2.t > t_max) rec2.t = t_max;
-    if (rec1.t >= rec2.t) return false;
-    if (rec1.t < 0) rec1.t = 0;
 
-    const double ray_length = r.direction().length();
-    const double distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    const double hit_distance = neg_inv_density * log(random_double());
-    if (hit_distance > distance_inside_boundary) return false;
+bool hittable_constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    STAT_PRIM(stat_prim_medium);
+    double t;
+    if (!sample_collision(r, t_min, t_max, t)) return false;
 
     //Write hit data
-    //double t = rec1.t + hit_distance / ray_length;
-    //rec.write_data(r, t, r.at(t), vec3(1,0,0), phase_function, rec1.u, rec1.v);
-    //rec.normal = vec3(1,0,0);
-    //rec.front_face = true;
-
-    rec.t = rec1.t + hit_distance / ray_length;
+    rec.t = t;
     rec.p = r.at(rec.t);
 
 
     rec.normal = vec3(1,0,0);  // arbitrary
     rec.front_face = true;     // also arbitrary
-    rec.mat_ptr = phase_function;
+    rec.mat_ptr = phase_function.get();
+    rec.object_id = object_id;
 
 
     return true;
 }
 
 
+///Blocks with the probability of a collision, the medium's transmittance on average
+bool hittable_constant_medium::occluded(const ray& r, double t_min, double t_max) const {
+    STAT_PRIM(stat_prim_medium);
+    double t;
+    return sample_collision(r, t_min, t_max, t);
+}
+
+
+///Exact, the density is the same everywhere: exp(-density * length inside the boundary)
+double hittable_constant_medium::transmittance(const ray& r, double t_min, double t_max) const {
+    STAT_PRIM(stat_prim_medium);
+    interval_list inside;
+    if (!boundary->intervals(r, t_min, t_max, inside)) return 1.0;
+
+    double length = 0.0;
+    for (int span = 0; span < inside.count; span++){length += inside.exit[span] - inside.enter[span];}
+    return exp(length * r.direction().length() / neg_inv_density);
+}
+
+
 ///Bounding box for hittable_constant_medium
 bool hittable_constant_medium::bounding_box(aabb &output_box) const{
     return boundary->bounding_box(output_box);
@@ -74,6 +103,178 @@ bool hittable_constant_medium::bounding_box(aabb &output_box) const{
 
 
 
+/*
+** Hittable grid medium
+**
+** Heterogeneous medium filling a box, density is a sparse grid scaled by density.
+** Free flights are delta tracked one majorant block at a time, so empty blocks are stepped over
+** without sampling and thin ones only take a few long steps.
+ */
+
+class hittable_grid_medium : public hittable{
+  public:
+    //Constructors
+    hittable_grid_medium() {}
+    hittable_grid_medium(shared_ptr<density_grid> g, const aabb& bounds, double d, color c)
+        : grid(g), box(bounds), density(d), phase_function(make_arena_shared<material_isotropic>(c)) {
+        const vec3 size = box.max() - box.min();
+        for (int a = 0; a < 3; a++){to_grid[a] = grid->size(a) / size[a];}
+    }
+
+    //Hittable methods
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool bounding_box(aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+    virtual bool random_hits() const override {return true;}
+
+  private:
+    shared_ptr<density_grid> grid;
+    aabb box;
+    vec3 to_grid;   //Grid cells per world unit on each axis
+    double density;
+    shared_ptr<material> phase_function;
+
+    bool clip(const ray& r, double& t_min, double& t_max) const;
+    bool sample_collision(const ray& r, double t_min, double t_max, double& t) const;
+    inline point3 grid_point(const point3& p) const {return (p - box.min()) * to_grid;}
+    template<typename F> void traverse(const ray& r, double t_min, double t_max, F visit) const;
+};
+
+
+///Restricts [t_min, t_max] to the part of the ray inside the box
+bool hittable_grid_medium::clip(const ray& r, double& t_min, double& t_max) const{
+    for (int a = 0; a < 3; a++){
+        const double inv = 1.0 / r.direction()[a];
+        double t0 = (box.min()[a] - r.origin()[a]) * inv;
+        double t1 = (box.max()[a] - r.origin()[a]) * inv;
+        if (inv < 0.0) std::swap(t0, t1);
+        t_min = fmax(t0, t_min);
+        t_max = fmin(t1, t_max);
+        if (t_max <= t_min) return false;
+    }
+    return true;
+}
+
+
+///Walks the majorant blocks along the ray in order, visit(t_enter, t_exit, majorant) returns false to stop
+template<typename F>
+void hittable_grid_medium::traverse(const ray& r, double t_min, double t_max, F visit) const{
+    const int B = density_grid::block_size;
+    const point3 start = r.at(t_min);
+    vec3 o, d;
+    int cell[3], step[3];
+    double next[3], delta[3];
+    for (int a = 0; a < 3; a++){
+        o[a] = (start[a] - box.min()[a]) * to_grid[a];
+        d[a] = r.direction()[a] * to_grid[a];
+        cell[a] = std::min(std::max((int)floor(o[a] / B), 0), grid->blocks(a)-1);
+        if (d[a] > 0){step[a] = 1; next[a] = t_min + ((cell[a]+1)*B - o[a]) / d[a]; delta[a] = B / d[a];}
+        else if (d[a] < 0){step[a] = -1; next[a] = t_min + (cell[a]*B - o[a]) / d[a]; delta[a] = -B / d[a];}
+        else {step[a] = 0; next[a] = infinity; delta[a] = infinity;}
+    }
+
+    double t = t_min;
+    while (true){
+        const int a = (next[0] < next[1]) ? ((next[0] < next[2]) ? 0 : 2) : ((next[1] < next[2]) ? 1 : 2);
+        const double t_exit = fmin(next[a], t_max);
+        if (!visit(t, t_exit, grid->majorant(cell[0], cell[1], cell[2]))) return;
+        if (t_exit >= t_max) return;
+
+        t = t_exit;
+        cell[a] += step[a];
+        next[a] += delta[a];
+        if (cell[a] < 0 || cell[a] >= grid->blocks(a)) return;
+    }
+}
+
+
+///Delta tracking, every tentative collision is real with probability density/majorant
+bool hittable_grid_medium::sample_collision(const ray& r, double t_min, double t_max, double& t_hit) const {
+    if (!clip(r, t_min, t_max)) return false;
+
+    const double ray_length = r.direction().length();
+    bool collided = false;
+    traverse(r, t_min, t_max, [&](double t, double t_exit, float majorant){
+        if (majorant <= 0.0f) return true;
+        const double sigma_max = density * majorant;
+        while (true){
+            t -= log(1.0 - random_double()) / (sigma_max * ray_length);
+            if (t >= t_exit) return true;
+
+            if (random_double() * majorant < grid->sample(grid_point(r.at(t)))){
+                t_hit = t;
+                collided = true;
+                return false;
+            }
+        }
+    });
+    return collided;
+}
+
+
+bool hittable_grid_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    STAT_PRIM(stat_prim_medium);
+    double t;
+    if (!sample_collision(r, t_min, t_max, t)) return false;
+
+    rec.t = t;
+    rec.p = r.at(t);
+
+    rec.normal = vec3(1,0,0);  // arbitrary
+    rec.front_face = true;     // also arbitrary
+    rec.u = rec.v = 0.0;
+    rec.mat_ptr = phase_function.get();
+    rec.object_id = object_id;
+    return true;
+}
+
+
+///Blocks with the probability of a collision, transmittance() is the smoother estimate
+bool hittable_grid_medium::occluded(const ray& r, double t_min, double t_max) const {
+    STAT_PRIM(stat_prim_medium);
+    double t;
+    return sample_collision(r, t_min, t_max, t);
+}
+
+
+///Ratio tracking, every tentative collision scales the estimate by the fraction it lets through
+double hittable_grid_medium::transmittance(const ray& r, double t_min, double t_max) const{
+    STAT_PRIM(stat_prim_medium);
+    if (!clip(r, t_min, t_max)) return 1.0;
+
+    const double ray_length = r.direction().length();
+    double transmitted = 1.0;
+    traverse(r, t_min, t_max, [&](double t, double t_exit, float majorant){
+        if (majorant <= 0.0f) return true;
+        const double sigma_max = density * majorant;
+        while (true){
+            t -= log(1.0 - random_double()) / (sigma_max * ray_length);
+            if (t >= t_exit) return true;
+
+            transmitted *= 1.0 - grid->sample(grid_point(r.at(t))) / majorant;
+
+            //Nearly opaque, stop early without biasing the estimate
+            if (transmitted < 0.1){
+                if (random_double() < 0.5) {transmitted = 0.0; return false;}
+                transmitted *= 2.0;
+            }
+        }
+    });
+    return transmitted;
+}
+
+
+///Bounding box for hittable_grid_medium
+bool hittable_grid_medium::bounding_box(aabb &output_box) const{
+    output_box = box;
+    return true;
+}
+
+
+
+
+
 
 
 
@@ -3,19 +3,20 @@
 #include <iostream>
 #include <math.h>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 //
 #include "extern_stb_image.h"
 
-//Include OpemMP for multithreading
-#include <omp.h>
-
-
-
 //Project files
 #include "utils.h"
 #include "objects.h"
 #include "camera.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "denoiser.h"
 
 
 //SDL Display
@@ -30,221 +31,6 @@ using namespace std;
 
 
 
-void write_color(unsigned char* pixelsData, const int index, color pixel_color, int samples_per_pixel){
-    double r = pixel_color.x(); double g = pixel_color.y(); double b = pixel_color.z();
-
-    double scale = 1.0 / samples_per_pixel;
-    r = sqrt(scale*r); g = sqrt(scale*g); b = sqrt(scale*b);
-
-    pixelsData[index+0] = (unsigned char)(256*clamp(r, 0.0, 0.999));
-    pixelsData[index+1] = (unsigned char)(256*clamp(g, 0.0, 0.999));
-    pixelsData[index+2] = (unsigned char)(256*clamp(b, 0.0, 0.999));
-}
-
-
-void write_color_acc(double* pixelsData, const int index, color pixel_color){
-    pixelsData[index+0] += pixel_color.x();
-    pixelsData[index+1] += pixel_color.y();
-    pixelsData[index+2] += pixel_color.z();
-}
-
-
-
-
-
-struct scene{
-    hittable_list objects;
-    color background;
-};
-
-
-color ray_color(const ray& r, const scene& world, int depth){
-    //Limit max recursion
-    if (depth<=0){return color(0,0,0);}
-
-    //Check for world collision
-    hit_record rec;
-    if(!world.objects.hit(r, 0.001, infinity, rec)){return world.background;}
-
-    //Check the scattered ray
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered)){return emitted;}
-
-    //Recur
-    return emitted + attenuation * ray_color(scattered, world, depth-1);
-}
-
-
-
-hittable_list random_scene() {
-    hittable_list world;
-
-    auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(checker)));
-
-    for (int a = -11; a < 11; a+=4) {
-        for (int b = -11; b < 11; b+=4) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
-        }
-    }
-
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-    auto marble = make_shared<lambertian>(make_shared<texture_noise>(4));
-    world.add(make_shared<sphere>(point3(4, 0.8, 2), 0.8, marble));
-
-    //auto material5 = make_shared<lambertian>(make_shared<texture_image>("src/earthmap.jpg"));
-    //world.add(make_shared<sphere>(point3(4, 0.8,-2), 0.8, material5));
-
-    auto material6 = make_shared<material_light>(color(4,4,4));
-    //world.add(make_shared<sphere>(point3(4, 4, 0), 2.0, material6));
-    //world.add(make_shared<hittable_rect>(point3(-2, 1, -2), point3(2, 4, -2), material6)); //Z aligned
-    //world.add(make_shared<hittable_rect>(point3(-2, 1, -2), point3(-2, 4, 2), material6)); // X aligned
-    world.add(make_shared<hittable_rect>(point3(-4, 4, -4), point3( 4, 4, 4), material6)); // Y aligned
-
-    return world;
-}
-
-
-
-
-void cornell_box(scene* outputScene){
-    outputScene->background = color(0.035, 0.025, 0.05);
-
-    //Materials
-    auto red   = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-
-    //auto red   = make_shared<metal>(color(.65, .05, .05), 0.5);
-    //auto white = make_shared<metal>(color(.73, .73, .73), 0.5);
-    //auto green = make_shared<metal>(color(.12, .45, .15), 0.5);
-
-    //Box
-    int s = 2;
-    outputScene->objects.add(make_shared<hittable_rect>(point3(-s,   0, -s), point3( s,   0, s), white));
-    outputScene->objects.add(make_shared<hittable_rect>(point3(-s,   0, -s), point3( s, s*2,-s), white));
-    outputScene->objects.add(make_shared<hittable_rect>(point3(-s,   0, -s), point3(-s, s*2, s), red));
-    outputScene->objects.add(make_shared<hittable_rect>(point3( s,   0, -s), point3( s, s*2, s), green));
-    outputScene->objects.add(make_shared<hittable_rect>(point3(-s, s*2, -s), point3( s, s*2, s), white));
-
-    //Light
-    //outputScene->objects.add(make_shared<hittable_rect>(point3(-s*0.5, s*2-0.1, -s*0.5), point3( s*0.5, s*2-0.1, s*0.5), light));
-
-    //Things
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    outputScene->objects.add(make_shared<hittable_constant_medium>(make_shared<sphere>(point3( 0, 1.0, 0), 9.0, white), 0.10, color(0.1,0.1,0.1)));
-
-    //Metal ball
-    auto met = make_shared<metal>(color(0.7, 0.6, 0.5), 0.01);
-    outputScene->objects.add(make_shared<sphere>(point3(-1, 2, -1), 0.9, met));
-
-    //Marble ball
-    //auto marble = make_shared<lambertian>(make_shared<texture_noise>(16));
-    auto marble = make_shared<metal>(make_shared<texture_noise>(8), 0.75);
-    outputScene->objects.add(make_shared<sphere>(point3(1, 1, 0), 0.7, marble));
-
-    //Marble ball
-    auto light1 = make_shared<material_light>(color(5,15,15));
-    auto light2 = make_shared<material_light>(color(15,15,5));
-    outputScene->objects.add(make_shared<sphere>(point3( 1.8, 3.6, -1.8), 0.6, light1));
-    outputScene->objects.add(make_shared<sphere>(point3(-1.8, 3.6, -1.8), 0.6, light2));
-
-    //Rect
-    auto light3 = make_shared<material_light>(color(10,10,10));
-    outputScene->objects.add(make_shared<hittable_rect>(point3(-1.75, 0.01, 1.25), point3( 1.75, 0.01, 1.75), light3));
-    //rect = make_shared<hittable_rotated>(rect, axis_z, 30);
-    //rect = make_shared<hittable_rotated>(rect, axis_x, 60);
-    //rect = make_shared<hittable_rotated>(rect, axis_y, 30);
-    //rect = make_shared<hittable_translated>(rect, vec3(-1, 0, -1));
-    //outputScene->objects.add(rect);
-}
-
-
-
-
-
-void renderScene(double* pixels, const scene& world, const camera& cam, int IMG_WIDTH, int IMG_HEIGHT, int SPP, int MAX_DEPTH, bool accumulative = false){
-    const int CHANNELS = 3;
-
-    //Multithreading
-    double time = 0.0;
-    double begin = omp_get_wtime();
-    const unsigned int THREADS = 16;
-    const int STEP = floor(IMG_HEIGHT/THREADS);
-    int chunksDone = 0;
-
-    //Render all the chunks
-    #pragma omp parallel for
-    for(unsigned int k=0; k<THREADS; ++k){
-        const double thread_begin = 0.0;
-
-        //Cycle all the rows in this chunk
-        for(int sj=STEP-1; sj>=0; --sj){
-            int j = sj+(k*STEP);
-            //Cycle each pixel in this row
-            for(int i=0; i<IMG_WIDTH; ++i){
-                //Accumulate samples for this pixel
-                color pixel_color(0,0,0);
-                for(int s=0; s<SPP; ++s){
-                    const double u = (i + random_double()) / (IMG_WIDTH-1);
-                    const double v = (j + random_double()) / (IMG_HEIGHT-1);
-                    ray r = cam.get_ray(u, v);
-                    pixel_color += ray_color(r, world, MAX_DEPTH);
-                }
-
-                //Output the color into the right pixel
-                const int PIXEL_INDEX = (i+(j*IMG_WIDTH)) * 3;//3 channels
-                write_color_acc(pixels, PIXEL_INDEX, pixel_color);
-
-            }
-        }
-
-        //Output feedback of chunk completed
-        int thread_id = omp_get_thread_num();
-        double thread_end = omp_get_wtime();
-        chunksDone++;
-        //if(!accumulative){printf("Thread %d (chunk: %d-%d) finished in %f, remains %d chunks.\n", thread_id, k*STEP, (k+1)*STEP, (double)(thread_end - thread_begin), THREADS-chunksDone);}
-    }
-
-    //Output total time elapsed
-    double end = omp_get_wtime();
-    time = (double)(end - begin);
-    printf("Time elpased for rendering %f\n", time);
-}
-
-
 /*
 int main_renderToFile(int argc, char* argv[]){
     //Image data
@@ -286,8 +72,9 @@ int main_renderToFile(int argc, char* argv[]){
 
 
 
-void saveFrame(uint32_t* screenPixelData, int width, int height, long epoch, int suffix){
-    unsigned char pixelData[width * height * 3];
+void saveFrame(uint32_t* screenPixelData, int width, int height, long epoch, int suffix, const double* cost = nullptr){
+    TRACE_SCOPE("saveFrame");
+    vector<unsigned char> pixelData(width * height * 3);
     for (int j=0;j<height;++j){
         for (int i=0;i<width;++i){
             const int ind = (i+j*width);
@@ -299,8 +86,46 @@ void saveFrame(uint32_t* screenPixelData, int width, int height, long epoch, int
 
     stbi_flip_vertically_on_write(1);
     string name = "frames/"+ std::to_string(epoch) + "_" + std::to_string(suffix) + ".png";
-    stbi_write_png(name.c_str(), width, height, 3, pixelData, width * 3);
+    stbi_write_png(name.c_str(), width, height, 3, pixelData.data(), width * 3);
     cout<<"Frame '"<<name<<"' saved."<<endl;
+
+    //Cost heatmap next to the frame
+    if (cost){
+        string cost_name = "frames/"+ std::to_string(epoch) + "_" + std::to_string(suffix) + "_cost.png";
+        write_cost_heatmap(cost_name.c_str(), cost, width, height);
+    }
+}
+
+
+
+int main_renderAnimation(int argc, char* argv[]){
+    //Image data
+    const int IMG_WIDTH = 512;
+    const int IMG_HEIGHT = 512;
+    const int SPP = 64;
+    const int MAX_DEPTH = 8;
+    const int FRAMES = 96;
+    const double FPS = 24.0;
+    const long epoch = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    film pixels(IMG_WIDTH, IMG_HEIGHT);
+    vector<uint32_t> packed(IMG_WIDTH * IMG_HEIGHT);
+
+    //Both copies of the scene are built once, every frame after that is a refit
+    animation_pipeline pipeline([](scene* world, animation& anim){bouncing_scene(world, anim, 256);});
+    cout << "Scene created." << endl;
+
+    //Turntable camera, once around every 8 seconds
+    const double waited = pipeline.run(0, FRAMES, FPS, [&](const scene& world, int frame, double time, const frame_update& update){
+        const double angle = 2*pi * time / 8.0;
+        camera cam(point3(14*sin(angle), 4, 14*cos(angle)), point3(0, 1, 0), vec3(0, 1, 0), 35.0, (double)IMG_WIDTH / IMG_HEIGHT, 0.0, 10.0);
+        pixels.clear();
+        renderScene(pixels, world, cam, SPP, MAX_DEPTH);
+        film_resolver::standard().resolve_film(pixels, packed.data());
+        saveFrame(packed.data(), IMG_WIDTH, IMG_HEIGHT, epoch, frame);
+        cout << "Frame " << frame << " prepared in " << update.seconds*1e3 << " ms (" << update.rebuilds << " rebuilds)" << endl;
+    });
+    cout << "Waited " << waited << " s on frame preparation." << endl;
+    return 0;
 }
 
 
@@ -312,8 +137,27 @@ int main_renderToDisplay(int argc, char *argv[]) {
     const int IMG_HEIGHT = 512 * RES_MUL;
     const int SPP = 2;
     const int MAX_DEPTH = 8;
-    double pixelsAcc[IMG_WIDTH * IMG_HEIGHT * 3];
-    int samples = 0;
+    film pixelsAcc(IMG_WIDTH, IMG_HEIGHT);
+    vector<double> pixelsSums; //Row major copy for the denoiser and the EXR writer
+    const bool SAVE_FRAMES = true; //Png of every finished pass
+    const bool SAVE_COST = false; //Per-pixel cost heatmap (traversal work with STATS=1, time otherwise)
+    vector<double> pixelsCost(SAVE_COST ? IMG_WIDTH * IMG_HEIGHT : 0, 0.0);
+
+    //Extra outputs (the denoiser needs aov_denoise), saved as a multi-layer EXR next to every frame when SAVE_AOVS is set
+    const bool SAVE_AOVS = false;
+    aov_buffers aovs;
+    aovs.resize(IMG_WIDTH, IMG_HEIGHT, SAVE_AOVS ? aov_all : aov_denoise);
+
+    //Camera samples per pixel whose first hits are kept while the camera holds still, 0 traces them all.
+    //Anti-aliasing and depth of field stop at that many samples, see render_primary.h
+    const int PRIMARY_SUBSAMPLES = 0;
+    primary_cache primaryCache;
+    primaryCache.subsamples = PRIMARY_SUBSAMPLES;
+
+    //Filtered image, shown while denoising is enabled (N on, B off)
+    vector<double> pixelsFiltered(IMG_WIDTH * IMG_HEIGHT * 3, 0.0);
+    film pixelsDenoised(IMG_WIDTH, IMG_HEIGHT);
+    denoiser filter;
 
     //Init controller (SDL, Window, etc...)
     DisplayController& controller = DisplayController::getInstance();
@@ -322,10 +166,22 @@ int main_renderToDisplay(int argc, char *argv[]) {
 
     //Init scene
     scene world;
-    cornell_box(&world);
+    {
+        TRACE_SCOPE("scene build");
+        cornell_box(&world);
+    }
     cout << "Scene created." << endl;
 
-    //Camera
+    //Learn where the light comes from during the first passes and guide the diffuse bounces there,
+    //see render_guiding.h. Training starts over when the scene changes
+    const bool GUIDE_PATHS = false;
+    if (GUIDE_PATHS){world.guide = make_shared<path_guide>();}
+
+    //Caustics from a progressive photon map traced every refinement pass, see render_photons.h
+    const bool PHOTON_CAUSTICS = false;
+    if (PHOTON_CAUSTICS){world.photons = make_shared<photon_map>();}
+
+    //Camera, the navigation starts from this pose
     const vec3 lookfrom = vec3( 0, 2,  10);
     const vec3 lookat   = vec3( 0, 2, 0);
     const vec3 vup      = vec3( 0, 1, 0);
@@ -333,58 +189,243 @@ int main_renderToDisplay(int argc, char *argv[]) {
     const double ASPECT_RATIO = IMG_WIDTH / IMG_HEIGHT;
     auto dist_to_focus = 10.0;
     auto aperture = 0.1;
-    camera cam(lookfrom, lookat, vup, FOV, ASPECT_RATIO, aperture, dist_to_focus);
+    controller.setCameraPose(camera_pose::looking_at(lookfrom, lookat));
+    auto makeCamera = [&](){
+        const camera_pose& pose = controller.getCameraPose();
+        return camera(pose.position, pose.target(), vup, FOV, ASPECT_RATIO, aperture, dist_to_focus);
+    };
     cout << "Camera created." << endl;
 
+    //Preview while the camera moves: 1 spp at a fraction of the resolution, adapted to hold SCREEN_FPS,
+    //upscaled into pixelsPreview and shown for the tiles that have no refined samples yet
+    int previewScale = 4;
+    const int MAX_PREVIEW_SCALE = 16;
+    film pixelsPreviewLow;
+    film pixelsPreview(IMG_WIDTH, IMG_HEIGHT);
+
+    //Tiles the presenter can read while the worker writes them, the three films share the tiling
+    const int TILES = pixelsAcc.tile_count();
+    tile_sync accSync, previewSync, denoisedSync;
+    accSync.resize(TILES);
+    previewSync.resize(TILES);
+    denoisedSync.resize(TILES);
+
+    //Camera handoff from the display loop to the render worker
+    std::mutex cameraMutex;
+    camera pendingCamera = makeCamera();
+    bool restartPending = true;
+    std::atomic<bool> quit(false);
+    std::atomic<int> passesDone(0);
+    render_control control;
+    control.tiles = &accSync;
+    control.primary = PRIMARY_SUBSAMPLES > 0 ? &primaryCache : nullptr;
+
+    //Previews don't trace photons, a photon pass would cost more than the preview itself
+    render_control previewControl;
+    previewControl.photon_pass = false;
+
     //Get epoch
     auto p1 = std::chrono::system_clock::now();
     auto epoch = std::chrono::duration_cast<std::chrono::seconds>(p1.time_since_epoch()).count();
 
-    //Display loop
-    bool quit = false;
+    //Render worker, runs passes back to back and never waits for the display
+    std::thread worker([&](){
+        TRACE_THREAD_NAME("render");
+        camera cam = pendingCamera;
+        int samples = 0;
+        while (!quit){
+            bool restart = false;
+            {
+                std::lock_guard<std::mutex> lock(cameraMutex);
+                if (restartPending){cam = pendingCamera; restartPending = false; restart = true; control.cancel = false;}
+            }
+
+            //Restart the accumulation from the new point of view with a quick low resolution frame
+            if (restart){
+                TRACE_SCOPE("restart");
+                const int PREVIEW_WIDTH = IMG_WIDTH / previewScale;
+                const int PREVIEW_HEIGHT = IMG_HEIGHT / previewScale;
+                pixelsPreviewLow.resize(PREVIEW_WIDTH, PREVIEW_HEIGHT);
+                render_info preview = renderScene(pixelsPreviewLow, world, cam, 1, MAX_DEPTH, nullptr, nullptr, &previewControl);
+
+                #pragma omp parallel for
+                for (int t=0;t<TILES;++t){
+                    accSync.begin_write(t);
+                    pixelsAcc.clear_tile(t);
+                    accSync.end_write(t, 0);
+                    denoisedSync.begin_write(t);
+                    denoisedSync.end_write(t, 0);
+
+                    previewSync.begin_write(t);
+                    int x0, y0, x1, y1;
+                    pixelsPreview.tile_rect(t, x0, y0, x1, y1);
+                    for (int j=y0;j<y1;++j){
+                        for (int i=x0;i<x1;++i){
+                            pixelsPreview.set(i, j, pixelsPreviewLow.average(std::min(i / previewScale, PREVIEW_WIDTH-1), std::min(j / previewScale, PREVIEW_HEIGHT-1)));
+                        }
+                    }
+                    previewSync.end_write(t, 1);
+                }
+                std::fill(pixelsCost.begin(), pixelsCost.end(), 0.0);
+                aovs.clear();
+                samples = 0;
+                if (world.photons){world.photons->restart();}
+
+                //Coarser if we missed the frame budget, finer if there's plenty of room
+                const double previewTicks = preview.seconds * 1000.0;
+                if (previewTicks > SCREEN_TICKS_PER_FRAME && previewScale < MAX_PREVIEW_SCALE){previewScale *= 2;}
+                else if (previewTicks * 4 < SCREEN_TICKS_PER_FRAME && previewScale > 1){previewScale /= 2;}
+                continue;
+            }
+
+            //Refinement pass, dropped as soon as the camera moves again
+            render_info pass = renderScene(pixelsAcc, world, cam, SPP, MAX_DEPTH, SAVE_COST ? pixelsCost.data() : nullptr, &aovs, &control);
+            if (pass.cancelled){continue;}
+            samples += SPP;
+            cout << "Samples: " << samples << endl;
+
+            //The worker owns the buffers between passes, so whole-image outputs are made here
+            const bool denoise = controller.denoiseEnabled();
+            if (denoise || SAVE_AOVS){
+                pixelsSums.resize(IMG_WIDTH * IMG_HEIGHT * 3);
+                pixelsAcc.export_sums(pixelsSums.data());
+            }
+            if (denoise){
+                filter.run(pixelsSums.data(), aovs, samples, IMG_WIDTH, IMG_HEIGHT, pixelsFiltered.data());
+                #pragma omp parallel for
+                for (int t=0;t<TILES;++t){
+                    denoisedSync.begin_write(t);
+                    int x0, y0, x1, y1;
+                    pixelsDenoised.tile_rect(t, x0, y0, x1, y1);
+                    for (int j=y0;j<y1;++j){
+                        for (int i=x0;i<x1;++i){
+                            const double* p = &pixelsFiltered[(i + j*IMG_WIDTH)*3];
+                            pixelsDenoised.set(i, j, color(p[0], p[1], p[2]));
+                        }
+                    }
+                    denoisedSync.end_write(t, 1);
+                }
+            }
+            const string name = "frames/" + std::to_string(epoch) + "_" + std::to_string(samples / SPP);
+            if (SAVE_COST){write_cost_heatmap((name + "_cost.png").c_str(), pixelsCost.data(), IMG_WIDTH, IMG_HEIGHT);}
+            if (SAVE_AOVS){write_aovs((name + ".exr").c_str(), pixelsSums.data(), aovs, samples);}
+            passesDone = samples / SPP;
+        }
+    });
+
+    //Display loop, presents at SCREEN_FPS whatever the worker has finished so far
     SDL_Event e;
+    int savedPasses = 0;
+    bool denoiseShown = false;
+    film_resolver resolver;
+    vector<int> dirtyTiles;
+    vector<char> resolvedTiles;
+
+    //The presenter resolves with a few threads of its own, the worker keeps the rest
+    const int PRESENT_THREADS = std::max(1, omp_get_num_procs() / 4);
     while(!quit){
+        const Uint32 frameStart = SDL_GetTicks();
         while(SDL_PollEvent(&e) != 0){
             //Quit event
-            if(e.type == SDL_QUIT){quit = true;}
+            if(e.type == SDL_QUIT){quit = true; control.cancel = true;}
+
+            //Look around with the right mouse button
+            if(e.type == SDL_MOUSEMOTION && (e.motion.state & SDL_BUTTON_RMASK)){controller.onMouseMove(e.motion.xrel, e.motion.yrel);}
         }
 
+        //Update
+        controller.update();
+
         //Keydown event
         const Uint8* currentKeyStates = SDL_GetKeyboardState(NULL);
         controller.onKeyDown(currentKeyStates);
 
-        //Update
-        controller.update();
+        //Hand the new camera to the worker and stop its current pass
+        if (controller.consumeCameraMoved()){
+            std::lock_guard<std::mutex> lock(cameraMutex);
+            pendingCamera = makeCamera();
+            restartPending = true;
+            control.cancel = true;
+        }
+
+        //Everything is resolved again when the denoiser or the exposure/tonemap settings change
+        const bool denoise = controller.denoiseEnabled();
+        if (controller.consumeResolveChanged() || denoise != denoiseShown){
+            denoiseShown = denoise;
+            resolver.configure(controller.getResolveSettings());
+            for (int t=0;t<TILES;++t){accSync.dirty[t] = true;}
+        }
 
-        //Draw
-        renderScene(pixelsAcc, world, cam, IMG_WIDTH, IMG_HEIGHT, SPP, MAX_DEPTH, true);
-        samples += SPP;
-        double gammaScale = 1.0 / samples;
-        for (int j=0;j<IMG_HEIGHT;++j){
-            for (int i=0;i<IMG_WIDTH;++i){
-                int ind = i + (j * IMG_WIDTH);
-
-                //Extract with gamma correction
-                double r = sqrt(gammaScale * pixelsAcc[ind*3+0]);
-                double g = sqrt(gammaScale * pixelsAcc[ind*3+1]);
-                double b = sqrt(gammaScale * pixelsAcc[ind*3+2]);
-
-                screenPixelData[ind] = 0;
-                screenPixelData[ind] |= (unsigned char)(256*clamp(r, 0.0, 0.999));
-                screenPixelData[ind] |= (unsigned char)(256*clamp(g, 0.0, 0.999)) << 8;
-                screenPixelData[ind] |= (unsigned char)(256*clamp(b, 0.0, 0.999)) << 16;
+        //Resolve the tiles that changed: denoised if enabled, refined if they have samples, the preview otherwise
+        int firstDirty = IMG_HEIGHT, lastDirty = -1;
+        {
+            TRACE_SCOPE("tonemap");
+            dirtyTiles.clear();
+            for (int t=0;t<TILES;++t){
+                const bool accDirty = accSync.dirty[t].exchange(false);
+                const bool previewDirty = previewSync.dirty[t].exchange(false);
+                const bool denoisedDirty = denoisedSync.dirty[t].exchange(false);
+                if (accDirty || previewDirty || denoisedDirty){dirtyTiles.push_back(t);}
+            }
+            resolvedTiles.assign(dirtyTiles.size(), 0);
+
+            #pragma omp parallel num_threads(PRESENT_THREADS)
+            {
+                vector<float> tile(film::tile_pixels * film::channels);
+                #pragma omp for schedule(dynamic, 16)
+                for (int k=0;k<(int)dirtyTiles.size();++k){
+                    const int t = dirtyTiles[k];
+                    int n = denoise ? denoisedSync.read(t, pixelsDenoised.tile_data(t), film::tile_bytes(), tile.data()) : 0;
+                    if (n == 0){n = accSync.read(t, pixelsAcc.tile_data(t), film::tile_bytes(), tile.data());}
+                    if (n == 0){n = previewSync.read(t, pixelsPreview.tile_data(t), film::tile_bytes(), tile.data());}
+
+                    //A writer got in the way, try again next frame
+                    if (n < 0){accSync.dirty[t] = true; continue;}
+                    if (n == 0) continue;
+
+                    int x0, y0, x1, y1;
+                    pixelsAcc.tile_rect(t, x0, y0, x1, y1);
+                    for (int j=y0;j<y1;++j){
+                        resolver.resolve_weighted(tile.data() + (j-y0) * film::tile_size * film::channels, x1 - x0, screenPixelData + j*IMG_WIDTH + x0);
+                    }
+                    resolvedTiles[k] = 1;
+                }
+            }
+            for (size_t k=0;k<dirtyTiles.size();++k){
+                if (!resolvedTiles[k]) continue;
+                int x0, y0, x1, y1;
+                pixelsAcc.tile_rect(dirtyTiles[k], x0, y0, x1, y1);
+                firstDirty = std::min(firstDirty, y0);
+                lastDirty = std::max(lastDirty, y1 - 1);
             }
         }
-        cout << "Samples: " << samples << endl;
 
-        saveFrame(screenPixelData, IMG_WIDTH, IMG_HEIGHT, epoch, samples / SPP);
+        //Only the changed rows are uploaded
+        {
+            TRACE_SCOPE("present");
+            controller.draw(firstDirty, lastDirty - firstDirty + 1);
+            controller.drawImGui();
+        }
+
+        //Save every pass the worker finished, with whatever rows of the next pass are already in
+        const int passes = passesDone;
+        if (SAVE_FRAMES && passes != savedPasses){
+            savedPasses = passes;
+            saveFrame(screenPixelData, IMG_WIDTH, IMG_HEIGHT, epoch, passes);
+        }
 
-        controller.draw();
-        controller.drawImGui();
+        //Hold the display rate
+        const Uint32 frameTicks = SDL_GetTicks() - frameStart;
+        if (frameTicks < (Uint32)SCREEN_TICKS_PER_FRAME){SDL_Delay(SCREEN_TICKS_PER_FRAME - frameTicks);}
     }
 
     //Close event
+    worker.join();
     controller.close();
+#ifdef TRACCIA_TRACE
+    string trace_name = "frames/" + std::to_string(epoch) + "_trace.json";
+    if (trace_dump(trace_name.c_str())){cout << "Trace '" << trace_name << "' saved." << endl;}
+#endif
     return 0;
 }
 
@@ -396,6 +437,8 @@ int main_renderToDisplay(int argc, char *argv[]) {
 
 
 int main(int argc, char *argv[]) {
+    TRACE_THREAD_NAME("main");
     //return main_renderToFile(argc, argv);
+    //return main_renderAnimation(argc, argv);
     return main_renderToDisplay(argc, argv);
 }
@@ -6,13 +6,27 @@
 
 struct hit_record;
 
+///Ids in creation order, so they are stable across runs of the same scene
+inline std::atomic<uint32_t> next_material_id(1);
+
 class material{
   public:
+    uint32_t material_id = next_material_id++;
+
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
 
     virtual color emitted(double u, double v, const point3& p) const {
       return color(0,0,0);
     }
+
+    ///BSDF times cosine toward direction and the pdf scatter() picks it with, for light sampling.
+    ///Materials that scatter in a delta (or whose pdf isn't known) return false and are skipped
+    virtual bool eval(const ray& r_in, const hit_record& rec, const vec3& direction, color& f, double& pdf) const {
+        return false;
+    }
+
+    ///Participating media scatter inside a volume, they have no surface to guide the denoiser
+    virtual bool is_volume() const {return false;}
 };
 
 
@@ -21,7 +21,7 @@ class dielectric : public material{
 
         //Create the scattered ray either by reflecting or refracting it
         vec3 direction;
-        bool should_reflect = cannot_refract || (reflectance(cos_theta, refraction_ratio) > random_double());
+        bool should_reflect = cannot_refract || (reflectance(cos_theta, refraction_ratio) > sample_1d());
         if (should_reflect){direction = reflect(unit_direction, rec.normal);
         }else{direction = refract(unit_direction, rec.normal, refraction_ratio);}
         scattered = ray(rec.p, direction);
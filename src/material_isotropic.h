@@ -10,16 +10,20 @@
 
 class material_isotropic : public material{
   public:
-    material_isotropic(const color& a) : albedo(make_shared<solid_color>(a)) {}
+    material_isotropic(const color& a) : albedo(make_arena_shared<solid_color>(a)) {}
     material_isotropic(shared_ptr<texture> a) : albedo(a) {}
 
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override{
         //Scatter the ray in a random direction
-        scattered = ray(rec.p, random_in_unit_sphere());
+        double u, v;
+        sample_2d(u, v);
+        scattered = ray(rec.p, warp_sphere(u, v));
         attenuation = albedo->value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    virtual bool is_volume() const override {return true;}
+
   public:
     shared_ptr<texture> albedo;
 };
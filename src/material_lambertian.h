@@ -9,20 +9,28 @@
 
 class lambertian : public material{
   public:
-    lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
+    lambertian(const color& a) : albedo(make_arena_shared<solid_color>(a)) {}
     lambertian(shared_ptr<texture> a) : albedo(a) {}
 
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override{
         //Create the scattered ray
-        auto scatter_direction = rec.normal + random_unit_vector();
-        if (scatter_direction.near_zero()){scatter_direction = rec.normal;}
-        scattered = ray(rec.p, scatter_direction);
+        double u, v;
+        sample_2d(u, v);
+        scattered = ray(rec.p, warp_cosine_hemisphere(rec.normal, u, v));
 
         //Get the attenuation color from the texture at the UV point
         attenuation = albedo->value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    virtual bool eval(const ray& r_in, const hit_record& rec, const vec3& direction, color& f, double& pdf) const override{
+        const double cosine = dot(rec.normal, unit_vector(direction));
+        if (cosine <= 0){return false;}
+        pdf = cosine / pi;
+        f = albedo->value(rec.u, rec.v, rec.p) * pdf;
+        return true;
+    }
+
   public:
     shared_ptr<texture> albedo;
 };
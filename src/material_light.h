@@ -10,7 +10,7 @@
 class material_light : public material{
   public:
     material_light(shared_ptr<texture> a) : emit(a) {}
-    material_light(color c) : emit(make_shared<solid_color>(c)) {}
+    material_light(color c) : emit(make_arena_shared<solid_color>(c)) {}
 
 
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override{
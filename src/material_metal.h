@@ -8,7 +8,7 @@
 
 class metal : public material{
   public:
-    metal(const color& a, double f) : albedo(make_shared<solid_color>(a)), fuzz(f) {}
+    metal(const color& a, double f) : albedo(make_arena_shared<solid_color>(a)), fuzz(f) {}
     metal(shared_ptr<texture> a, double f) : albedo(a), fuzz(f) {}
 
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override{
@@ -17,7 +17,9 @@ class metal : public material{
 
         //Create the scattered ray
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
+        double u, v;
+        sample_2d(u, v);
+        scattered = ray(rec.p, reflected + fuzz*warp_ball(u, v, sample_1d()));
 
         //Scatter only if the scattered ray is in the same direction of the normal
         return (dot(scattered.direction(), rec.normal) > 0);
@@ -12,6 +12,8 @@
 #include "hittable_volumes.h"
 #include "hittable_sphere.h"
 #include "hittable_rect.h"
+#include "hittable_box.h"
+#include "hittable_static.h"
 
 //Materials
 #include "material_abstract.h"
@@ -0,0 +1,181 @@
+#ifndef __RENDER_ANIMATION_H_
+#define __RENDER_ANIMATION_H_
+
+#include <vector>
+#include <utility>
+#include <functional>
+#include <thread>
+#include <initializer_list>
+#include <math.h>
+
+//Include OpemMP for the timers
+#include <omp.h>
+
+#include "utils.h"
+#include "renderer.h"
+
+
+/*
+** Animation
+**
+** Keyframed tracks drive setters on primitives (through static_objects::get) and on instances,
+** animation::update applies them for a time and then refits the static containers they touch.
+** The pipeline builds the scene twice with the same seed and ids, so frame N+1 is updated and
+** refitted on one copy by a helper thread while frame N renders on the other.
+ */
+
+///Keyframed value, linear between keys, held outside them unless it loops
+template<typename T>
+class track{
+  public:
+    //Constructors
+    track() {}
+    track(std::initializer_list<std::pair<double, T>> k){for (const auto& kv : k){key(kv.first, kv.second);}}
+
+    //Functionality
+    track& key(double time, const T& value);
+    track& looping(bool l = true){loop = l; return *this;}
+    T at(double time) const;
+
+  private:
+    std::vector<std::pair<double, T>> keys; //Sorted by time
+    bool loop = false;
+};
+
+
+template<typename T>
+track<T>& track<T>::key(double time, const T& value){
+    auto it = keys.begin();
+    while (it != keys.end() && it->first <= time){++it;}
+    keys.insert(it, {time, value});
+    return *this;
+}
+
+
+template<typename T>
+T track<T>::at(double time) const{
+    if (keys.empty()) return T();
+    const double first = keys.front().first, last = keys.back().first;
+    if (loop && last > first){time = first + fmod(fmod(time - first, last - first) + (last - first), last - first);}
+    if (time <= first) return keys.front().second;
+    if (time >= last) return keys.back().second;
+
+    size_t k = 1;
+    while (keys[k].first < time){++k;}
+    const double f = (time - keys[k-1].first) / (keys[k].first - keys[k-1].first);
+    return keys[k-1].second * (1.0 - f) + keys[k].second * f;
+}
+
+
+
+
+///Work done to move one copy of the scene to a new time
+struct frame_update{
+    double seconds = 0.0;
+    int refits = 0;
+    int rebuilds = 0;
+};
+
+
+///What changes over time in one copy of a scene
+class animation{
+  public:
+    //Bindings, called in the order they were added
+    void bind(std::function<void(double)> update){updates.push_back(update);}
+    template<typename T, typename F> void bind(const track<T>& tr, F apply){
+        updates.push_back([tr, apply](double time){apply(tr.at(time));});
+    }
+
+    //Containers refitted after the bindings ran
+    void refit(shared_ptr<static_objects> statics){containers.push_back(statics);}
+
+    frame_update update(double time);
+
+  private:
+    std::vector<std::function<void(double)>> updates;
+    std::vector<shared_ptr<static_objects>> containers;
+};
+
+
+frame_update animation::update(double time){
+    TRACE_SCOPE("animation update");
+    frame_update out;
+    const double begin = omp_get_wtime();
+
+    for (const auto& u : updates){u(time);}
+    for (const auto& c : containers){
+        if (c->update()){out.rebuilds++;}
+        else {out.refits++;}
+    }
+
+    out.seconds = omp_get_wtime() - begin;
+    return out;
+}
+
+
+
+
+///Builds an animated scene, must give the same scene every time it's called with the same seed
+typedef std::function<void(scene*, animation&)> animated_scene_builder;
+
+class animation_pipeline{
+  public:
+    animation_pipeline(animated_scene_builder build, uint64_t seed = 0);
+
+    ///Renders count frames from first, render(world, frame, time, update) runs on the calling thread.
+    ///Returns the seconds the caller waited on frame preparation that didn't overlap a render
+    template<typename F> double run(int first, int count, double fps, F render);
+
+  private:
+    struct buffer{
+        scene world;
+        animation anim;
+        frame_update last;
+    };
+    buffer buffers[2];
+};
+
+
+animation_pipeline::animation_pipeline(animated_scene_builder build, uint64_t seed){
+    TRACE_SCOPE("animation build");
+
+    //Both copies get the same object and material ids
+    const uint32_t objects = next_object_id, materials = next_material_id;
+    for (auto& b : buffers){
+        next_object_id = objects;
+        next_material_id = materials;
+        random_seed(seed);
+        build(&b.world, b.anim);
+    }
+}
+
+
+template<typename F>
+double animation_pipeline::run(int first, int count, double fps, F render){
+    double waited = omp_get_wtime();
+    buffers[0].last = buffers[0].anim.update(first / fps);
+    buffers[0].world.touch();
+    waited = omp_get_wtime() - waited;
+
+    for (int f=first; f<first+count; f++){
+        buffer& current = buffers[(f - first) % 2];
+        buffer& next = buffers[(f - first + 1) % 2];
+
+        //The next frame only touches its own copy of the scene
+        std::thread prepare;
+        if (f+1 < first+count){prepare = std::thread([&next, f, fps](){next.last = next.anim.update((f+1) / fps); next.world.touch();});}
+
+        render((const scene&)current.world, f, f / fps, (const frame_update&)current.last);
+
+        if (prepare.joinable()){
+            const double join_begin = omp_get_wtime();
+            prepare.join();
+            waited += omp_get_wtime() - join_begin;
+        }
+    }
+    return waited;
+}
+
+
+
+#endif // __RENDER_ANIMATION_H_
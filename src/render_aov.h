@@ -0,0 +1,157 @@
+#ifndef __RENDER_AOV_H_
+#define __RENDER_AOV_H_
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "utils.h"
+#include "utils_exr.h"
+
+
+/*
+** Arbitrary output variables
+**
+** ray_color fills an aov_sample for every camera path and renderScene sums the samples into
+** the buffers that were requested, every other buffer stays empty.
+** Beauty = emission + direct + indirect: emission is what the camera ray hits (or the background),
+** direct is the light found by the first bounce and indirect everything after it.
+** Ids aren't averaged, every pass overwrites them with the id of its last sample.
+ */
+
+enum aov_type{aov_depth, aov_normal, aov_albedo, aov_emission, aov_direct, aov_indirect, aov_object_id, aov_material_id, aov_types};
+
+const char* const aov_names[aov_types] = {"depth", "normal", "albedo", "emission", "direct", "indirect", "object_id", "material_id"};
+const int aov_channels[aov_types] = {1, 3, 3, 3, 3, 3, 1, 1};
+
+typedef uint32_t aov_mask;
+inline constexpr aov_mask aov_bit(aov_type t){return 1u << t;}
+const aov_mask aov_all = (1u << aov_types) - 1;
+
+//What the denoiser is guided by
+const aov_mask aov_denoise = aov_bit(aov_depth) | aov_bit(aov_normal) | aov_bit(aov_albedo);
+
+//Depth written when the camera ray escapes
+const double miss_depth = 1e6;
+
+
+///Outputs of one camera path
+struct aov_sample{
+    //First surface hit, volumes leave them to the surface behind them
+    color albedo;
+    vec3 normal;
+    double depth = 0.0;
+
+    //First scattering event
+    color emission;
+    color direct;
+    color indirect;
+    uint32_t object_id = 0;
+    uint32_t material_id = 0;
+
+    inline void set_surface(const color& a, const vec3& n, double d){albedo = a; normal = n; depth = d;}
+
+    ///Sums the samples of a pixel, ids keep the last one
+    inline void accumulate(const aov_sample& s){
+        albedo += s.albedo; normal += s.normal; depth += s.depth;
+        emission += s.emission; direct += s.direct; indirect += s.indirect;
+        object_id = s.object_id; material_id = s.material_id;
+    }
+};
+
+
+///Per-pixel sums of the requested outputs, rgb layers use the layout of the color buffer
+struct aov_buffers{
+    aov_mask mask = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<double> layers[aov_types];
+
+    ///Allocates the requested layers and frees the others
+    void resize(int w, int h, aov_mask requested){
+        width = w; height = h; mask = requested;
+        for (int t=0; t<aov_types; t++){
+            if (has((aov_type)t)){layers[t].assign((size_t)w * h * aov_channels[t], 0.0);}
+            else {std::vector<double>().swap(layers[t]);}
+        }
+    }
+
+    void clear(){
+        for (auto& layer : layers){std::fill(layer.begin(), layer.end(), 0.0);}
+    }
+
+    inline bool has(aov_type t) const {return mask & aov_bit(t);}
+    inline bool has_all(aov_mask m) const {return (mask & m) == m;}
+    inline const double* get(aov_type t) const {return layers[t].data();}
+
+    ///Adds the sums of a pixel, ids are overwritten
+    inline void add(int pixel, const aov_sample& sum){
+        if (has(aov_depth)){layers[aov_depth][pixel] += sum.depth;}
+        if (has(aov_normal)){add3(layers[aov_normal], pixel, sum.normal);}
+        if (has(aov_albedo)){add3(layers[aov_albedo], pixel, sum.albedo);}
+        if (has(aov_emission)){add3(layers[aov_emission], pixel, sum.emission);}
+        if (has(aov_direct)){add3(layers[aov_direct], pixel, sum.direct);}
+        if (has(aov_indirect)){add3(layers[aov_indirect], pixel, sum.indirect);}
+        if (has(aov_object_id)){layers[aov_object_id][pixel] = sum.object_id;}
+        if (has(aov_material_id)){layers[aov_material_id][pixel] = sum.material_id;}
+    }
+
+  private:
+    static inline void add3(std::vector<double>& layer, int pixel, const vec3& v){
+        layer[pixel*3+0] += v.x(); layer[pixel*3+1] += v.y(); layer[pixel*3+2] += v.z();
+    }
+};
+
+
+///Writes the averaged beauty and every requested layer as one multi-layer EXR
+inline bool write_aovs(const char* path, const double* color_acc, const aov_buffers& aovs, int samples){
+    const size_t n = (size_t)aovs.width * aovs.height;
+    const double inv = 1.0 / (samples > 0 ? samples : 1);
+    static const char* const rgb[3] = {"R", "G", "B"};
+    static const char* const xyz[3] = {"X", "Y", "Z"};
+
+    //Float copies stay alive until the file is written
+    std::vector<std::vector<float>> planes;
+    std::vector<exr_channel> channels;
+    auto add_plane = [&](const std::string& name, const double* src, int stride, int offset, double scale){
+        planes.emplace_back(n);
+        for (size_t i=0; i<n; i++){planes.back()[i] = (float)(src[i*stride + offset] * scale);}
+        channels.push_back({name, nullptr});
+    };
+
+    for (int c=0; c<3; c++){add_plane(rgb[c], color_acc, 3, c, inv);}
+    for (int t=0; t<aov_types; t++){
+        if (!aovs.has((aov_type)t)) continue;
+        const bool is_id = (t == aov_object_id || t == aov_material_id);
+        const double scale = is_id ? 1.0 : inv;
+        if (aov_channels[t] == 1){add_plane(t == aov_depth ? "Z" : aov_names[t], aovs.get((aov_type)t), 1, 0, scale);}
+        else {
+            for (int c=0; c<3; c++){
+                add_plane(std::string(aov_names[t]) + "." + (t == aov_normal ? xyz[c] : rgb[c]), aovs.get((aov_type)t), 3, c, scale);
+            }
+        }
+    }
+    for (size_t i=0; i<channels.size(); i++){channels[i].data = planes[i].data();}
+
+    return write_exr(path, aovs.width, aovs.height, channels);
+}
+
+
+///Parses a comma separated list of names ("depth,normal,albedo" or "all")
+inline aov_mask parse_aov_mask(const std::string& list){
+    aov_mask mask = 0;
+    size_t begin = 0;
+    while (begin <= list.size()){
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos) end = list.size();
+        const std::string name = list.substr(begin, end - begin);
+        if (name == "all"){mask |= aov_all;}
+        for (int t=0; t<aov_types; t++){if (name == aov_names[t]) mask |= aov_bit((aov_type)t);}
+        begin = end + 1;
+    }
+    return mask;
+}
+
+
+
+#endif // __RENDER_AOV_H_
@@ -0,0 +1,224 @@
+#ifndef __RENDER_ENVIRONMENT_H_
+#define __RENDER_ENVIRONMENT_H_
+
+//Base Library
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <functional>
+
+//STB
+#include "extern_stb_image.h"
+
+//Project files
+#include "utils.h"
+
+
+/*
+** Environment map
+**
+** HDR latitude-longitude image lighting the scene from infinitely far away, +y is up and the
+** top row of the image is the zenith. Loaded from .pfm or anything stbi_loadf reads (.hdr).
+** At load time every texel gets a weight, its luminance times the solid angle it covers, and
+** the weights go in an alias table: sample() picks a texel in O(1) whatever the resolution, so
+** a sun a few texels wide is found by every shadow ray instead of by one path in a million.
+** A texel is 16 bytes, radiance and pdf together, so a miss costs one cache line whether or not
+** it's weighted against the light sample.
+ */
+
+class environment_map{
+  public:
+    //Constructors
+    environment_map(const char* filename, double intensity = 1.0, double rotation = 0.0);
+    environment_map(int width, int height, const std::function<color(const vec3&)>& radiance, double rotation = 0.0);
+
+    bool valid() const {return w > 0;}
+    int width() const {return w;}
+    int height() const {return h;}
+
+    ///Radiance coming from direction, pdf is the solid angle density sample() has for it
+    inline color lookup(const vec3& direction, double& pdf) const;
+    inline color radiance(const vec3& direction) const {double pdf; return lookup(direction, pdf);}
+
+    ///Direction toward the environment picked proportionally to the texel weights, returns its radiance
+    inline color sample(double u, double v, vec3& direction, double& pdf) const;
+
+  private:
+    struct texel{float r, g, b, pdf;};      //pdf in (u,v) over 2 pi^2, divided by sin(theta) on use
+    struct alias_entry{float probability; uint32_t alias;};
+
+    int w = 0, h = 0;
+    double rotation = 0.0;                  //Turns around +y, in fractions of a turn
+    std::vector<texel> texels;
+    std::vector<alias_entry> table;
+
+    inline int texel_index(const vec3& direction, double& sin_theta) const;
+    bool load_pfm(const char* filename, std::vector<float>& rgb);
+    void build_table();
+};
+
+
+environment_map::environment_map(const char* filename, double intensity, double rotation) : rotation(rotation){
+    TRACE_SCOPE("environment load");
+    std::vector<float> rgb;
+    const size_t length = strlen(filename);
+    if (length > 4 && strcmp(filename + length - 4, ".pfm") == 0){
+        load_pfm(filename, rgb);
+    }else{
+        int components = 3;
+        float* data = stbi_loadf(filename, &w, &h, &components, 3);
+        if (data){rgb.assign(data, data + (size_t)w * h * 3); stbi_image_free(data);}
+    }
+    if (rgb.empty()){std::cerr << "ERROR: Could not load environment map '"<<filename<<"'.\n"; w = h = 0; return;}
+
+    texels.resize((size_t)w * h);
+    for (size_t i=0; i<texels.size(); i++){
+        texels[i] = {(float)(rgb[3*i] * intensity), (float)(rgb[3*i+1] * intensity), (float)(rgb[3*i+2] * intensity), 0.0f};
+    }
+    build_table();
+    std::cout << "Loaded environment map with size: " << w << " x " << h << std::endl;
+}
+
+
+///Bakes a procedural sky at the given resolution, so it's sampled like a loaded one
+environment_map::environment_map(int width, int height, const std::function<color(const vec3&)>& radiance, double rotation)
+    : w(width), h(height), rotation(rotation){
+    texels.resize((size_t)w * h);
+    for (int j=0; j<h; j++){
+        const double theta = pi * (j + 0.5) / h;
+        for (int i=0; i<w; i++){
+            const double phi = 2*pi * (i + 0.5) / w - pi;
+            const color c = radiance(vec3(sin(theta)*cos(phi), cos(theta), sin(theta)*sin(phi)));
+            texels[i + (size_t)j*w] = {(float)c.x(), (float)c.y(), (float)c.z(), 0.0f};
+        }
+    }
+    build_table();
+}
+
+
+///Portable float map, rows are stored bottom to top and a negative scale means little endian
+bool environment_map::load_pfm(const char* filename, std::vector<float>& rgb){
+    FILE* f = fopen(filename, "rb");
+    if (!f) return false;
+    char magic[3] = {0};
+    double scale = 0.0;
+    if (fscanf(f, "%2s %d %d %lf", magic, &w, &h, &scale) != 4 || w <= 0 || h <= 0 || (strcmp(magic, "PF") && strcmp(magic, "Pf"))){fclose(f); return false;}
+    fgetc(f);
+
+    const int channels = magic[1] == 'F' ? 3 : 1;
+    std::vector<float> raw((size_t)w * h * channels);
+    const bool complete = fread(raw.data(), sizeof(float), raw.size(), f) == raw.size();
+    fclose(f);
+    if (!complete) return false;
+
+    const uint16_t probe = 1;
+    const bool little = *(const uint8_t*)&probe == 1;
+    if ((scale < 0) != little){
+        for (float& v : raw){
+            uint8_t* b = (uint8_t*)&v;
+            std::swap(b[0], b[3]); std::swap(b[1], b[2]);
+        }
+    }
+
+    rgb.resize((size_t)w * h * 3);
+    for (int j=0; j<h; j++){
+        const float* row = raw.data() + (size_t)(h - 1 - j) * w * channels;
+        for (int i=0; i<w; i++){
+            for (int c=0; c<3; c++){rgb[(i + (size_t)j*w)*3 + c] = row[i*channels + (channels == 3 ? c : 0)];}
+        }
+    }
+    return true;
+}
+
+
+///Vose's alias method over luminance times sin(theta), the texel pdfs are written next to their radiance
+void environment_map::build_table(){
+    const size_t n = texels.size();
+    std::vector<double> weight(n);
+    double total = 0.0;
+    for (int j=0; j<h; j++){
+        const double sin_theta = sin(pi * (j + 0.5) / h);
+        for (int i=0; i<w; i++){
+            const texel& t = texels[i + (size_t)j*w];
+            const double luminance = 0.2126*t.r + 0.7152*t.g + 0.0722*t.b;
+            weight[i + (size_t)j*w] = fmax(luminance, 0.0) * sin_theta;
+            total += weight[i + (size_t)j*w];
+        }
+    }
+
+    //A black map can't be importance sampled, fall back to the solid angle alone
+    if (total <= 0.0){
+        total = 0.0;
+        for (int j=0; j<h; j++){
+            for (int i=0; i<w; i++){weight[i + (size_t)j*w] = sin(pi * (j + 0.5) / h); total += weight[i + (size_t)j*w];}
+        }
+    }
+
+    table.resize(n);
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i=0; i<n; i++){
+        texels[i].pdf = (float)(weight[i] / total * n / (2*pi*pi));
+        scaled[i] = weight[i] / total * n;
+        (scaled[i] < 1.0 ? small : large).push_back((uint32_t)i);
+    }
+    while (!small.empty() && !large.empty()){
+        const uint32_t s = small.back(); small.pop_back();
+        const uint32_t l = large.back();
+        table[s] = {(float)scaled[s], l};
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0){large.pop_back(); small.push_back(l);}
+    }
+    for (uint32_t i : large){table[i] = {1.0f, i};}
+    for (uint32_t i : small){table[i] = {1.0f, i};}
+}
+
+
+inline int environment_map::texel_index(const vec3& direction, double& sin_theta) const{
+    const vec3 d = unit_vector(direction);
+    const double cos_theta = clamp(d.y(), -1.0, 1.0);
+    sin_theta = sqrt(fmax(0.0, 1.0 - cos_theta*cos_theta));
+    double u = (atan2(d.z(), d.x()) + pi) / (2*pi) - rotation;
+    u -= floor(u);
+    const double v = acos(cos_theta) / pi;
+    const int i = std::min((int)(u * w), w - 1);
+    const int j = std::min((int)(v * h), h - 1);
+    return i + j*w;
+}
+
+
+inline color environment_map::lookup(const vec3& direction, double& pdf) const{
+    double sin_theta;
+    const texel& t = texels[texel_index(direction, sin_theta)];
+    pdf = sin_theta > 0.0 ? t.pdf / sin_theta : 0.0;
+    return color(t.r, t.g, t.b);
+}
+
+
+inline color environment_map::sample(double u, double v, vec3& direction, double& pdf) const{
+    //The leftover of u picks between the texel and its alias, then places the point inside the texel
+    const size_t n = table.size();
+    const double scaled = u * n;
+    uint32_t index = (uint32_t)std::min((size_t)scaled, n - 1);
+    double rest = scaled - index;
+    const alias_entry& entry = table[index];
+    if (rest < entry.probability){rest /= entry.probability;}
+    else {rest = (rest - entry.probability) / (1.0 - entry.probability); index = entry.alias;}
+    rest = fmin(rest, 0.9999999);
+
+    const int i = index % w, j = index / w;
+    const double phi = 2*pi * ((i + rest) / w + rotation) - pi;
+    const double theta = pi * (j + v) / h;
+    const double sin_theta = sin(theta);
+    direction = vec3(sin_theta*cos(phi), cos(theta), sin_theta*sin(phi));
+
+    const texel& t = texels[index];
+    pdf = sin_theta > 0.0 ? t.pdf / sin_theta : 0.0;
+    return color(t.r, t.g, t.b);
+}
+
+
+
+#endif // __RENDER_ENVIRONMENT_H_
@@ -0,0 +1,177 @@
+#ifndef __RENDER_FILM_H_
+#define __RENDER_FILM_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <new>
+
+#include "utils.h"
+#include "render_threads.h"
+
+
+/*
+** Film
+**
+** Accumulation buffer split in square tiles, every tile is one contiguous, cache line aligned
+** block, so a thread rendering a tile never shares a line with another thread.
+** A pixel is four values: the summed r, g, b and the number of samples in them, so pixels can
+** have different sample counts and the resolve divides each one by its own.
+** film (float) halves the bandwidth of film_t<double>, counts stay exact up to 2^24 samples.
+** Storage is allocated untouched and clear() zeroes every tile from the render thread that owns
+** it in the tile order (see render_threads.h), so on NUMA machines its pages land on that node.
+ */
+
+template<typename T>
+class film_t{
+  public:
+    static const int tile_size = 16;
+    static const int channels = 4;
+    static const int tile_pixels = tile_size * tile_size;
+
+    //Constructors
+    film_t() {}
+    film_t(int width, int height){resize(width, height);}
+
+    //Size and tiles
+    void resize(int width, int height);
+    int width() const {return w;}
+    int height() const {return h;}
+    int tile_count() const {return tiles_x * tiles_y;}
+    const std::vector<uint32_t>& tile_order() const {return morton_order;}
+    void tile_rect(int tile, int& x0, int& y0, int& x1, int& y1) const;
+
+    //Pixels
+    void clear();
+    void clear_tile(int tile){memset(tile_data(tile), 0, tile_bytes());}
+    inline T* pixel(int x, int y){return data.get() + index(x, y);}
+    inline const T* pixel(int x, int y) const {return data.get() + index(x, y);}
+    inline void add(int x, int y, const color& sum, int samples);
+    inline void set(int x, int y, const color& average);
+    inline color average(int x, int y) const;
+
+    //Raw tiles, tile_size rows of tile_size pixels
+    T* tile_data(int tile){return data.get() + (size_t)tile * tile_pixels * channels;}
+    const T* tile_data(int tile) const {return data.get() + (size_t)tile * tile_pixels * channels;}
+    static size_t tile_bytes(){return (size_t)tile_pixels * channels * sizeof(T);}
+
+    ///Row major rgb sums (the layout of the denoiser and image writers), sample counts are dropped
+    void export_sums(double* rgb) const;
+
+  private:
+    struct aligned_free{void operator()(T* p) const {free(p);}};
+
+    int w = 0, h = 0;
+    int tiles_x = 0, tiles_y = 0;
+    size_t capacity = 0;
+    std::unique_ptr<T, aligned_free> data;
+    std::vector<uint32_t> morton_order;
+
+    inline size_t index(int x, int y) const {
+        const int tile = (y / tile_size) * tiles_x + (x / tile_size);
+        return ((size_t)tile * tile_pixels + (y % tile_size) * tile_size + (x % tile_size)) * channels;
+    }
+
+    static uint32_t morton_code(uint32_t x, uint32_t y);
+};
+
+typedef film_t<float> film;
+
+
+///Resizes and clears, the storage is only reallocated when it grows
+template<typename T>
+void film_t<T>::resize(int width, int height){
+    w = width; h = height;
+    tiles_x = (w + tile_size - 1) / tile_size;
+    tiles_y = (h + tile_size - 1) / tile_size;
+
+    const size_t bytes = (size_t)tile_count() * tile_bytes();
+    if (bytes > capacity){
+        data.reset(static_cast<T*>(aligned_alloc(64, bytes)));
+        if (!data){capacity = 0; throw std::bad_alloc();}
+        capacity = bytes;
+    }
+
+    //Neighbouring tiles are handed out close in time, so camera rays in flight stay coherent
+    morton_order.resize(tile_count());
+    for (int t=0; t<tile_count(); t++){morton_order[t] = t;}
+    std::sort(morton_order.begin(), morton_order.end(), [this](uint32_t a, uint32_t b){
+        return morton_code(a % tiles_x, a / tiles_x) < morton_code(b % tiles_x, b / tiles_x);
+    });
+    clear();
+}
+
+
+///Zeroes every tile from the thread tile_scheduler hands it to first, the first touch of a fresh film
+template<typename T>
+void film_t<T>::clear(){
+    #pragma omp parallel
+    {
+        int begin, end;
+        thread_range(tile_count(), omp_get_thread_num(), omp_get_num_threads(), begin, end);
+        for (int k=begin; k<end; k++){clear_tile(morton_order[k]);}
+    }
+}
+
+
+///Pixel bounds of a tile, x1/y1 excluded and clipped to the image
+template<typename T>
+void film_t<T>::tile_rect(int tile, int& x0, int& y0, int& x1, int& y1) const{
+    x0 = (tile % tiles_x) * tile_size;
+    y0 = (tile / tiles_x) * tile_size;
+    x1 = std::min(x0 + tile_size, w);
+    y1 = std::min(y0 + tile_size, h);
+}
+
+
+template<typename T>
+inline void film_t<T>::add(int x, int y, const color& sum, int samples){
+    T* p = pixel(x, y);
+    p[0] += (T)sum.x(); p[1] += (T)sum.y(); p[2] += (T)sum.z(); p[3] += (T)samples;
+}
+
+template<typename T>
+inline void film_t<T>::set(int x, int y, const color& average){
+    T* p = pixel(x, y);
+    p[0] = (T)average.x(); p[1] = (T)average.y(); p[2] = (T)average.z(); p[3] = (T)1;
+}
+
+template<typename T>
+inline color film_t<T>::average(int x, int y) const{
+    const T* p = pixel(x, y);
+    return p[3] > 0 ? color(p[0], p[1], p[2]) / (double)p[3] : color(0,0,0);
+}
+
+
+template<typename T>
+void film_t<T>::export_sums(double* rgb) const{
+    #pragma omp parallel for
+    for (int y=0; y<h; y++){
+        for (int x=0; x<w; x++){
+            const T* p = pixel(x, y);
+            for (int c=0; c<3; c++){rgb[(x + y*w)*3+c] = p[c];}
+        }
+    }
+}
+
+
+///Interleaves the bits of x and y
+template<typename T>
+uint32_t film_t<T>::morton_code(uint32_t x, uint32_t y){
+    auto spread = [](uint32_t v){
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+
+
+#endif // __RENDER_FILM_H_
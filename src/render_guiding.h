@@ -0,0 +1,380 @@
+#ifndef __RENDER_GUIDING_H_
+#define __RENDER_GUIDING_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+//Include OpemMP for the refinement
+#include <omp.h>
+
+#include "utils.h"
+
+
+/*
+** Path guiding
+**
+** A spatial-directional tree (SD-tree, Mueller et al. 2017 "Practical Path Guiding") learns the
+** light arriving at the diffuse surfaces of a scene while it renders:
+** - a binary tree cuts the scene bounds in cells, splitting a cell along x, y, z in turn once
+**   enough samples land in it
+** - every cell holds a quadtree over the directions, mapped on the square by the equal-area
+**   (cos theta, phi) projection, so a quadrant's energy over its area is a radiance
+** Training runs in iterations of 1, 2, 4... samples per pixel (end_pass() counts them). Paths
+** record the radiance they bring back into the building quadtrees and sample the ones frozen at
+** the end of the previous iteration, so every pass stays unbiased. Between iterations the cells are
+** split where the samples were, and each quadtree is rebuilt from what it learned: quadrants with
+** more than directional_threshold of the energy are subdivided, the others collapsed.
+** At guided points the bounce picks the quadtree with probability guide_fraction and the BSDF
+** otherwise, weighted by the pdf of the mixture (one sample MIS). Recording during a pass is lock
+** free (atomic adds into the leaf quadrant), the trees only change between passes.
+ */
+
+///Adds v to a, compare and swap since atomic floats have no fetch_add before C++20
+inline void atomic_add(std::atomic<float>& a, float v){
+    float old = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)){}
+}
+
+
+///Directional distribution over the sphere
+class guide_quadtree{
+  public:
+    guide_quadtree(){nodes.emplace_back();}
+
+    ///Adds the radiance estimate of direction to the leaf quadrant it falls in
+    inline void record(const vec3& direction, float value);
+
+    ///Sums every quadrant from its children, after the recording is done
+    void build();
+
+    ///Same structure as other (refined by its energy), emptied
+    void refine(const guide_quadtree& other, double threshold, int max_depth);
+
+    double total() const {const node& r = nodes[0]; return (double)r.sum[0] + r.sum[1] + r.sum[2] + r.sum[3];}
+
+    ///Direction drawn proportionally to the energy, with its solid angle pdf
+    inline vec3 sample(double u, double v, double& pdf) const;
+
+    ///Solid angle pdf of direction
+    inline double pdf(const vec3& direction) const;
+
+  private:
+    struct node{
+        std::atomic<float> sum[4];
+        uint32_t child[4] = {0, 0, 0, 0};   //0 for a leaf quadrant (the root is never a child)
+
+        node(){for (auto& s : sum){s.store(0.0f, std::memory_order_relaxed);}}
+        node(const node& o){
+            for (int q=0; q<4; q++){sum[q].store(o.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed); child[q] = o.child[q];}
+        }
+        node& operator=(const node& o){
+            for (int q=0; q<4; q++){sum[q].store(o.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed); child[q] = o.child[q];}
+            return *this;
+        }
+        inline float value(int q) const {return sum[q].load(std::memory_order_relaxed);}
+    };
+    std::vector<node> nodes;
+
+    static inline void to_square(const vec3& direction, double& x, double& y);
+    static inline vec3 from_square(double x, double y);
+    double build_node(uint32_t n);
+    void refine_node(const guide_quadtree& other, uint32_t src, uint32_t dst, double total, double scale, double threshold, int depth, int max_depth);
+};
+
+
+///Quadrant q covers x in [q&1, (q&1)+1)/2 and y in [q>>1, (q>>1)+1)/2 of its node
+inline void guide_quadtree::to_square(const vec3& direction, double& x, double& y){
+    const vec3 d = unit_vector(direction);
+    x = clamp((d.y() + 1.0) * 0.5, 0.0, 0.9999999);
+    double phi = atan2(d.z(), d.x()) / (2*pi);
+    if (phi < 0.0){phi += 1.0;}
+    y = clamp(phi, 0.0, 0.9999999);
+}
+
+inline vec3 guide_quadtree::from_square(double x, double y){
+    const double cos_theta = 2*x - 1;
+    const double sin_theta = sqrt(fmax(0.0, 1 - cos_theta*cos_theta));
+    const double phi = 2*pi*y;
+    return vec3(sin_theta*cos(phi), cos_theta, sin_theta*sin(phi));
+}
+
+
+inline void guide_quadtree::record(const vec3& direction, float value){
+    if (!(value > 0.0f) || !std::isfinite(value)) return;
+    double x, y;
+    to_square(direction, x, y);
+    uint32_t n = 0;
+    while (true){
+        const int q = (x >= 0.5) + 2*(y >= 0.5);
+        x = 2*x - (q & 1);
+        y = 2*y - (q >> 1);
+        if (!nodes[n].child[q]){atomic_add(nodes[n].sum[q], value); return;}
+        n = nodes[n].child[q];
+    }
+}
+
+
+double guide_quadtree::build_node(uint32_t n){
+    double total = 0.0;
+    for (int q=0; q<4; q++){
+        if (nodes[n].child[q]){nodes[n].sum[q].store((float)build_node(nodes[n].child[q]), std::memory_order_relaxed);}
+        total += nodes[n].value(q);
+    }
+    return total;
+}
+
+void guide_quadtree::build(){build_node(0);}
+
+
+void guide_quadtree::refine(const guide_quadtree& other, double threshold, int max_depth){
+    nodes.assign(1, node());
+    refine_node(other, 0, 0, other.total(), 1.0, threshold, 1, max_depth);
+}
+
+
+///src is a node of other (or ~0 under one of its leaves, whose energy is spread evenly by scale)
+void guide_quadtree::refine_node(const guide_quadtree& other, uint32_t src, uint32_t dst, double total, double scale,
+                                 double threshold, int depth, int max_depth){
+    for (int q=0; q<4; q++){
+        const bool inside = src != ~0u;
+        const double energy = inside ? other.nodes[src].value(q) : scale;
+        if (depth >= max_depth || total <= 0.0 || energy / total <= threshold) continue;
+
+        const uint32_t child = (uint32_t)nodes.size();
+        nodes.emplace_back();
+        nodes[dst].child[q] = child;
+        const uint32_t from = inside && other.nodes[src].child[q] ? other.nodes[src].child[q] : ~0u;
+        refine_node(other, from, child, total, energy / 4, threshold, depth + 1, max_depth);
+    }
+}
+
+
+inline vec3 guide_quadtree::sample(double u, double v, double& pdf) const{
+    double x0 = 0.0, y0 = 0.0, size = 1.0;
+    pdf = 1.0;
+    uint32_t n = 0;
+    while (true){
+        const node& nd = nodes[n];
+        const double s[4] = {nd.value(0), nd.value(1), nd.value(2), nd.value(3)};
+        const double total = s[0] + s[1] + s[2] + s[3];
+        if (total <= 0.0){break;}
+
+        //Column (x half) first, then the row inside it, u and v are rescaled for the levels below
+        const double left = (s[0] + s[2]) / total;
+        int column;
+        if (u < left){column = 0; u = u / left;}
+        else {column = 1; u = (u - left) / (1.0 - left);}
+        const double col_total = s[column] + s[column + 2];
+        const double bottom = col_total > 0.0 ? s[column] / col_total : 0.5;
+        int row;
+        if (v < bottom){row = 0; v = v / bottom;}
+        else {row = 1; v = (v - bottom) / (1.0 - bottom);}
+        u = fmin(u, 0.9999999); v = fmin(v, 0.9999999);
+
+        const int q = column + 2*row;
+        pdf *= 4.0 * s[q] / total;
+        size *= 0.5;
+        x0 += column * size;
+        y0 += row * size;
+        if (!nd.child[q]){break;}
+        n = nd.child[q];
+    }
+    pdf /= 4*pi;
+    return from_square(x0 + u * size, y0 + v * size);
+}
+
+
+inline double guide_quadtree::pdf(const vec3& direction) const{
+    double x, y;
+    to_square(direction, x, y);
+    double pdf = 1.0 / (4*pi);
+    uint32_t n = 0;
+    while (true){
+        const node& nd = nodes[n];
+        const double total = (double)nd.value(0) + nd.value(1) + nd.value(2) + nd.value(3);
+        if (total <= 0.0){return pdf;}
+        const int q = (x >= 0.5) + 2*(y >= 0.5);
+        x = 2*x - (q & 1);
+        y = 2*y - (q >> 1);
+        pdf *= 4.0 * nd.value(q) / total;
+        if (!nd.child[q] || pdf == 0.0){return pdf;}
+        n = nd.child[q];
+    }
+}
+
+
+
+
+///Learned distribution of a shading point mixed with its BSDF
+struct guide_mix{
+    const guide_quadtree* tree = nullptr;   //Null when the point isn't guided
+    guide_quadtree* record = nullptr;       //Where its bounce is recorded, null once training is over
+    double fraction = 0.0;                  //Probability of sampling the tree
+
+    ///Pdf of the mixture for a direction the BSDF has bsdf_pdf for
+    inline double pdf(double bsdf_pdf, const vec3& direction) const {
+        return tree ? (1.0 - fraction) * bsdf_pdf + fraction * tree->pdf(direction) : bsdf_pdf;
+    }
+};
+
+
+class path_guide{
+  public:
+    //Settings, read when training starts
+    double guide_fraction = 0.5;            //Probability of sampling the guide at a guided point
+    int training_iterations = 6;            //Iterations of 1, 2, 4... spp before the trees are frozen
+    double spatial_threshold = 12000;       //Samples a cell takes before it splits, times sqrt(2^iteration)
+    double directional_threshold = 0.01;    //Energy share of a quadrant before it's subdivided
+    int max_depth = 20;
+
+    ///Starts training over when the scene changed, bounds are its bounding box
+    void prepare(const aabb& bounds, uint64_t scene_revision);
+
+    ///Counts the samples per pixel of a finished pass, ends the iteration once it has them all
+    void end_pass(int spp);
+
+    ///Drops what was learned, training starts over with the next pass
+    void restart(){leaves.clear();}
+
+    bool training() const {return iteration < training_iterations;}
+    int iterations_done() const {return iteration;}
+    size_t cells() const {return leaves.size();}
+
+    ///Guide of the cell around p, fraction is 0 until the first iteration is done
+    inline guide_mix at(const point3& p);
+
+  private:
+    struct cell{
+        guide_quadtree sampling, building;
+        std::atomic<uint32_t> samples{0};
+
+        cell() {}
+        cell(const cell& o) : sampling(o.sampling), building(o.building), samples(o.samples.load()) {}
+    };
+    struct spatial_node{
+        int axis = 0;
+        uint32_t child = 0;     //Children at child and child + 1, 0 for a leaf
+        uint32_t leaf = 0;
+    };
+
+    std::vector<spatial_node> nodes;
+    std::vector<cell> leaves;
+    point3 origin;
+    double extent = 0.0;
+    uint64_t revision = 0;
+    int iteration = 0;
+    int iteration_spp = 0;
+
+    void reset(const aabb& bounds);
+    void end_iteration();
+    void split(uint32_t n, uint32_t threshold);
+};
+
+
+void path_guide::reset(const aabb& bounds){
+    //A cube around the bounds, so the cells stay close to cubes
+    const vec3 size = bounds.max() - bounds.min();
+    extent = fmax(fmax(size.x(), size.y()), fmax(size.z(), 1e-3)) * 1.01;
+    origin = (bounds.min() + bounds.max()) * 0.5 - vec3(extent, extent, extent) * 0.5;
+    nodes.assign(1, spatial_node());
+    leaves.clear();
+    leaves.emplace_back();
+    iteration = 0;
+    iteration_spp = 0;
+}
+
+
+void path_guide::prepare(const aabb& bounds, uint64_t scene_revision){
+    if (scene_revision == revision && !leaves.empty()) return;
+    revision = scene_revision;
+    reset(bounds);
+}
+
+
+inline guide_mix path_guide::at(const point3& p){
+    guide_mix mix;
+    if (leaves.empty()) return mix;
+
+    //Walk down halving the box along the split axis
+    point3 lo = origin;
+    double size[3] = {extent, extent, extent};
+    uint32_t n = 0;
+    while (nodes[n].child){
+        const int a = nodes[n].axis;
+        size[a] *= 0.5;
+        if (p[a] >= lo[a] + size[a]){lo[a] += size[a]; n = nodes[n].child + 1;}
+        else {n = nodes[n].child;}
+    }
+
+    cell& c = leaves[nodes[n].leaf];
+    if (iteration > 0 && c.sampling.total() > 0.0){
+        mix.tree = &c.sampling;
+        mix.fraction = guide_fraction;
+    }
+    if (training()){
+        mix.record = &c.building;
+        c.samples.fetch_add(1, std::memory_order_relaxed);
+    }
+    return mix;
+}
+
+
+void path_guide::end_pass(int spp){
+    if (!training()) return;
+    iteration_spp += spp;
+    if (iteration_spp >= (1 << iteration)){end_iteration();}
+}
+
+
+///Splits leaf node n in halves until every leaf is under threshold, both halves start from its trees
+void path_guide::split(uint32_t n, uint32_t threshold){
+    const uint32_t leaf = nodes[n].leaf;
+    const uint32_t samples = leaves[leaf].samples.load();
+    if (samples <= threshold) return;
+
+    const uint32_t child = (uint32_t)nodes.size();
+    nodes.resize(nodes.size() + 2);
+    nodes[n].child = child;
+    for (int k=0; k<2; k++){
+        nodes[child + k].axis = (nodes[n].axis + 1) % 3;
+        nodes[child + k].leaf = k == 0 ? leaf : (uint32_t)leaves.size();
+    }
+    const cell half = leaves[leaf];
+    leaves.push_back(half);
+    leaves[leaf].samples = samples / 2;
+    leaves.back().samples = samples / 2;
+    split(child, threshold);
+    split(child + 1, threshold);
+}
+
+
+void path_guide::end_iteration(){
+    TRACE_SCOPE("guide refine");
+
+    //Cells that took many samples split, the halves share what the cell learned
+    const uint32_t threshold = (uint32_t)(spatial_threshold * sqrt((double)(1 << iteration)));
+    const size_t leaf_nodes = nodes.size();
+    for (size_t n=0; n<leaf_nodes; n++){
+        if (!nodes[n].child){split((uint32_t)n, threshold);}
+    }
+
+    //What every cell learned is what it samples next, its new building tree follows it
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (size_t l=0; l<leaves.size(); l++){
+        cell& c = leaves[l];
+        c.building.build();
+        c.sampling = c.building;
+        c.building.refine(c.sampling, directional_threshold, max_depth);
+        c.samples = 0;
+    }
+
+    iteration++;
+    iteration_spp = 0;
+}
+
+
+
+#endif // __RENDER_GUIDING_H_
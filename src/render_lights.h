@@ -0,0 +1,444 @@
+#ifndef __RENDER_LIGHTS_H_
+#define __RENDER_LIGHTS_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "utils.h"
+#include "objects.h"
+
+
+/*
+** Light tree
+**
+** The emitters of a scene in a binary tree (Conty Estevez and Kulla 2018). Every node bounds the
+** positions of the lights below it, their total power and their emission directions, as a cone:
+** normals within theta_o of an axis, each emitting up to theta_e away from its normal.
+** A shading point picks one light by walking down from the root, going left or right in proportion
+** to what each side can send toward it at most: power over squared distance, times how far the
+** cone and the point's hemisphere can turn toward each other. The walk spends a single random
+** number, rescaled at every step.
+** Lights close in space and orientation share subtrees, so a point far from a cluster or behind it
+** skips it as a whole: the noise follows the few lights that matter to a point, however many there
+** are, and a sample costs one walk down the tree.
+** pdf() walks back up from a light, it's what emitters found by bounce rays are weighted against.
+ */
+
+///Normals within theta_o of axis, each emitting up to theta_e away from its normal
+struct light_cone{
+    vec3 axis = vec3(0, 1, 0);
+    double theta_o = 0.0;
+    double theta_e = pi / 2;
+
+    static light_cone merge(const light_cone& a, const light_cone& b);
+
+    ///Solid angle measure of the emitted directions, the orientation part of the split cost
+    double measure() const {
+        const double theta_w = fmin(theta_o + theta_e, pi);
+        return 2*pi * (1 - cos(theta_o))
+             + pi/2 * (2*theta_w*sin(theta_o) - cos(theta_o - 2*theta_w) - 2*theta_o*sin(theta_o) + cos(theta_o));
+    }
+};
+
+
+///Smallest cone holding both, turning the wider one toward the other
+light_cone light_cone::merge(const light_cone& first, const light_cone& second){
+    const light_cone& a = first.theta_o >= second.theta_o ? first : second;
+    const light_cone& b = first.theta_o >= second.theta_o ? second : first;
+    const double theta_d = acos(clamp(dot(a.axis, b.axis), -1.0, 1.0));
+    const double theta_e = fmax(a.theta_e, b.theta_e);
+    if (fmin(theta_d + b.theta_o, pi) <= a.theta_o){return {a.axis, a.theta_o, theta_e};}
+
+    const double theta_o = (a.theta_o + theta_d + b.theta_o) / 2;
+    if (theta_o >= pi){return {a.axis, pi, theta_e};}
+
+    //Turn a's axis by theta_o - a.theta_o toward b's
+    vec3 toward = b.axis - dot(a.axis, b.axis) * a.axis;
+    if (toward.length_squared() < 1e-12){vec3 t, bt; orthonormal_basis(a.axis, t, bt); toward = t;}
+    toward = unit_vector(toward);
+    const double theta_r = theta_o - a.theta_o;
+    return {unit_vector(cos(theta_r) * a.axis + sin(theta_r) * toward), theta_o, theta_e};
+}
+
+
+
+
+///One emitter as the light tree samples it, spheres are sampled in the cone they subtend, rects by area
+struct light_source{
+    enum light_shape{light_sphere, light_rect};
+
+    light_shape shape;
+    point3 a, b;                //Center of spheres, corners of rects
+    double radius = 0.0;
+    int ax_1 = 0, ax_2 = 0, ax_k = 0;
+    const material* mat = nullptr;
+    uint32_t object_id = 0;
+
+    double power = 0.0;         //Emitted luminance times area and pi
+    aabb bounds;
+    light_cone cone;
+
+    light_source(const sphere& s);
+    light_source(const hittable_rect& r);
+
+    ///Direction from p toward a point of the light, with the distance to it, its radiance and the solid angle pdf
+    inline bool sample(const point3& p, double u, double v, vec3& direction, double& distance, color& radiance, double& pdf) const;
+
+    ///Solid angle pdf sample() has for the point hit on the light, seen from p
+    inline double pdf(const point3& p, const point3& hit) const;
+
+    ///Ray leaving a point of the light, uniform over its area and cosine weighted around the normal
+    ///(rects pick a face with s), with the power it carries: its radiance over the pdf of the two
+    inline void emit(double u, double v, double s, double t, ray& r, color& power) const;
+};
+
+
+light_source::light_source(const sphere& s)
+    : shape(light_sphere), a(s.get_center()), b(s.get_center()), radius(s.get_radius()), mat(s.get_material()), object_id(s.object_id){
+    const vec3 extent(radius, radius, radius);
+    bounds = aabb(a - extent, a + extent);
+    power = luminance(mat->emitted(0.5, 0.5, a)) * 4*pi*radius*radius * pi;
+    cone = {vec3(0, 1, 0), pi, pi / 2};
+}
+
+
+light_source::light_source(const hittable_rect& r)
+    : shape(light_rect), a(r.get_corner()), b(r.get_opposite_corner()), mat(r.get_material()), object_id(r.object_id){
+    ax_k = a.x() == b.x() ? 0 : (a.y() == b.y() ? 1 : 2);
+    ax_1 = ax_k == 0 ? 1 : 0;
+    ax_2 = ax_k == 2 ? 1 : 2;
+    bounds = aabb(point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z())),
+                  point3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z())));
+    const double area = fabs((b[ax_1] - a[ax_1]) * (b[ax_2] - a[ax_2]));
+
+    //Rects emit from both faces, the cone has to cover the two normals
+    power = luminance(mat->emitted(0.5, 0.5, (a + b) / 2)) * 2*area * pi;
+    vec3 normal(0, 0, 0);
+    normal[ax_k] = 1;
+    cone = {normal, pi, pi / 2};
+}
+
+
+inline bool light_source::sample(const point3& p, double u, double v, vec3& direction, double& distance, color& radiance, double& pdf) const{
+    if (shape == light_sphere){
+        const vec3 d = a - p;
+        const double dist2 = d.length_squared();
+        if (dist2 <= radius*radius) return false;
+
+        //Uniform in the cone of the sphere, 1 - cos_max written so it keeps its digits for far lights
+        const double sin2_max = radius*radius / dist2;
+        const double cos_max = sqrt(fmax(0.0, 1 - sin2_max));
+        const double one_minus_cos = sin2_max / (1 + cos_max);
+        const double cos_t = 1 - u * one_minus_cos;
+        const double sin_t = sqrt(fmax(0.0, 1 - cos_t*cos_t));
+        const double phi = 2*pi*v;
+        const double dist = sqrt(dist2);
+        const vec3 axis = d / dist;
+        vec3 t, bt;
+        orthonormal_basis(axis, t, bt);
+        direction = sin_t*cos(phi)*t + sin_t*sin(phi)*bt + cos_t*axis;
+
+        distance = dist*cos_t - sqrt(fmax(0.0, radius*radius - dist2*sin_t*sin_t));
+        const point3 hit = p + distance*direction;
+        const uv coords = sphere::get_sphere_uv((hit - a) / radius);
+        radiance = mat->emitted(coords.u, coords.v, hit);
+        pdf = 1 / (2*pi * one_minus_cos);
+        return true;
+    }
+
+    point3 q;
+    q[ax_1] = a[ax_1] + u * (b[ax_1] - a[ax_1]);
+    q[ax_2] = a[ax_2] + v * (b[ax_2] - a[ax_2]);
+    q[ax_k] = a[ax_k];
+    const vec3 d = q - p;
+    const double dist2 = d.length_squared();
+    distance = sqrt(dist2);
+    direction = d / distance;
+    const double cosine = fabs(direction[ax_k]);
+    if (cosine < 1e-9) return false;
+    radiance = mat->emitted(u, v, q);
+    pdf = dist2 / (cosine * fabs((b[ax_1] - a[ax_1]) * (b[ax_2] - a[ax_2])));
+    return true;
+}
+
+
+inline double light_source::pdf(const point3& p, const point3& hit) const{
+    if (shape == light_sphere){
+        const double dist2 = (a - p).length_squared();
+        if (dist2 <= radius*radius) return 0.0;
+        const double sin2_max = radius*radius / dist2;
+        return 1 / (2*pi * sin2_max / (1 + sqrt(fmax(0.0, 1 - sin2_max))));
+    }
+    const vec3 d = hit - p;
+    const double dist2 = d.length_squared();
+    const double cosine = fabs(d[ax_k]) / sqrt(dist2);
+    if (cosine < 1e-9) return 0.0;
+    return dist2 / (cosine * fabs((b[ax_1] - a[ax_1]) * (b[ax_2] - a[ax_2])));
+}
+
+
+inline void light_source::emit(double u, double v, double s, double t, ray& r, color& power) const{
+    if (shape == light_sphere){
+        const vec3 normal = warp_sphere(u, v);
+        const point3 p = a + radius * normal;
+        const uv coords = sphere::get_sphere_uv(normal);
+        r = ray(p, warp_cosine_hemisphere(normal, s, t));
+        power = mat->emitted(coords.u, coords.v, p) * (pi * 4*pi*radius*radius);
+        return;
+    }
+
+    point3 q;
+    q[ax_1] = a[ax_1] + u * (b[ax_1] - a[ax_1]);
+    q[ax_2] = a[ax_2] + v * (b[ax_2] - a[ax_2]);
+    q[ax_k] = a[ax_k];
+    vec3 normal(0, 0, 0);
+    normal[ax_k] = s < 0.5 ? 1 : -1;
+    s = s < 0.5 ? 2*s : 2*s - 1;
+    r = ray(q, warp_cosine_hemisphere(normal, s, t));
+    power = mat->emitted(u, v, q) * (pi * 2*fabs((b[ax_1] - a[ax_1]) * (b[ax_2] - a[ax_2])));
+}
+
+
+
+
+class light_tree{
+  public:
+    //Constructors
+    light_tree() {}
+    light_tree(std::vector<light_source> sources){build(std::move(sources));}
+
+    //Functionality
+    void build(std::vector<light_source> sources);
+    bool empty() const {return lights.empty();}
+    size_t size() const {return lights.size();}
+    const std::vector<light_source>& sources() const {return lights;}
+
+    ///Light picked for a shading point at p with normal n (zero for points without a hemisphere), null if none can reach it
+    inline const light_source* sample(const point3& p, const vec3& n, double u, double& pdf) const;
+
+    ///Probability sample() has to pick light from p and n
+    inline double pdf(const point3& p, const vec3& n, const light_source& light) const;
+
+    ///Light made from the primitive with this object id, null if it isn't one
+    inline const light_source* find(uint32_t object_id) const;
+
+  private:
+    static const uint32_t no_light = 0xffffffffu;
+    static const int split_bins = 12;
+
+    //What importance() reads, the cone angles as cosines and sines
+    struct light_node{
+        point3 center;      //Of the bounds
+        double radius2;     //Squared half diagonal of the bounds
+        vec3 axis;
+        double cos_o, sin_o, cos_e;
+        double power;
+        uint32_t right;     //Right child of inner nodes, the left one is always the next node
+        uint32_t light;     //Light of leaves, no_light for inner nodes
+        uint32_t parent;
+    };
+
+    std::vector<light_source> lights;
+    std::vector<light_node> nodes;
+    std::vector<uint32_t> leaf_of;                          //Leaf node of every light
+    std::vector<std::pair<uint32_t, uint32_t>> by_object;   //Sorted (object id, light)
+
+    uint32_t build_node(std::vector<uint32_t>& order, uint32_t start, uint32_t end, uint32_t parent);
+    static inline double importance(const light_node& node, const point3& p, const vec3& n);
+};
+
+
+void light_tree::build(std::vector<light_source> sources){
+    TRACE_SCOPE("light tree build");
+    lights = std::move(sources);
+    nodes.clear();
+    leaf_of.assign(lights.size(), 0);
+    by_object.clear();
+    for (uint32_t i=0; i<lights.size(); i++){by_object.push_back({lights[i].object_id, i});}
+    std::sort(by_object.begin(), by_object.end());
+    if (lights.empty()) return;
+
+    std::vector<uint32_t> order(lights.size());
+    for (uint32_t i=0; i<order.size(); i++){order[i] = i;}
+    nodes.reserve(2 * lights.size());
+    build_node(order, 0, (uint32_t)order.size(), no_light);
+}
+
+
+///Binned split minimizing power times surface area times orientation measure on both sides
+uint32_t light_tree::build_node(std::vector<uint32_t>& order, uint32_t start, uint32_t end, uint32_t parent){
+    const uint32_t index = (uint32_t)nodes.size();
+    nodes.push_back(light_node());
+    {
+        const light_source& first = lights[order[start]];
+        aabb bounds = first.bounds;
+        light_cone cone = first.cone;
+        double power = first.power;
+        for (uint32_t i=start+1; i<end; i++){
+            const light_source& l = lights[order[i]];
+            bounds = box_including(bounds, l.bounds);
+            cone = light_cone::merge(cone, l.cone);
+            power += l.power;
+        }
+
+        light_node& node = nodes[index];
+        node.center = (bounds.min() + bounds.max()) / 2;
+        node.radius2 = (bounds.max() - bounds.min()).length_squared() / 4;
+        node.axis = cone.axis;
+        node.cos_o = cos(cone.theta_o); node.sin_o = sin(cone.theta_o);
+        node.cos_e = cos(cone.theta_e);
+        node.power = power;
+        node.parent = parent;
+        node.right = 0;
+        node.light = no_light;
+    }
+    if (end - start == 1){
+        nodes[index].light = order[start];
+        leaf_of[order[start]] = index;
+        return index;
+    }
+
+    //Centroid bounds
+    point3 lo = (lights[order[start]].bounds.min() + lights[order[start]].bounds.max()) / 2, hi = lo;
+    for (uint32_t i=start; i<end; i++){
+        const point3 c = (lights[order[i]].bounds.min() + lights[order[i]].bounds.max()) / 2;
+        for (int a=0; a<3; a++){lo[a] = fmin(lo[a], c[a]); hi[a] = fmax(hi[a], c[a]);}
+    }
+
+    auto cost = [](double power, const aabb& box, const light_cone& cone){return power * (box.surface_area() + 1e-12) * cone.measure();};
+    int best_axis = -1, best_bin = 0;
+    double best_cost = infinity;
+    for (int a=0; a<3; a++){
+        const double extent = hi[a] - lo[a];
+        if (extent <= 0) continue;
+
+        struct bin{int count = 0; double power = 0; aabb box; light_cone cone;};
+        bin bins[split_bins];
+        for (uint32_t i=start; i<end; i++){
+            const light_source& l = lights[order[i]];
+            const double c = (l.bounds.min()[a] + l.bounds.max()[a]) / 2;
+            bin& b = bins[std::min((int)((c - lo[a]) / extent * split_bins), split_bins - 1)];
+            if (b.count++ == 0){b.box = l.bounds; b.cone = l.cone;}
+            else {b.box = box_including(b.box, l.bounds); b.cone = light_cone::merge(b.cone, l.cone);}
+            b.power += l.power;
+        }
+
+        //Left side of every split from a prefix sweep, right side from a suffix sweep
+        double right_cost[split_bins] = {0};
+        bin acc;
+        for (int i=split_bins-1; i>0; i--){
+            if (bins[i].count){
+                if (acc.count == 0){acc.box = bins[i].box; acc.cone = bins[i].cone;}
+                else {acc.box = box_including(acc.box, bins[i].box); acc.cone = light_cone::merge(acc.cone, bins[i].cone);}
+                acc.count += bins[i].count; acc.power += bins[i].power;
+            }
+            right_cost[i] = acc.count ? cost(acc.power, acc.box, acc.cone) : infinity;
+        }
+        acc = bin();
+        for (int i=0; i<split_bins-1; i++){
+            if (bins[i].count){
+                if (acc.count == 0){acc.box = bins[i].box; acc.cone = bins[i].cone;}
+                else {acc.box = box_including(acc.box, bins[i].box); acc.cone = light_cone::merge(acc.cone, bins[i].cone);}
+                acc.count += bins[i].count; acc.power += bins[i].power;
+            }
+            if (acc.count == 0 || acc.count == (int)(end - start)) continue;
+            const double c = cost(acc.power, acc.box, acc.cone) + right_cost[i+1];
+            if (c < best_cost){best_cost = c; best_axis = a; best_bin = i;}
+        }
+    }
+
+    //Split where the cost is lowest, in halves when every centroid is the same
+    uint32_t mid;
+    if (best_axis < 0){
+        mid = (start + end) / 2;
+    }else{
+        const int a = best_axis;
+        const double extent = hi[a] - lo[a];
+        mid = (uint32_t)(std::partition(order.begin() + start, order.begin() + end, [&](uint32_t i){
+            const double c = (lights[i].bounds.min()[a] + lights[i].bounds.max()[a]) / 2;
+            return std::min((int)((c - lo[a]) / extent * split_bins), split_bins - 1) <= best_bin;
+        }) - order.begin());
+    }
+
+    build_node(order, start, mid, index);
+    const uint32_t right = build_node(order, mid, end, index);
+    nodes[index].right = right;
+    return index;
+}
+
+
+///Upper bound of what the lights of node send toward p, the angles are widened by the ones the box spans.
+///Differences of angles clamped at 0 are taken on their cosines and sines, there's no trigonometry
+inline double light_tree::importance(const light_node& node, const point3& p, const vec3& n){
+    const vec3 d = node.center - p;
+    const double dist2 = d.length_squared();
+
+    //Inside the bounds every direction is possible
+    if (dist2 <= node.radius2){return node.power / fmax(node.radius2, 1e-12);}
+
+    const double inv_dist = 1 / sqrt(dist2);
+    const vec3 dir = d * inv_dist;
+    const double sin_u = sqrt(node.radius2 / dist2), cos_u = sqrt(1 - sin_u*sin_u);
+
+    //cos and sin of max(0, a - b)
+    auto cos_sub = [](double sin_a, double cos_a, double sin_b, double cos_b){return cos_a > cos_b ? 1.0 : cos_a*cos_b + sin_a*sin_b;};
+    auto sin_sub = [](double sin_a, double cos_a, double sin_b, double cos_b){return cos_a > cos_b ? 0.0 : sin_a*cos_b - cos_a*sin_b;};
+
+    //Emitter side, angle between the cone and the direction toward p, minus the cone and the box
+    const double cos_t = clamp(-dot(node.axis, dir), -1.0, 1.0), sin_t = sqrt(1 - cos_t*cos_t);
+    const double cos_x = cos_sub(sin_t, cos_t, node.sin_o, node.cos_o), sin_x = sin_sub(sin_t, cos_t, node.sin_o, node.cos_o);
+    const double cos_e = cos_sub(sin_x, cos_x, sin_u, cos_u);
+    if (cos_e <= node.cos_e) return 0.0;
+
+    //Receiver side, the hemisphere of the shading point
+    double cos_i = 1.0;
+    if (n.length_squared() > 0){
+        const double cos_n = clamp(dot(n, dir), -1.0, 1.0), sin_n = sqrt(1 - cos_n*cos_n);
+        cos_i = cos_sub(sin_n, cos_n, sin_u, cos_u);
+        if (cos_i <= 0) return 0.0;
+    }
+    return node.power * cos_e * cos_i / dist2;
+}
+
+
+inline const light_source* light_tree::sample(const point3& p, const vec3& n, double u, double& pdf) const{
+    if (lights.empty()) return nullptr;
+    uint32_t index = 0;
+    pdf = 1.0;
+    while (nodes[index].light == no_light){
+        const double left = importance(nodes[index + 1], p, n);
+        const double right = importance(nodes[nodes[index].right], p, n);
+        if (left + right <= 0) return nullptr;
+        const double p_left = left / (left + right);
+        if (u < p_left){u = fmin(u / p_left, 0.9999999); index = index + 1; pdf *= p_left;}
+        else {u = fmin((u - p_left) / (1 - p_left), 0.9999999); index = nodes[index].right; pdf *= 1 - p_left;}
+    }
+    return &lights[nodes[index].light];
+}
+
+
+inline double light_tree::pdf(const point3& p, const vec3& n, const light_source& light) const{
+    double pdf = 1.0;
+    uint32_t index = leaf_of[&light - lights.data()];
+    while (nodes[index].parent != no_light){
+        const uint32_t parent = nodes[index].parent;
+        const double left = importance(nodes[parent + 1], p, n);
+        const double right = importance(nodes[nodes[parent].right], p, n);
+        if (left + right <= 0) return 0.0;
+        pdf *= (index == parent + 1 ? left : right) / (left + right);
+        index = parent;
+    }
+    return pdf;
+}
+
+
+inline const light_source* light_tree::find(uint32_t object_id) const{
+    const auto it = std::lower_bound(by_object.begin(), by_object.end(), std::make_pair(object_id, 0u));
+    return it != by_object.end() && it->first == object_id ? &lights[it->second] : nullptr;
+}
+
+
+
+#endif // __RENDER_LIGHTS_H_
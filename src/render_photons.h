@@ -0,0 +1,301 @@
+#ifndef __RENDER_PHOTONS_H_
+#define __RENDER_PHOTONS_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+//Include OpemMP for the photon pass
+#include <omp.h>
+
+#include "utils.h"
+#include "hittable_abstract.h"
+#include "render_lights.h"
+#include "render_threads.h"
+
+
+/*
+** Photon mapped caustics
+**
+** Light reaching a diffuse surface through glass or mirrors (L S+ D paths) is found by camera paths
+** only when a bounce leaves the surface in the few directions that go through the specular objects
+** and end on a light, with small lights that almost never happens. A photon pass follows those
+** paths the other way: photons leave points of the emitters in the light tree, picked by power, go
+** through the specular bounces and are kept where they land on the first diffuse surface (photons
+** reaching one before any specular bounce are direct light, the light samples handle it).
+** Every diffuse point of a camera path adds the caustic it gets, from the density of the photons
+** around it, and the emitters the path then finds through specular bounces are skipped, those
+** paths are the photons. Caustics seen directly or through other surfaces (lighting the walls
+** around them) are both read from the map.
+** Photons are traced in parallel, every thread its range of photon indices, and sorted in a hash
+** grid of cells twice the gather radius wide, so a gather reads at most 8 cells. A pass keeps no more
+** photons than fit in max_bytes.
+** Progressive (probabilistic progressive photon mapping, Knaus and Zwicker 2011): every pass traces
+** new photons and the radius shrinks, r^2 times (k + alpha) / (k + 1) after pass k, so the average
+** of the passes converges to the caustic. Otherwise the first map is kept until the scene changes.
+ */
+
+class photon_map{
+  public:
+    //Settings, read at every photon pass
+    int photons = 1 << 17;                  //Emitted per pass
+    double radius = 0.05;                   //Gather radius of the first pass
+    double alpha = 2.0 / 3.0;               //Smaller shrinks the radius faster
+    bool progressive = true;                //New photons every pass, or the first ones until the scene changes
+    int max_depth = 8;                      //Bounces of a photon
+    size_t max_bytes = (size_t)64 << 20;
+
+    ///Traces the photons of a pass if it needs new ones, returns the rays traced
+    uint64_t prepare(const hittable& objects, const light_tree* lights, uint64_t scene_revision);
+
+    ///Counts a finished pass, the next one gets a smaller radius
+    void end_pass();
+
+    ///Drops the photons, the next pass traces new ones from radius, e.g. when the accumulation restarts
+    void restart(){traced_revision = 0; pass = 0; built = false; stored_count = 0;}
+
+    bool ready() const {return built;}
+    size_t stored() const {return stored_count;}
+    double gather_radius() const {return sqrt(radius2);}
+    size_t bytes() const {return (size_t)capacity * bytes_per_photon;}
+
+    ///Caustic radiance leaving rec toward the origin of r_in, from the photons within the radius
+    inline color gather(const ray& r_in, const hit_record& rec) const;
+
+    ///If the photons start from the emitter with this object id
+    inline bool covers(uint32_t object_id) const {return lights && lights->find(object_id);}
+
+  private:
+    struct photon{
+        float position[3];
+        float power[3];
+        uint32_t direction;     //Toward where it came from, 10 bits per axis
+    };
+
+    //Raw photons, the cell of each, photon indices by cell, the photons by cell and where every cell starts
+    static const size_t bytes_per_photon = 2 * sizeof(photon) + 6 * sizeof(uint32_t);
+    std::vector<photon> traced, sorted;
+    std::vector<uint32_t> cell_of, order, cell_start;
+    std::unique_ptr<std::atomic<uint32_t>[]> cursor;
+    uint32_t capacity = 0, mask = 0;
+    size_t stored_count = 0;
+
+    const light_tree* lights = nullptr;
+    std::vector<double> light_cdf;
+    uint64_t traced_revision = 0;
+    uint32_t first_index = 0;               //Photon index the next pass starts from, passes continue the sequence
+    int pass = 0;
+    double radius2 = 0.0, cell_size = 1.0;
+    bool built = false;
+
+    static inline uint32_t pack_direction(const vec3& d);
+    static inline vec3 unpack_direction(uint32_t d);
+    inline uint32_t cell_hash(int x, int y, int z) const {
+        return ((uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u) & mask;
+    }
+    inline int cell_coord(double x) const {return (int)floor(x / cell_size);}
+
+    uint64_t trace(const hittable& objects, uint32_t count);
+};
+
+
+inline uint32_t photon_map::pack_direction(const vec3& d){
+    uint32_t packed = 0;
+    for (int a=0; a<3; a++){packed |= (uint32_t)std::min(std::max((d[a] + 1.0) * 511.5, 0.0), 1023.0) << (10*a);}
+    return packed;
+}
+
+inline vec3 photon_map::unpack_direction(uint32_t d){
+    vec3 v;
+    for (int a=0; a<3; a++){v[a] = ((d >> (10*a)) & 1023) / 511.5 - 1.0;}
+    return unit_vector(v);
+}
+
+
+uint64_t photon_map::prepare(const hittable& objects, const light_tree* tree, uint64_t scene_revision){
+    const bool fresh = scene_revision != traced_revision;
+    if (!fresh && !progressive) return 0;
+    if (fresh){
+        traced_revision = scene_revision;
+        pass = 0;
+        first_index = 0;
+    }
+    if (pass == 0){radius2 = radius * radius;}
+
+    //Emitters picked by power
+    lights = tree && !tree->empty() ? tree : nullptr;
+    light_cdf.clear();
+    if (lights){
+        double total = 0.0;
+        for (const light_source& l : lights->sources()){light_cdf.push_back(total += l.power);}
+    }
+    const uint32_t count = (uint32_t)std::min<size_t>(std::max(photons, 0), max_bytes / bytes_per_photon);
+    if (!lights || light_cdf.back() <= 0.0 || count == 0){built = false; stored_count = 0; return 0;}
+
+    TRACE_SCOPE("photon pass");
+    return trace(objects, count);
+}
+
+
+void photon_map::end_pass(){
+    if (!built || !progressive) return;
+    pass++;
+    radius2 *= (pass + alpha) / (pass + 1);
+}
+
+
+uint64_t photon_map::trace(const hittable& objects, uint32_t count){
+    //Storage for count photons and a table of at least as many cells, kept across passes
+    if (count > capacity){
+        capacity = count;
+        traced.resize(count); sorted.resize(count);
+        cell_of.resize(count); order.resize(count);
+        uint32_t cells = 1;
+        while (cells < count){cells *= 2;}
+        mask = cells - 1;
+        cell_start.resize(cells + 1);
+        cursor.reset(new std::atomic<uint32_t>[cells]);
+    }
+    const uint32_t cells = mask + 1;
+    cell_size = 2 * sqrt(radius2);
+    for (uint32_t c=0; c<cells; c++){cursor[c].store(0, std::memory_order_relaxed);}
+
+    const std::vector<light_source>& sources = lights->sources();
+    const double total_power = light_cdf.back();
+    const uint32_t stream = 0x70686f74u;
+    uint64_t rays = 0;
+    int threads = 1;
+    std::vector<int> stored(omp_get_max_threads() + 1, 0);
+
+    #pragma omp parallel reduction(+:rays)
+    {
+        #pragma omp single
+        threads = omp_get_num_threads();
+        int begin, end;
+        const int t = omp_get_thread_num();
+        thread_range((int)count, t, threads, begin, end);
+
+        //Trace the photons of the range, the kept ones are packed at its start
+        int kept = begin;
+        for (int i=begin; i<end; i++){
+            sampler_begin_stream(0, 0, first_index + (uint32_t)i, stream, sampler_sobol);
+            sampler_bounce();
+            const double pick = sample_1d();
+            double u, v, s, w;
+            sample_2d(u, v);
+            sample_2d(s, w);
+            const size_t l = std::min<size_t>(std::upper_bound(light_cdf.begin(), light_cdf.end(), pick * total_power) - light_cdf.begin(), sources.size() - 1);
+            if (sources[l].power <= 0.0) continue;
+
+            ray r;
+            color power;
+            sources[l].emit(u, v, s, w, r, power);
+            power /= sources[l].power / total_power * count;
+
+            bool specular = false;
+            for (int depth=0; depth<max_depth; depth++){
+                rays++;
+                hit_record rec;
+                if (!objects.hit(r, 0.001, infinity, rec)) break;
+                sampler_bounce();
+                ray scattered;
+                color attenuation, f;
+                double pdf;
+                if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered) || rec.mat_ptr->is_volume()) break;
+
+                //First diffuse surface, kept if the photon went through a specular bounce on the way
+                if (rec.mat_ptr->eval(r, rec, rec.normal, f, pdf)){
+                    if (specular && power.length_squared() > 0.0){
+                        photon& ph = traced[kept++];
+                        const vec3 from = -unit_vector(r.direction());
+                        for (int a=0; a<3; a++){ph.position[a] = (float)rec.p[a]; ph.power[a] = (float)power[a];}
+                        ph.direction = pack_direction(from);
+                    }
+                    break;
+                }
+                specular = true;
+                power = power * attenuation;
+                r = scattered;
+            }
+        }
+        stored[t + 1] = kept - begin;
+        for (int i=begin; i<kept; i++){
+            const float* p = traced[i].position;
+            cell_of[i] = cell_hash(cell_coord(p[0]), cell_coord(p[1]), cell_coord(p[2]));
+            cursor[cell_of[i]].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        //Cell offsets, then every thread scatters its photons to their cell
+        #pragma omp barrier
+        #pragma omp single
+        {
+            uint32_t sum = 0;
+            for (uint32_t c=0; c<cells; c++){
+                cell_start[c] = sum;
+                sum += cursor[c].load(std::memory_order_relaxed);
+                cursor[c].store(cell_start[c], std::memory_order_relaxed);
+            }
+            cell_start[cells] = sum;
+        }
+        for (int i=begin; i<kept; i++){order[cursor[cell_of[i]].fetch_add(1, std::memory_order_relaxed)] = i;}
+
+        //Photon index order inside the cells, so the sums don't depend on the threads
+        #pragma omp barrier
+        #pragma omp for schedule(dynamic, 1024)
+        for (uint32_t c=0; c<cells; c++){
+            const uint32_t a = cell_start[c], b = cell_start[c+1];
+            if (b - a > 1){std::sort(order.begin() + a, order.begin() + b);}
+            for (uint32_t k=a; k<b; k++){sorted[k] = traced[order[k]];}
+        }
+    }
+
+    stored_count = 0;
+    for (int t=1; t<=threads; t++){stored_count += stored[t];}
+    first_index += count;
+    built = true;
+    return rays;
+}
+
+
+inline color photon_map::gather(const ray& r_in, const hit_record& rec) const{
+    color sum(0,0,0);
+    if (stored_count == 0) return sum;
+
+    //The cells the sphere of the radius overlaps, each read once. Cells are 2r wide so it spans 2 per
+    //axis at most, rounding of p+r can reach a third one the sphere doesn't touch
+    const double r = sqrt(radius2);
+    int lo[3], hi[3];
+    for (int a=0; a<3; a++){lo[a] = cell_coord(rec.p[a] - r); hi[a] = std::min(cell_coord(rec.p[a] + r), lo[a] + 1);}
+    uint32_t visited[8];
+    int n = 0;
+    for (int x=lo[0]; x<=hi[0]; x++){
+        for (int y=lo[1]; y<=hi[1]; y++){
+            for (int z=lo[2]; z<=hi[2]; z++){
+                const uint32_t c = cell_hash(x, y, z);
+                if (std::find(visited, visited + n, c) != visited + n) continue;
+                visited[n++] = c;
+
+                for (uint32_t k=cell_start[c]; k<cell_start[c+1]; k++){
+                    const photon& ph = sorted[k];
+                    const vec3 d(ph.position[0] - rec.p.x(), ph.position[1] - rec.p.y(), ph.position[2] - rec.p.z());
+                    if (d.length_squared() > radius2) continue;
+
+                    //BSDF without the cosine, the photon power is already per area
+                    const vec3 from = unpack_direction(ph.direction);
+                    color f;
+                    double pdf;
+                    if (!rec.mat_ptr->eval(r_in, rec, from, f, pdf)) continue;
+                    sum += f / dot(rec.normal, from) * color(ph.power[0], ph.power[1], ph.power[2]);
+                }
+            }
+        }
+    }
+    return sum / (pi * radius2);
+}
+
+
+
+#endif // __RENDER_PHOTONS_H_
@@ -0,0 +1,167 @@
+#ifndef __RENDER_PRIMARY_H_
+#define __RENDER_PRIMARY_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <memory>
+#include <algorithm>
+
+#include "utils.h"
+#include "camera.h"
+#include "hittable_abstract.h"
+#include "render_film.h"
+#include "render_threads.h"
+
+
+/*
+** Primary hit cache
+**
+** While the camera holds still every pass would trace the same kind of camera rays again. With
+** the cache set on a render_control, a pixel keeps a fixed set of subsamples (the first ones of
+** its sequence, pixel jitter and lens) and sample s of the pixel is subsample s % slots: the first
+** pass to reach a subsample traces it and stores its first hit, the later ones start the path from
+** there. The bounces of every subsample continue a sampler stream of their own, so the paths stay
+** as well stratified as without the cache, only anti-aliasing and depth of field stop at slots
+** samples per pixel.
+** Objects whose hits are random (media) aren't cached, they are traced again by every sample in
+** front of the cached hit.
+** A record is 40 bytes in the film's tile layout. The slots per pixel are capped by max_bytes, and
+** the whole cache is dropped in O(1) (a generation bump) when the image size, camera, sampler or
+** scene revision it was filled for changes.
+ */
+
+///First hit of a subsample on the cached objects, t is infinity if it misses them all
+struct primary_hit{
+    uint32_t generation : 31;   //Filled for the cache generation, 0 never
+    uint32_t front_face : 1;
+    uint32_t object_id;
+    float t;
+    float u, v;
+    float normal[3];            //Facing the ray
+    const material* mat_ptr;
+
+    inline void write(const hit_record& rec){
+        t = (float)rec.t; u = (float)rec.u; v = (float)rec.v;
+        normal[0] = (float)rec.normal.x(); normal[1] = (float)rec.normal.y(); normal[2] = (float)rec.normal.z();
+        mat_ptr = rec.mat_ptr; object_id = rec.object_id; front_face = rec.front_face;
+    }
+
+    ///The hit record of camera ray r, false for a miss
+    inline bool read(const ray& r, hit_record& rec) const {
+        if (t == infinity) return false;
+        rec.t = t; rec.u = u; rec.v = v;
+        rec.p = r.at(rec.t);
+        rec.normal = vec3(normal[0], normal[1], normal[2]);
+        rec.mat_ptr = mat_ptr; rec.object_id = object_id; rec.front_face = front_face;
+        return true;
+    }
+};
+
+
+class primary_cache{
+  public:
+    //Fixed subsamples per pixel, and the most memory they may take (fewer slots are kept past it)
+    int subsamples = 4;
+    size_t max_bytes = (size_t)256 << 20;
+
+    ///Gets the cache ready for a pass of film seen through cam, empty unless it was filled for the same
+    ///image, view, sampler and scene revision. False when not even one slot per pixel fits in max_bytes
+    template<typename T>
+    bool prepare(const film_t<T>& film, const camera& cam, uint64_t scene_revision);
+
+    ///Drops every record, the next passes trace them again
+    void invalidate();
+
+    int slots() const {return slot_count;}
+    size_t bytes() const {return (size_t)tile_count * film::tile_pixels * slot_count * sizeof(primary_hit);}
+
+    ///Record of subsample slot of pixel (x, y), filled() tells if it holds a hit of the current generation
+    inline primary_hit& at(int x, int y, int slot){return records.get()[index(x, y) + slot];}
+    inline bool filled(const primary_hit& h) const {return h.generation == generation;}
+    inline void fill(primary_hit& h, const hit_record* rec){
+        if (rec){h.write(*rec);}
+        else {h.t = infinity;}
+        h.generation = generation;
+    }
+
+  private:
+    struct aligned_free{void operator()(primary_hit* p) const {free(p);}};
+
+    int w = 0, h = 0, tiles_x = 0, tile_count = 0, slot_count = 0;
+    size_t capacity = 0;
+    std::unique_ptr<primary_hit, aligned_free> records;
+    uint32_t generation = 1;
+
+    //What the records were filled for
+    camera view = camera(point3(0,0,1), point3(0,0,0), vec3(0,1,0), 90.0, 1.0, 0.0, 1.0);
+    sampler_type sampler = sampler_types;
+    uint64_t revision = 0;
+
+    inline size_t index(int x, int y) const {
+        const int size = film::tile_size;
+        const int tile = (y / size) * tiles_x + (x / size);
+        return ((size_t)tile * film::tile_pixels + (y % size) * size + (x % size)) * slot_count;
+    }
+
+    static bool same_view(const camera& a, const camera& b);
+};
+
+
+///Every field get_ray() reads
+bool primary_cache::same_view(const camera& a, const camera& b){
+    const vec3* va[] = {&a.origin, &a.lower_left_corner, &a.horizontal, &a.vertical, &a.u, &a.v};
+    const vec3* vb[] = {&b.origin, &b.lower_left_corner, &b.horizontal, &b.vertical, &b.u, &b.v};
+    for (int i=0; i<6; i++){
+        for (int c=0; c<3; c++){if ((*va[i])[c] != (*vb[i])[c]) return false;}
+    }
+    return a.lens_radius == b.lens_radius;
+}
+
+
+template<typename T>
+bool primary_cache::prepare(const film_t<T>& film, const camera& cam, uint64_t scene_revision){
+    const size_t pixels = (size_t)film.tile_count() * film::tile_pixels;
+    const int fitting = (int)std::min<size_t>(std::max(subsamples, 0), max_bytes / (pixels * sizeof(primary_hit)));
+    if (fitting < 1){slot_count = 0; return false;}
+
+    const bool same = film.width() == w && film.height() == h && fitting == slot_count &&
+                      active_sampler == sampler && scene_revision == revision && same_view(cam, view);
+    if (same) return true;
+
+    w = film.width(); h = film.height();
+    tiles_x = (w + film::tile_size - 1) / film::tile_size;
+    tile_count = film.tile_count();
+    slot_count = fitting;
+    view = cam; sampler = active_sampler; revision = scene_revision;
+    invalidate();
+
+    //New storage is first touched in the film's tile order, by the thread the tiles go to first
+    if (bytes() > capacity){
+        records.reset(static_cast<primary_hit*>(aligned_alloc(64, bytes())));
+        if (!records){slot_count = 0; capacity = 0; return false;}     //The pass runs uncached
+        capacity = bytes();
+        const std::vector<uint32_t>& order = film.tile_order();
+        const size_t tile_records = (size_t)film::tile_pixels * slot_count;
+        #pragma omp parallel
+        {
+            int begin, end;
+            thread_range(tile_count, omp_get_thread_num(), omp_get_num_threads(), begin, end);
+            for (int k=begin; k<end; k++){memset(records.get() + order[k] * tile_records, 0, tile_records * sizeof(primary_hit));}
+        }
+        generation = 1;
+    }
+    return true;
+}
+
+
+///Records of older generations read as empty, they're only zeroed when the counter wraps
+void primary_cache::invalidate(){
+    if (++generation < (1u << 31)) return;
+    generation = 1;
+    if (records){memset(records.get(), 0, capacity);}
+}
+
+
+
+#endif // __RENDER_PRIMARY_H_
@@ -0,0 +1,175 @@
+#ifndef __RENDER_RESOLVE_H_
+#define __RENDER_RESOLVE_H_
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+//Include OpemMP for multithreading
+#include <omp.h>
+
+
+/*
+** Film resolve
+**
+** Turns summed radiance into packed 8 bit rgb (r in the low byte, like the SDL ABGR8888 texture).
+** Exposure and the tonemap operator run as float math on blocks of channels the compiler
+** vectorizes, the output transfer (gamma 2 or sRGB) and quantization are one lookup in a
+** 64K entry table, so there are no sqrt/pow calls per pixel.
+ */
+
+enum tonemap_operator{tonemap_clamp, tonemap_reinhard, tonemap_aces, tonemap_operators};
+enum output_transfer{transfer_gamma2, transfer_srgb};
+
+const char* const tonemap_names[tonemap_operators] = {"clamp", "reinhard", "aces"};
+
+struct resolve_settings{
+    double exposure = 0.0;                      //In stops
+    tonemap_operator tonemap = tonemap_clamp;
+    output_transfer transfer = transfer_gamma2; //Gamma 2 is what the renderer always showed
+};
+
+
+class film_resolver{
+  public:
+    film_resolver(){configure(resolve_settings());}
+
+    void configure(const resolve_settings& settings);
+    const resolve_settings& settings() const {return current;}
+
+    ///Resolves count pixels of summed rgb, scale is usually 1/samples
+    void resolve_row(const double* acc, int count, double scale, uint32_t* out) const;
+
+    ///Resolves rows [first_row, first_row+rows) of a width wide image, in parallel
+    void resolve(const double* acc, int width, int first_row, int rows, double scale, uint32_t* out) const;
+
+    ///Resolves count film pixels (summed r, g, b and sample count), each divided by its own count
+    template<typename T> void resolve_weighted(const T* pixels, int count, uint32_t* out) const;
+
+    ///Resolves a whole film (see render_film.h) into a row major image, tiles in parallel
+    template<typename Film> void resolve_film(const Film& f, uint32_t* out) const;
+
+    ///Shared resolver with the default settings
+    static const film_resolver& standard(){static film_resolver resolver; return resolver;}
+
+  private:
+    static const int lut_bits = 16;
+    static const int block = 64;
+
+    resolve_settings current;
+    bool lut_built = false;
+    std::vector<uint8_t> lut;
+
+    template<int OP> void map_block(const float* x, int channels, uint32_t* index) const;
+    void map_and_pack(const float* x, int count, uint32_t* out) const;
+};
+
+
+void film_resolver::configure(const resolve_settings& settings){
+    const bool rebuild = !lut_built || settings.transfer != current.transfer;
+    current = settings;
+    if (!rebuild) return;
+
+    //Linear [0,1] to the 8 bit output value
+    const int size = 1 << lut_bits;
+    lut.resize(size);
+    for (int i=0; i<size; i++){
+        const double x = i / (double)(size-1);
+        double v;
+        if (current.transfer == transfer_srgb){v = (x <= 0.0031308) ? 12.92*x : 1.055*pow(x, 1.0/2.4) - 0.055;}
+        else {v = sqrt(x);}
+        lut[i] = (uint8_t)(256*std::min(std::max(v, 0.0), 0.999));
+    }
+    lut_built = true;
+}
+
+
+///Tonemap and quantization of a block of exposed channels into lut indices
+template<int OP>
+void film_resolver::map_block(const float* exposed, int channels, uint32_t* index) const{
+    const float lut_max = (float)((1 << lut_bits) - 1);
+
+    #pragma omp simd
+    for (int c=0; c<channels; c++){
+        float x = exposed[c];
+        if (OP == tonemap_reinhard){x = x / (1.0f + x);}
+        if (OP == tonemap_aces){x = (x * (2.51f*x + 0.03f)) / (x * (2.43f*x + 0.59f) + 0.14f);}
+        x = (x > 0.0f) ? std::min(x, 1.0f) : 0.0f;     //NaN fails the test and maps to black
+        index[c] = std::min((uint32_t)(x * lut_max + 0.5f), (uint32_t)lut_max);
+    }
+}
+
+
+///Tonemaps and packs up to block pixels of exposed rgb
+void film_resolver::map_and_pack(const float* x, int count, uint32_t* out) const{
+    uint32_t index[block*3];
+    switch (current.tonemap){
+        case tonemap_reinhard: map_block<tonemap_reinhard>(x, count*3, index); break;
+        case tonemap_aces:     map_block<tonemap_aces>(x, count*3, index); break;
+        default:               map_block<tonemap_clamp>(x, count*3, index); break;
+    }
+    for (int i=0; i<count; i++){
+        out[i] = lut[index[i*3+0]] | (lut[index[i*3+1]] << 8) | (lut[index[i*3+2]] << 16);
+    }
+}
+
+
+void film_resolver::resolve_row(const double* acc, int count, double scale, uint32_t* out) const{
+    const float k = (float)(scale * exp2(current.exposure));
+    float exposed[block*3];
+
+    for (int start=0; start<count; start+=block){
+        const int n = std::min(block, count - start);
+        const double* src = acc + start*3;
+
+        #pragma omp simd
+        for (int c=0; c<n*3; c++){exposed[c] = (float)src[c] * k;}
+        map_and_pack(exposed, n, out + start);
+    }
+}
+
+
+template<typename T>
+void film_resolver::resolve_weighted(const T* pixels, int count, uint32_t* out) const{
+    const float k = (float)exp2(current.exposure);
+    float exposed[block*3];
+
+    for (int start=0; start<count; start+=block){
+        const int n = std::min(block, count - start);
+        const T* src = pixels + start*4;
+
+        #pragma omp simd
+        for (int i=0; i<n; i++){
+            const float samples = (float)src[i*4+3];
+            const float scale = samples > 0.0f ? k / samples : 0.0f;
+            exposed[i*3+0] = (float)src[i*4+0] * scale;
+            exposed[i*3+1] = (float)src[i*4+1] * scale;
+            exposed[i*3+2] = (float)src[i*4+2] * scale;
+        }
+        map_and_pack(exposed, n, out + start);
+    }
+}
+
+
+template<typename Film>
+void film_resolver::resolve_film(const Film& f, uint32_t* out) const{
+    #pragma omp parallel for
+    for (int t=0; t<f.tile_count(); t++){
+        int x0, y0, x1, y1;
+        f.tile_rect(t, x0, y0, x1, y1);
+        for (int y=y0; y<y1; y++){resolve_weighted(f.pixel(x0, y), x1 - x0, out + (size_t)y*f.width() + x0);}
+    }
+}
+
+
+void film_resolver::resolve(const double* acc, int width, int first_row, int rows, double scale, uint32_t* out) const{
+    #pragma omp parallel for
+    for (int j=first_row; j<first_row+rows; j++){
+        resolve_row(acc + (size_t)j*width*3, width, scale, out + (size_t)j*width);
+    }
+}
+
+
+
+#endif // __RENDER_RESOLVE_H_
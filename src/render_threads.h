@@ -0,0 +1,295 @@
+#ifndef __RENDER_THREADS_H_
+#define __RENDER_THREADS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+//Include OpemMP for the thread pool
+#include <omp.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+#include "utils.h"
+
+
+/*
+** Threads, affinity and NUMA
+**
+** cpu_topology reads the NUMA nodes and their CPUs from sysfs, anywhere else (or when the
+** kernel doesn't expose them) it's one node holding every CPU.
+** render_threads says how many threads render and where they run:
+** - affinity_none leaves placement to the OS
+** - affinity_compact fills the CPUs of the first node, then the next one...
+** - affinity_spread deals the threads round robin over the nodes
+** apply_thread_config() pins the OpenMP pool and records the node of every thread (thread_node).
+** Every render thread owns a contiguous range of the film's Morton tile order: film_t::clear()
+** first-touches it from that thread and tile_scheduler hands it out to it first, so the tile
+** pages live on the node that writes them. Threads steal from their node, then from the others.
+** With replicate set, replicate_per_node() copies the static BVHs and primitive arrays of a scene
+** on every node, each thread then traces against its own node's copy.
+ */
+
+enum thread_affinity{affinity_none, affinity_compact, affinity_spread, thread_affinities};
+
+const char* const thread_affinity_names[thread_affinities] = {"none", "compact", "spread"};
+
+struct thread_config{
+    int threads = 0;                            //0 for one per CPU
+    thread_affinity affinity = affinity_none;
+    bool replicate = false;                     //Copy the hot scene data on every node
+};
+
+//Read by apply_thread_config()
+inline thread_config render_threads;
+
+//Node of the calling thread, set when it's placed
+inline thread_local int thread_node = 0;
+
+
+
+///NUMA nodes and the CPUs in each
+struct cpu_topology{
+    std::vector<std::vector<int>> node_cpus;
+
+    int nodes() const {return (int)node_cpus.size();}
+    int cpus() const {int n = 0; for (const auto& c : node_cpus){n += (int)c.size();} return n;}
+
+    static const cpu_topology& system(){static cpu_topology topology = detect(); return topology;}
+
+  private:
+    static cpu_topology detect();
+    static std::vector<int> parse_cpu_list(const char* list);
+};
+
+
+///"0-3,8,10-11" to {0,1,2,3,8,10,11}
+std::vector<int> cpu_topology::parse_cpu_list(const char* list){
+    std::vector<int> cpus;
+    while (*list){
+        char* end;
+        const long first = strtol(list, &end, 10);
+        if (end == list) break;
+        long last = first;
+        if (*end == '-'){list = end + 1; last = strtol(list, &end, 10);}
+        for (long c = first; c <= last; c++){cpus.push_back((int)c);}
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return cpus;
+}
+
+
+cpu_topology cpu_topology::detect(){
+    cpu_topology topology;
+#ifdef __linux__
+    //Only the CPUs the process may run on, containers often get a few CPUs of a big machine
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    //Nodes are listed as node0, node1... and may have holes
+    std::vector<int> ids;
+    if (DIR* dir = opendir("/sys/devices/system/node")){
+        while (dirent* entry = readdir(dir)){
+            int id;
+            if (sscanf(entry->d_name, "node%d", &id) == 1){ids.push_back(id);}
+        }
+        closedir(dir);
+    }
+    std::sort(ids.begin(), ids.end());
+    for (int id : ids){
+        const std::string path = "/sys/devices/system/node/node" + std::to_string(id) + "/cpulist";
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) continue;
+        char line[4096] = {0};
+        if (fgets(line, sizeof(line), f)){
+            std::vector<int> cpus = parse_cpu_list(line);
+            if (masked){cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&](int c){return c >= CPU_SETSIZE || !CPU_ISSET(c, &allowed);}), cpus.end());}
+            if (!cpus.empty()){topology.node_cpus.push_back(cpus);}
+        }
+        fclose(f);
+    }
+#endif
+    if (topology.node_cpus.empty()){
+        topology.node_cpus.emplace_back();
+        for (int c = 0; c < omp_get_num_procs(); c++){topology.node_cpus[0].push_back(c);}
+    }
+    return topology;
+}
+
+
+
+
+///CPU (-1 when not pinned) and node of every render thread
+struct thread_placement{
+    std::vector<int> cpu;
+    std::vector<int> node;
+    std::vector<int> node_threads;  //Threads on each node
+
+    int threads() const {return (int)node.size();}
+};
+
+inline thread_placement place_threads(const thread_config& config, const cpu_topology& topology){
+    thread_placement p;
+    const int threads = config.threads > 0 ? config.threads : topology.cpus();
+    p.node_threads.assign(topology.nodes(), 0);
+
+    //Compact walks the CPUs node by node, spread takes one CPU from each node in turn
+    std::vector<std::pair<int, int>> slots;
+    if (config.affinity == affinity_spread){
+        for (size_t i = 0; slots.size() < (size_t)topology.cpus(); i++){
+            for (int n = 0; n < topology.nodes(); n++){
+                if (i < topology.node_cpus[n].size()){slots.push_back({topology.node_cpus[n][i], n});}
+            }
+        }
+    }else{
+        for (int n = 0; n < topology.nodes(); n++){
+            for (int c : topology.node_cpus[n]){slots.push_back({c, n});}
+        }
+    }
+
+    for (int t = 0; t < threads; t++){
+        const auto& slot = slots[t % slots.size()];
+        p.cpu.push_back(config.affinity == affinity_none ? -1 : slot.first);
+        p.node.push_back(config.affinity == affinity_none ? 0 : slot.second);
+        p.node_threads[p.node.back()]++;
+    }
+    return p;
+}
+
+//Placement of the OpenMP pool, set by apply_thread_config()
+inline thread_placement current_placement = place_threads(thread_config(), cpu_topology::system());
+
+
+///Pins the calling thread to cpu, or to every CPU for -1
+inline void pin_thread(int cpu){
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu >= 0){CPU_SET(cpu, &set);}
+    else {for (const auto& cpus : cpu_topology::system().node_cpus){for (int c : cpus){CPU_SET(c, &set);}}}
+    sched_setaffinity(0, sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+
+///Pins thread t of the pool where the placement wants it, only calls the kernel when it moves
+inline void place_pool_thread(int t){
+    static thread_local int pinned = -1;  //Threads start free to run anywhere
+    const int cpu = t < (int)current_placement.cpu.size() ? current_placement.cpu[t] : -1;
+    thread_node = t < (int)current_placement.node.size() ? current_placement.node[t] : 0;
+    if (cpu != pinned){pin_thread(cpu); pinned = cpu;}
+}
+
+
+///Sizes and pins the OpenMP pool from render_threads
+inline void apply_thread_config(){
+    current_placement = place_threads(render_threads, cpu_topology::system());
+    omp_set_num_threads(current_placement.threads());
+
+    #pragma omp parallel
+    place_pool_thread(omp_get_thread_num());
+}
+
+
+///Runs fn on a thread pinned to the CPUs of node, first touches inside fn land there
+template<typename F>
+void run_on_node(int node, F fn){
+    std::thread worker([node, &fn](){
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : cpu_topology::system().node_cpus[node]){CPU_SET(c, &set);}
+        sched_setaffinity(0, sizeof(set), &set);
+#endif
+        thread_node = node;
+        fn();
+    });
+    worker.join();
+}
+
+
+
+
+///Range [begin, end) of n items owned by thread t of threads
+inline void thread_range(int n, int t, int threads, int& begin, int& end){
+    begin = (int)((int64_t)n * t / threads);
+    end = (int)((int64_t)n * (t + 1) / threads);
+}
+
+
+///Hands out tile indices, every thread's own range first, then the ranges of its node, then any
+class tile_scheduler{
+  public:
+    void reset(int tiles, int team, const thread_placement& placement);
+    inline int next(int thread);
+
+  private:
+    struct alignas(64) range{
+        std::atomic<int> next{0};
+        int end = 0;
+    };
+
+    int threads = 0;
+    std::unique_ptr<range[]> ranges;
+    std::vector<std::vector<int>> victims;  //Per thread, the threads it steals from in order
+};
+
+
+///Splits tiles between threads the way film_t::clear() does, threads past the placement count as node 0
+void tile_scheduler::reset(int tiles, int team, const thread_placement& placement){
+    const int n = std::max(team, 1);
+    if (n != threads){
+        threads = n;
+        ranges.reset(new range[n]);
+    }
+    for (int t = 0; t < n; t++){
+        int begin, end;
+        thread_range(tiles, t, n, begin, end);
+        ranges[t].next.store(begin, std::memory_order_relaxed);
+        ranges[t].end = end;
+    }
+
+    victims.assign(n, std::vector<int>());
+    for (int t = 0; t < n; t++){
+        const int node = t < placement.threads() ? placement.node[t] : 0;
+        for (int pass = 0; pass < 2; pass++){
+            for (int o = 1; o < n; o++){
+                const int v = (t + o) % n;
+                const bool same = (v < placement.threads() ? placement.node[v] : 0) == node;
+                if (same == (pass == 0)){victims[t].push_back(v);}
+            }
+        }
+    }
+}
+
+
+///Next position in the tile order for thread, -1 once every range is empty
+inline int tile_scheduler::next(int thread){
+    range& own = ranges[thread];
+    if (own.next.load(std::memory_order_relaxed) < own.end){
+        const int k = own.next.fetch_add(1, std::memory_order_relaxed);
+        if (k < own.end) return k;
+    }
+    for (int v : victims[thread]){
+        range& r = ranges[v];
+        if (r.next.load(std::memory_order_relaxed) >= r.end) continue;
+        const int k = r.next.fetch_add(1, std::memory_order_relaxed);
+        if (k < r.end) return k;
+    }
+    return -1;
+}
+
+
+
+#endif // __RENDER_THREADS_H_
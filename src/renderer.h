@@ -0,0 +1,791 @@
+#ifndef __RENDERER_H_
+#define __RENDERER_H_
+
+//Base library
+#include <iostream>
+#include <math.h>
+#include <atomic>
+#include <memory>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+//Include OpemMP for multithreading
+#include <omp.h>
+
+//Project files
+#include "utils.h"
+#include "objects.h"
+#include "camera.h"
+#include "render_aov.h"
+#include "render_resolve.h"
+#include "render_film.h"
+#include "render_threads.h"
+#include "render_environment.h"
+#include "render_lights.h"
+#include "render_primary.h"
+#include "render_guiding.h"
+#include "render_photons.h"
+
+
+
+
+void write_color(unsigned char* pixelsData, const int index, color pixel_color, int samples_per_pixel){
+    const double rgb[3] = {pixel_color.x(), pixel_color.y(), pixel_color.z()};
+    uint32_t packed;
+    film_resolver::standard().resolve_row(rgb, 1, 1.0 / samples_per_pixel, &packed);
+
+    pixelsData[index+0] = (unsigned char)(packed);
+    pixelsData[index+1] = (unsigned char)(packed >> 8);
+    pixelsData[index+2] = (unsigned char)(packed >> 16);
+}
+
+
+void write_color_acc(double* pixelsData, const int index, color pixel_color){
+    pixelsData[index+0] += pixel_color.x();
+    pixelsData[index+1] += pixel_color.y();
+    pixelsData[index+2] += pixel_color.z();
+}
+
+
+
+
+
+//Revisions handed to scenes, every edit gets a new one
+inline std::atomic<uint64_t> next_scene_revision(1);
+
+struct scene{
+    shared_ptr<scene_arena> arena = make_shared<scene_arena>();   //Set to null before building to use the heap
+    hittable_list objects;
+    color background;
+    shared_ptr<environment_map> environment;    //Replaces background when set, and is sampled as a light
+    shared_ptr<light_tree> lights;              //Emitters sampled by shading points, see build_light_tree
+    shared_ptr<path_guide> guide;               //When set, learns where the light comes from and guides the bounces
+    shared_ptr<photon_map> photons;             //When set, caustics come from photons traced every pass
+    std::vector<shared_ptr<scene>> replicas;    //One per NUMA node, see replicate_per_node
+    uint64_t revision = next_scene_revision++;  //Caches filled from the scene (primary_cache) are keyed on it
+
+    ///Call after editing a scene that was already rendered
+    void touch(){revision = next_scene_revision++;}
+
+    ///What threads of node trace against, the scene itself when it isn't replicated
+    const scene& replica(int node) const {return node < (int)replicas.size() ? *replicas[node] : *this;}
+};
+
+//Primitive types stored by value and intersected without virtual calls
+using static_objects = hittable_static<sphere, hittable_rect, hittable_box>;
+
+
+///Copies the static BVHs and primitive arrays of world on every NUMA node, each built by a thread
+///of its node so the pages are placed there. Materials, textures and the other objects stay shared.
+///Replicas don't follow later changes to world: call it again after refitting, or drop them with
+///world.replicas.clear()
+inline void replicate_per_node(scene& world){
+    world.replicas.clear();
+    const cpu_topology& topology = cpu_topology::system();
+    if (topology.nodes() < 2) return;
+
+    for (int n=0; n<topology.nodes(); n++){
+        run_on_node(n, [&world](){
+            auto copy = make_shared<scene>();
+            copy->arena = world.arena;
+            copy->background = world.background;
+            copy->environment = world.environment;
+            copy->lights = world.lights;
+            copy->guide = world.guide;
+            copy->photons = world.photons;
+            for (const auto& object : world.objects.objects){
+                if (auto statics = dynamic_pointer_cast<static_objects>(object)){copy->objects.add(make_shared<static_objects>(*statics));}
+                else {copy->objects.add(object);}
+            }
+            world.replicas.push_back(copy);
+        });
+    }
+}
+
+
+///Puts the emitting spheres and rects of the static containers of world in its light tree.
+///Like the replicas the tree doesn't follow the scene, build it again after moving lights
+inline void build_light_tree(scene& world){
+    std::vector<light_source> sources;
+    for (const auto& object : world.objects.objects){
+        auto statics = dynamic_pointer_cast<static_objects>(object);
+        if (!statics) continue;
+        for (size_t i=0; i<statics->count<sphere>(); i++){
+            const sphere& s = statics->get<sphere>(i);
+            if (dynamic_cast<const material_light*>(s.get_material())){sources.emplace_back(s);}
+        }
+        for (size_t i=0; i<statics->count<hittable_rect>(); i++){
+            const hittable_rect& r = statics->get<hittable_rect>(i);
+            if (dynamic_cast<const material_light*>(r.get_material())){sources.emplace_back(r);}
+        }
+    }
+    world.lights = sources.empty() ? nullptr : make_shared<light_tree>(std::move(sources));
+}
+
+
+//Rays traced by the calling thread, read back by renderScene
+inline thread_local uint64_t rays_traced = 0;
+
+
+
+
+/*
+** Direct lighting
+**
+** Every surface whose material has eval() sends shadow rays toward the lights: one toward a
+** direction sampled from the environment map, one toward a point of an emitter picked by the
+** light tree. The bounce ray still finds the same lights when it misses or hits an emitter, so
+** the two estimates are weighted against each other's pdf with the power heuristic: the light
+** sample wins on small bright lights, the bounce on large dim ones.
+** bounce_origin carries the pdf of the bounce that made a ray, 0 after the camera or a delta
+** bounce (those got no light sample and keep the full emission).
+** Only emitters inside static containers are in the light tree (see build_light_tree), the others
+** are found by bounces alone. At guided points the bounce pdf is the one of the guide mixture.
+** With a photon map, bounce_origin also tells if the ray left a diffuse point that gathered the
+** caustics, or went through specular bounces since: the emitters found then are the photons' light
+** (see render_photons.h).
+ */
+
+//Off leaves the lights and the environment to the bounce rays alone, for comparisons
+inline bool light_sampling = true;
+
+enum caustic_state : uint8_t{caustic_none, caustic_gathered, caustic_covered};
+
+///Shading point a ray was sampled from
+struct bounce_origin{
+    double pdf = 0.0;           //Solid angle pdf of the bounce, 0 when nothing was light sampled there
+    vec3 normal = vec3(0,0,0);
+    caustic_state caustic = caustic_none;
+};
+
+inline double power_heuristic(double pdf, double other){
+    const double a = pdf * pdf, b = other * other;
+    return a + b > 0.0 ? a / (a + b) : 0.0;
+}
+
+
+///What a ray leaving the scene brings back
+inline color environment_hit(const scene& world, const ray& r, const bounce_origin& from){
+    if (!world.environment){return world.background;}
+    double light_pdf;
+    const color radiance = world.environment->lookup(r.direction(), light_pdf);
+    return from.pdf > 0.0 ? radiance * power_heuristic(from.pdf, light_pdf) : radiance;
+}
+
+
+///Weight of the emission of a light hit by a bounce ray, against the light tree picking it
+inline double emitter_weight(const scene& world, const ray& r, const hit_record& rec, const bounce_origin& from){
+    if (from.pdf <= 0.0 || !world.lights) return 1.0;
+    const light_source* light = world.lights->find(rec.object_id);
+    if (!light) return 1.0;
+    const double light_pdf = world.lights->pdf(r.origin(), from.normal, *light) * light->pdf(r.origin(), rec.p);
+    return power_heuristic(from.pdf, light_pdf);
+}
+
+
+///Shadow ray toward a light sample, its contribution already divided by the pdf
+inline color shadow_sample(const scene& world, const ray& r_in, const hit_record& rec, const vec3& direction, double distance,
+                           const color& radiance, double light_pdf, const guide_mix& guide){
+    color f;
+    double scatter_pdf;
+    if (light_pdf <= 0.0 || radiance.length_squared() == 0.0 || !rec.mat_ptr->eval(r_in, rec, direction, f, scatter_pdf)){return color(0,0,0);}
+    scatter_pdf = guide.pdf(scatter_pdf, direction);
+
+    STAT_RAY(stat_ray_shadow);
+    rays_traced++;
+    const double transmitted = world.objects.transmittance(ray(rec.p, direction), 0.001, distance);
+    if (transmitted <= 0.0){return color(0,0,0);}
+    return f * radiance * (transmitted * power_heuristic(light_pdf, scatter_pdf) / light_pdf);
+}
+
+
+///Light samples of the environment and of one emitter at a hit
+inline color sample_lights(const scene& world, const ray& r_in, const hit_record& rec, const guide_mix& guide = guide_mix()){
+    color direct(0,0,0);
+    if (world.environment){
+        double u, v;
+        sample_2d(u, v);
+        vec3 direction;
+        double pdf;
+        const color radiance = world.environment->sample(u, v, direction, pdf);
+        direct += shadow_sample(world, r_in, rec, direction, infinity, radiance, pdf, guide);
+    }
+    if (world.lights){
+        const double pick = sample_1d();
+        double u, v;
+        sample_2d(u, v);
+        double pick_pdf, pdf, distance;
+        vec3 direction;
+        color radiance;
+        const light_source* light = world.lights->sample(rec.p, rec.normal, pick, pick_pdf);
+        if (light && light->sample(rec.p, u, v, direction, distance, radiance, pdf)){
+            direct += shadow_sample(world, r_in, rec, direction, distance * (1 - 1e-4), radiance, pick_pdf * pdf, guide);
+        }
+    }
+    return direct;
+}
+
+
+///Where the bounce just sampled leaves from, with the pdf the material had for it
+inline bounce_origin bounce_from(const ray& r_in, const hit_record& rec, const ray& scattered){
+    bounce_origin from;
+    color f;
+    if (!rec.mat_ptr->eval(r_in, rec, scattered.direction(), f, from.pdf)){from.pdf = 0.0;}
+    from.normal = rec.normal;
+    return from;
+}
+
+
+
+color ray_color(const ray& r, const scene& world, int depth, aov_sample* aov = nullptr, bool first_event = true,
+                const bounce_origin& from = bounce_origin());
+
+
+///Radiance of a ray that left the scene
+inline color ray_miss(const ray& r, const scene& world, aov_sample* aov, const bounce_origin& from){
+    const color sky = environment_hit(world, r, from);
+    if (aov){aov->set_surface(sky, vec3(0,0,0), miss_depth); aov->emission = sky;}
+    return sky;
+}
+
+
+///Radiance leaving rec toward the origin of r, continues the path below it
+color ray_shade(const ray& r, const hit_record& rec, const scene& world, int depth, aov_sample* aov, bool first_event,
+                const bounce_origin& from){
+    //Check the scattered ray
+    ray scattered;
+    color attenuation;
+    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    if (from.pdf > 0.0 && emitted.length_squared() > 0.0){emitted *= emitter_weight(world, r, rec, from);}
+    if (from.caustic == caustic_covered && world.photons->covers(rec.object_id)){emitted = color(0,0,0);}
+    sampler_bounce();
+    const bool scatters = rec.mat_ptr->scatter(r, rec, attenuation, scattered);
+    const bool volume = scatters && rec.mat_ptr->is_volume();
+    if (aov){
+        aov->emission = emitted;
+        if (first_event){aov->object_id = rec.object_id; aov->material_id = rec.mat_ptr->material_id;}
+
+        //Emitters have no albedo, their clamped emission keeps lights from being blurred into the walls
+        if (!volume){
+            color albedo = scatters ? attenuation : color(fmin(emitted.x(), 1.0), fmin(emitted.y(), 1.0), fmin(emitted.z(), 1.0));
+            aov->set_surface(albedo, rec.normal, rec.t * r.direction().length());
+        }
+    }
+    if (!scatters){return emitted;}
+
+    //Diffuse points gather the caustics, specular bounces carry on the state of the one before
+    caustic_state caustic = caustic_none;
+    color direct(0,0,0);
+    if (world.photons && world.photons->ready() && !volume){
+        color f_normal;
+        double pdf_normal;
+        if (rec.mat_ptr->eval(r, rec, rec.normal, f_normal, pdf_normal)){direct = world.photons->gather(r, rec); caustic = caustic_gathered;}
+        else if (from.caustic != caustic_none){caustic = caustic_covered;}
+    }
+
+    //Materials with eval() get light samples and guiding, only when the bounce ray will be traced too
+    const bool light_sampled = (world.environment || world.lights) && light_sampling && depth > 1;
+    const bool guidable = world.guide && depth > 1;
+    color f;
+    double bounce_pdf = 0.0;
+    guide_mix guide;
+    if ((light_sampled || guidable) && rec.mat_ptr->eval(r, rec, scattered.direction(), f, bounce_pdf)){
+        if (guidable){guide = world.guide->at(rec.p);}
+    }else{
+        bounce_pdf = 0.0;
+    }
+
+    if (light_sampled){direct += sample_lights(world, r, rec, guide);}
+
+    //One sample MIS of the learned distribution and the BSDF, drawn after the light samples
+    if (guide.tree){
+        if (sample_1d() < guide.fraction){
+            double u, v, guide_pdf;
+            sample_2d(u, v);
+            scattered = ray(rec.p, guide.tree->sample(u, v, guide_pdf));
+            if (!rec.mat_ptr->eval(r, rec, scattered.direction(), f, bounce_pdf)){f = color(0,0,0); bounce_pdf = 0.0;}
+        }
+        bounce_pdf = guide.pdf(bounce_pdf, scattered.direction());
+        if (bounce_pdf <= 0.0 || f.length_squared() == 0.0){
+            if (aov && first_event){aov->direct = direct;}
+            return emitted + direct;
+        }
+        attenuation = f / bounce_pdf;
+    }
+    bounce_origin next_from;
+    if (light_sampled){next_from.pdf = bounce_pdf; next_from.normal = rec.normal;}
+    next_from.caustic = caustic;
+
+    //Recur
+    STAT_RAY(stat_ray_bounce);
+    STAT_PATH_BOUNCE();
+
+    //Only the first event (for the direct/indirect split) and volumes (for the surface behind) look at the next hit
+    if (!aov || !(first_event || volume)){
+        const color incoming = ray_color(scattered, world, depth-1, nullptr, false, next_from);
+        if (guide.record){guide.record->record(scattered.direction(), (float)(luminance(incoming) / bounce_pdf));}
+        return emitted + direct + attenuation * incoming;
+    }
+    aov_sample next;
+    const color incoming = ray_color(scattered, world, depth-1, &next, false, next_from);
+    if (guide.record){guide.record->record(scattered.direction(), (float)(luminance(incoming) / bounce_pdf));}
+    if (volume){
+        const double offset = rec.t * r.direction().length();
+        aov->set_surface(next.albedo, next.normal, next.depth < miss_depth ? offset + next.depth : miss_depth);
+    }
+    if (first_event){
+        aov->direct = direct + attenuation * next.emission;
+        aov->indirect = attenuation * (incoming - next.emission);
+    }
+    return emitted + direct + attenuation * incoming;
+}
+
+
+///Traces a path, if aov isn't null also fills the outputs of its first event
+///(or only the surface ones when first_event is false, for the bounces below it)
+color ray_color(const ray& r, const scene& world, int depth, aov_sample* aov, bool first_event, const bounce_origin& from){
+    //Limit max recursion
+    if (depth<=0){
+        if (aov){aov->set_surface(color(0,0,0), vec3(0,0,0), miss_depth);}
+        return color(0,0,0);
+    }
+    rays_traced++;
+
+    //Check for world collision
+    hit_record rec;
+    if(!world.objects.hit(r, 0.001, infinity, rec)){return ray_miss(r, world, aov, from);}
+    return ray_shade(r, rec, world, depth, aov, first_event, from);
+}
+
+
+
+
+/*
+** Primary hits
+**
+** Camera paths of passes with a primary_cache (see render_primary.h) read their first hit on the
+** deterministic objects from the cache, or trace and store it when the slot is empty. Top level
+** objects with random hits are split out and traced by every sample up to the cached hit.
+ */
+
+///Top level objects of a scene, split by whether their hits can be cached
+struct primary_objects{
+    std::vector<const hittable*> cached;
+    std::vector<const hittable*> random;
+
+    primary_objects() {}
+    primary_objects(const scene& world){
+        for (const auto& object : world.objects.objects){(object->random_hits() ? random : cached).push_back(object.get());}
+    }
+};
+
+
+///Same as ray_color for a camera ray, with the first hit on the cached objects read from (or written to) slot
+color ray_color_cached(const ray& r, const scene& world, const primary_objects& objects, primary_cache& cache, primary_hit& slot,
+                       int depth, aov_sample* aov){
+    if (depth<=0){
+        if (aov){aov->set_surface(color(0,0,0), vec3(0,0,0), miss_depth);}
+        return color(0,0,0);
+    }
+
+    hit_record rec, temp_rec;
+    bool found = false;
+    if (cache.filled(slot)){
+        found = slot.read(r, rec);
+    }else{
+        rays_traced++;
+        double closest = infinity;
+        for (const hittable* object : objects.cached){
+            if (object->hit(r, 0.001, closest, temp_rec)){found = true; closest = temp_rec.t; rec = temp_rec;}
+        }
+        cache.fill(slot, found ? &rec : nullptr);
+        if (found){slot.read(r, rec);}    //Shade the stored hit, so later passes see the same one
+    }
+
+    //Media in front of it
+    double closest = found ? rec.t : infinity;
+    for (const hittable* object : objects.random){
+        if (object->hit(r, 0.001, closest, temp_rec)){found = true; closest = temp_rec.t; rec = temp_rec;}
+    }
+
+    if (!found){return ray_miss(r, world, aov, bounce_origin());}
+    return ray_shade(r, rec, world, depth, aov, true, bounce_origin());
+}
+
+
+
+
+
+/*
+** Wavefront tracing
+**
+** Instead of following one path to its end before starting the next, the paths of a tile move
+** one bounce at a time, every bounce is a batch of rays traced back to back. trace_sorted orders
+** the bounce rays by direction octant and by the Morton codes of their origin and direction, so
+** consecutive rays walk the same BVH nodes while they are still in cache. Camera rays are already
+** coherent and stay in scan order.
+** Paths draw from the random streams in a different order than depth first, the two converge
+** to the same image but not with the same noise.
+ */
+
+enum trace_order{trace_depth_first, trace_wavefront, trace_sorted, trace_orders};
+
+const char* const trace_order_names[trace_orders] = {"depth_first", "wavefront", "sorted"};
+
+//How renderScene follows paths, passes with AOVs or a cost buffer are always depth first
+inline trace_order active_trace_order = trace_depth_first;
+
+
+///A path between two bounces
+struct path_state{
+    ray r;
+    color throughput;
+    color radiance;
+    sample_state sample;
+    uint32_t pixel;     //Pixel index inside the tile
+    int depth;          //Rays left to trace
+    int bounces;
+    bounce_origin from;
+};
+
+
+///Spreads the low 10 bits of x three bits apart
+inline uint32_t morton_spread3(uint32_t x){
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ffu;
+    x = (x | (x << 8)) & 0x0300f00fu;
+    x = (x | (x << 4)) & 0x030c30c3u;
+    x = (x | (x << 2)) & 0x09249249u;
+    return x;
+}
+
+
+///Octant in the top bits, then 18 bits of direction and 30 bits of origin inside the batch bounds.
+///Direction comes first: rays leaving a tile already start close together, what scatters them is where they go
+inline uint64_t coherence_key(const ray& r, const point3& lo, const vec3& scale){
+    const vec3 d = unit_vector(r.direction());
+    uint32_t o[3], q[3];
+    uint64_t octant = 0;
+    for (int a=0; a<3; a++){
+        o[a] = (uint32_t)std::min(std::max((r.origin()[a] - lo[a]) * scale[a], 0.0), 1023.0);
+        q[a] = (uint32_t)std::min((d[a] + 1.0) * 32.0, 63.0);
+        octant |= (uint64_t)(d[a] < 0.0) << a;
+    }
+    const uint64_t origin = morton_spread3(o[0]) | (morton_spread3(o[1]) << 1) | (morton_spread3(o[2]) << 2);
+    const uint64_t direction = morton_spread3(q[0]) | (morton_spread3(q[1]) << 1) | (morton_spread3(q[2]) << 2);
+    return (octant << 61) | (direction << 30) | origin;
+}
+
+
+///Traces every path of the batch to its end one bounce at a time, adding their radiance to color_sum (one per tile pixel)
+void trace_batch(std::vector<path_state>& paths, const scene& world, std::vector<color>& color_sum, trace_order order){
+    std::vector<std::pair<uint64_t, uint32_t>> keys;
+    std::vector<path_state> next;
+    next.reserve(paths.size());
+
+    for (int bounce=0; !paths.empty(); bounce++){
+        //Sort the bounce rays by coherence key
+        if (order == trace_sorted && bounce > 0 && paths.size() > 1){
+            point3 lo = paths[0].r.origin(), hi = lo;
+            for (const path_state& p : paths){
+                for (int a=0; a<3; a++){lo[a] = fmin(lo[a], p.r.origin()[a]); hi[a] = fmax(hi[a], p.r.origin()[a]);}
+            }
+            vec3 scale;
+            for (int a=0; a<3; a++){scale[a] = hi[a] > lo[a] ? 1023.0 / (hi[a] - lo[a]) : 0.0;}
+
+            keys.resize(paths.size());
+            for (size_t k=0; k<paths.size(); k++){keys[k] = {coherence_key(paths[k].r, lo, scale), (uint32_t)k};}
+            std::sort(keys.begin(), keys.end());
+            next.clear();
+            for (const auto& key : keys){next.push_back(paths[key.second]);}
+            paths.swap(next);
+        }
+
+        //Trace the batch, the paths that keep going are compacted in place
+        size_t alive = 0;
+        for (size_t k=0; k<paths.size(); k++){
+            path_state& p = paths[k];
+            rays_traced++;
+
+            hit_record rec;
+            bool ended = true;
+            if (!world.objects.hit(p.r, 0.001, infinity, rec)){
+                p.radiance += p.throughput * environment_hit(world, p.r, p.from);
+            }else{
+                current_sample = p.sample;
+                sampler_bounce();
+                ray scattered;
+                color attenuation;
+                color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+                if (p.from.pdf > 0.0 && emitted.length_squared() > 0.0){emitted *= emitter_weight(world, p.r, rec, p.from);}
+                p.radiance += p.throughput * emitted;
+                if (rec.mat_ptr->scatter(p.r, rec, attenuation, scattered) && --p.depth > 0){
+                    STAT_RAY(stat_ray_bounce);
+                    if ((world.environment || world.lights) && light_sampling){
+                        p.radiance += p.throughput * sample_lights(world, p.r, rec);
+                        p.from = bounce_from(p.r, rec, scattered);
+                    }
+                    p.throughput = p.throughput * attenuation;
+                    p.r = scattered;
+                    p.sample = current_sample;
+                    p.bounces++;
+                    ended = false;
+                }else if (p.depth == 0){
+                    STAT_RAY(stat_ray_bounce);
+                    p.bounces++;
+                }
+            }
+
+            if (ended){
+                color_sum[p.pixel] += p.radiance;
+                STAT_PATH_END_AT(p.bounces);
+            }else{
+                paths[alive++] = p;
+            }
+        }
+        paths.resize(alive);
+    }
+}
+
+
+
+
+
+struct render_info{
+    double seconds;
+    uint64_t rays;
+    bool cancelled = false;
+};
+
+///Lets other threads read tiles of a film while renderScene accumulates into it.
+///Every tile is a seqlock: readers copy it and retry later if a write overlapped.
+struct tile_sync{
+    std::unique_ptr<std::atomic<uint32_t>[]> seq;   //Odd while a worker writes the tile
+    std::unique_ptr<std::atomic<int>[]> samples;    //Samples per pixel in the tile, 0 while it's empty
+    std::unique_ptr<std::atomic<bool>[]> dirty;     //Raised by writers, cleared by the reader
+    int tiles = 0;
+
+    void resize(int n){
+        tiles = n;
+        seq.reset(new std::atomic<uint32_t>[n]);
+        samples.reset(new std::atomic<int>[n]);
+        dirty.reset(new std::atomic<bool>[n]);
+        for (int t=0; t<n; t++){seq[t] = 0; samples[t] = 0; dirty[t] = false;}
+    }
+
+    inline void begin_write(int t){
+        seq[t].store(seq[t].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    inline void end_write(int t, int tile_samples){
+        samples[t].store(tile_samples, std::memory_order_relaxed);
+        seq[t].store(seq[t].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        dirty[t].store(true, std::memory_order_release);
+    }
+
+    ///Copies bytes of tile t into dst, returns its samples or -1 if a writer got in the way
+    inline int read(int t, const void* tile, size_t bytes, void* dst) const {
+        const uint32_t before = seq[t].load(std::memory_order_acquire);
+        if (before & 1) return -1;
+        const int n = samples[t].load(std::memory_order_relaxed);
+        memcpy(dst, tile, bytes);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return seq[t].load(std::memory_order_relaxed) == before ? n : -1;
+    }
+};
+
+///Cooperative cancellation of a pass, workers check the flag between tiles. Any thread may raise it
+///(the display loop does on input or quit), the owner of the pass lowers it before the next one
+struct render_control{
+    std::atomic<bool> cancel{false};
+
+    //If set, every tile is written under its seqlock and gets SPP more samples
+    tile_sync* tiles = nullptr;
+
+    //If set, depth first passes start their camera paths from the first hits cached in it
+    primary_cache* primary = nullptr;
+
+    //Off keeps the scene's photon map as it is instead of tracing the photons of a new pass (previews)
+    bool photon_pass = true;
+};
+
+//Number of renderScene calls so far, every pass draws from different random streams
+inline uint64_t render_pass = 0;
+
+//Merged counters of the last pass (all zeros unless built with TRACCIA_STATS)
+inline render_stats last_render_stats;
+
+
+///Renders SPP samples per pixel and adds them to the film, if cost isn't null also adds the per-pixel cost to it,
+///if aovs isn't null also adds the outputs it has buffers for (cost and aovs are row major).
+///A cancelled pass leaves the buffers partially accumulated, callers are expected to reset them
+template<typename T>
+render_info renderScene(film_t<T>& pixels, const scene& world, const camera& cam, int SPP, int MAX_DEPTH,
+                        double* cost = nullptr, aov_buffers* aovs = nullptr, render_control* control = nullptr){
+    TRACE_SCOPE("renderScene");
+
+    //Multithreading
+    double time = 0.0;
+    double begin = omp_get_wtime();
+    const int IMG_WIDTH = pixels.width();
+    const int IMG_HEIGHT = pixels.height();
+    const uint64_t pass_seed = splitmix64(render_pass++);
+    const std::vector<uint32_t>& order = pixels.tile_order();
+    uint64_t rays = 0;
+    last_render_stats.reset();
+
+    //AOVs and cost are gathered along each path, only the depth first tracer fills them
+    const trace_order path_order = (cost || aovs) ? trace_depth_first : active_trace_order;
+
+    //The primary cache is emptied if it was filled for another view or scene
+    primary_cache* primary = control ? control->primary : nullptr;
+    if (primary && (path_order != trace_depth_first || !primary->prepare(pixels, cam, world.revision))){primary = nullptr;}
+    const int slots = primary ? primary->slots() : 0;
+
+    //The guide starts over when the scene changed, it's only trained and used by depth first paths
+    path_guide* guide = path_order == trace_depth_first ? world.guide.get() : nullptr;
+    if (guide){
+        aabb bounds;
+        if (world.objects.bounding_box(bounds)){guide->prepare(bounds, world.revision);}
+        else {guide = nullptr;}
+    }
+
+    //Caustic photons of the pass, depth first paths gather them from the map
+    photon_map* photons = path_order == trace_depth_first && (!control || control->photon_pass) ? world.photons.get() : nullptr;
+    if (photons){rays += photons->prepare(world.objects, world.lights.get(), world.revision);}
+
+    //Every thread starts with the tiles it cleared, then helps its node, then the other nodes
+    tile_scheduler scheduler;
+    scheduler.reset((int)order.size(), omp_get_max_threads(), current_placement);
+
+    #pragma omp parallel reduction(+:rays)
+    {
+        const uint64_t rays_begin = rays_traced;
+        thread_stats.reset();
+        const int thread = omp_get_thread_num();
+        place_pool_thread(thread);
+        const scene& local = world.replica(thread_node);
+        primary_objects objects;
+        if (primary){objects = primary_objects(local);}
+
+        //Wavefront batches, reused across the tiles of the thread
+        std::vector<path_state> paths;
+        std::vector<color> color_sum;
+
+        //Tiles are handed out in Morton order, every tile is written by one thread only
+        for(int k; (k = scheduler.next(thread)) >= 0;){
+            if (control && control->cancel.load(std::memory_order_relaxed)) continue;
+            const int tile = order[k];
+            TRACE_SCOPE_ARG("tile", tile);
+
+            //Seed per tile so the image doesn't depend on which thread renders it
+            random_seed(pass_seed ^ splitmix64(tile));
+            if (control && control->tiles){control->tiles->begin_write(tile);}
+
+            int x0, y0, x1, y1;
+            pixels.tile_rect(tile, x0, y0, x1, y1);
+            if (path_order != trace_depth_first){
+                //Every sample of the tile starts a path, then they all bounce together
+                paths.clear();
+                color_sum.assign((x1-x0)*(y1-y0), color(0,0,0));
+                for(int j=y0; j<y1; ++j){
+                    for(int i=x0; i<x1; ++i){
+                        const uint32_t first_sample = (uint32_t)pixels.pixel(i, j)[3];
+                        for(int s=0; s<SPP; ++s){
+                            sampler_begin(i, j, first_sample + s);
+                            double du, dv;
+                            sample_2d(du, dv);
+                            path_state p;
+                            p.r = cam.get_ray((i + du) / (IMG_WIDTH-1), (j + dv) / (IMG_HEIGHT-1));
+                            p.throughput = color(1,1,1);
+                            p.radiance = color(0,0,0);
+                            p.sample = current_sample;
+                            p.pixel = (i-x0) + (j-y0)*(x1-x0);
+                            p.depth = MAX_DEPTH;
+                            p.bounces = 0;
+                            p.from = bounce_origin();
+                            STAT_RAY(stat_ray_camera);
+                            if (MAX_DEPTH > 0){paths.push_back(p);}
+                            else {STAT_PATH_END_AT(0);}
+                        }
+                    }
+                }
+                trace_batch(paths, local, color_sum, path_order);
+
+                for(int j=y0; j<y1; ++j){
+                    for(int i=x0; i<x1; ++i){pixels.add(i, j, color_sum[(i-x0) + (j-y0)*(x1-x0)], SPP);}
+                }
+                if (control && control->tiles){control->tiles->end_write(tile, control->tiles->samples[tile].load(std::memory_order_relaxed) + SPP);}
+                continue;
+            }
+
+            for(int j=y0; j<y1; ++j){
+                for(int i=x0; i<x1; ++i){
+                    cost_probe probe;
+                    if (cost){probe.begin();}
+
+                    //Accumulate samples for this pixel, continuing the sequence of the previous passes
+                    color pixel_color(0,0,0);
+                    aov_sample aov_sum;
+                    const uint32_t first_sample = (uint32_t)pixels.pixel(i, j)[3];
+                    for(int s=0; s<SPP; ++s){
+                        //Cached samples repeat the camera sample of their slot (random numbers can't be repeated,
+                        //those slots take Sobol points) and bounce on a stream of their own
+                        const uint32_t index = first_sample + s;
+                        if (primary){sampler_begin(i, j, index % slots, active_sampler == sampler_random ? sampler_sobol : active_sampler);}
+                        else {sampler_begin(i, j, index);}
+                        double du, dv;
+                        sample_2d(du, dv);
+                        const double u = (i + du) / (IMG_WIDTH-1);
+                        const double v = (j + dv) / (IMG_HEIGHT-1);
+                        ray r = cam.get_ray(u, v);
+                        STAT_RAY(stat_ray_camera);
+                        STAT_PATH_BEGIN();
+                        aov_sample aov;
+                        if (primary){
+                            sampler_begin_stream(i, j, index / slots, index % slots + 1);
+                            pixel_color += ray_color_cached(r, local, objects, *primary, primary->at(i, j, index % slots), MAX_DEPTH, aovs ? &aov : nullptr);
+                        }else{
+                            pixel_color += ray_color(r, local, MAX_DEPTH, aovs ? &aov : nullptr);
+                        }
+                        STAT_PATH_END();
+                        if (aovs){aov_sum.accumulate(aov);}
+                    }
+
+                    //Output the color into the right pixel
+                    pixels.add(i, j, pixel_color, SPP);
+                    if (aovs){aovs->add(i+(j*IMG_WIDTH), aov_sum);}
+                    if (cost){cost[i+(j*IMG_WIDTH)] += probe.end();}
+                }
+            }
+
+            if (control && control->tiles){control->tiles->end_write(tile, control->tiles->samples[tile].load(std::memory_order_relaxed) + SPP);}
+        }
+
+        //Merge the per thread counters
+        rays += rays_traced - rays_begin;
+        #pragma omp critical
+        last_render_stats.merge(thread_stats);
+    }
+
+#ifdef TRACCIA_STATS
+    last_render_stats.print();
+#endif
+
+    //A guide iteration ends once it has its samples per pixel
+    const bool cancelled = control && control->cancel.load();
+    if (guide && !cancelled){guide->end_pass(SPP);}
+    if (photons && !cancelled){photons->end_pass();}
+
+    //Output total time elapsed
+    double end = omp_get_wtime();
+    time = (double)(end - begin);
+    printf("Time elpased for rendering %f\n", time);
+    return {time, rays, cancelled};
+}
+
+
+
+#endif // __RENDERER_H_
@@ -0,0 +1,370 @@
+#ifndef __SCENES_H_
+#define __SCENES_H_
+
+
+#include "utils.h"
+#include "objects.h"
+#include "renderer.h"
+#include "render_animation.h"
+
+
+
+///Random spheres on a checkered ground, the grid is scaled to hold about count small spheres
+void random_scene(scene* outputScene, int count = 36, uint64_t seed = 0) {
+    arena_scope scope(outputScene->arena);
+    random_seed(seed);
+    outputScene->background = color(0.70, 0.80, 1.00);
+    auto statics = make_arena_shared<static_objects>();
+
+    //Grid layout, denser than the original 4 units step only when needed
+    const int side = (int)ceil(sqrt((double)count));
+    const double step = fmax(1.0, 24.0 / side);
+    const double extent = side * step;
+    const double ground_radius = fmax(1000.0, 10.0 * extent);
+
+    auto checker = make_arena_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    statics->add(sphere(point3(0,-ground_radius,0), ground_radius, make_arena_shared<lambertian>(checker)));
+
+    //Shared material palettes, so huge scenes don't pay for a material per sphere
+    vector<shared_ptr<material>> diffuse, metals;
+    for (int i = 0; i < 256; i++) {diffuse.push_back(make_arena_shared<lambertian>(color::random() * color::random()));}
+    for (int i = 0; i < 64; i++) {metals.push_back(make_arena_shared<metal>(color::random(0.5, 1), random_double(0, 0.5)));}
+    auto glass = make_arena_shared<dielectric>(1.5);
+
+    for (int a = 0; a < side; a++) {
+        for (int b = 0; b < side; b++) {
+            auto choose_mat = random_double();
+            point3 center(-extent/2 + a*step + 0.9*random_double(), 0.2, -extent/2 + b*step + 0.9*random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                shared_ptr<material> sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    sphere_material = diffuse[random_int(0, diffuse.size()-1)];
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    sphere_material = metals[random_int(0, metals.size()-1)];
+                } else {
+                    // glass
+                    sphere_material = glass;
+                }
+                statics->add(sphere(center, 0.2, sphere_material));
+            }
+        }
+    }
+
+    auto material1 = make_arena_shared<dielectric>(1.5);
+    statics->add(sphere(point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = make_arena_shared<lambertian>(color(0.4, 0.2, 0.1));
+    statics->add(sphere(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = make_arena_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    statics->add(sphere(point3(4, 1, 0), 1.0, material3));
+
+    auto marble = make_arena_shared<lambertian>(make_arena_shared<texture_noise>(4));
+    statics->add(sphere(point3(4, 0.8, 2), 0.8, marble));
+
+    //auto material5 = make_arena_shared<lambertian>(make_arena_shared<texture_image>("src/earthmap.jpg"));
+    //statics->add(sphere(point3(4, 0.8,-2), 0.8, material5));
+
+    auto material6 = make_arena_shared<material_light>(color(4,4,4));
+    //statics->add(sphere(point3(4, 4, 0), 2.0, material6));
+    //statics->add(hittable_rect(point3(-2, 1, -2), point3(2, 4, -2), material6)); //Z aligned
+    //statics->add(hittable_rect(point3(-2, 1, -2), point3(-2, 4, 2), material6)); // X aligned
+    statics->add(hittable_rect(point3(-4, 4, -4), point3( 4, 4, 4), material6)); // Y aligned
+
+    statics->build();
+    outputScene->objects.add(statics);
+    build_light_tree(*outputScene);
+}
+
+
+
+
+void cornell_box(scene* outputScene){
+    arena_scope scope(outputScene->arena);
+    outputScene->background = color(0.035, 0.025, 0.05);
+    auto statics = make_arena_shared<static_objects>();
+
+    //Materials
+    auto red   = make_arena_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_arena_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_arena_shared<lambertian>(color(.12, .45, .15));
+
+    //auto red   = make_arena_shared<metal>(color(.65, .05, .05), 0.5);
+    //auto white = make_arena_shared<metal>(color(.73, .73, .73), 0.5);
+    //auto green = make_arena_shared<metal>(color(.12, .45, .15), 0.5);
+
+    //Box
+    int s = 2;
+    statics->add(hittable_rect(point3(-s,   0, -s), point3( s,   0, s), white));
+    statics->add(hittable_rect(point3(-s,   0, -s), point3( s, s*2,-s), white));
+    statics->add(hittable_rect(point3(-s,   0, -s), point3(-s, s*2, s), red));
+    statics->add(hittable_rect(point3( s,   0, -s), point3( s, s*2, s), green));
+    statics->add(hittable_rect(point3(-s, s*2, -s), point3( s, s*2, s), white));
+
+    //Light
+    //statics->add(hittable_rect(point3(-s*0.5, s*2-0.1, -s*0.5), point3( s*0.5, s*2-0.1, s*0.5), light));
+
+    //Things
+    auto material3 = make_arena_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    outputScene->objects.add(make_arena_shared<hittable_constant_medium>(make_arena_shared<sphere>(point3( 0, 1.0, 0), 9.0, white), 0.10, color(0.1,0.1,0.1)));
+
+    //Metal ball
+    auto met = make_arena_shared<metal>(color(0.7, 0.6, 0.5), 0.01);
+    statics->add(sphere(point3(-1, 2, -1), 0.9, met));
+
+    //Marble ball
+    //auto marble = make_arena_shared<lambertian>(make_arena_shared<texture_noise>(16));
+    auto marble = make_arena_shared<metal>(make_arena_shared<texture_noise>(8), 0.75);
+    statics->add(sphere(point3(1, 1, 0), 0.7, marble));
+
+    //Marble ball
+    auto light1 = make_arena_shared<material_light>(color(5,15,15));
+    auto light2 = make_arena_shared<material_light>(color(15,15,5));
+    statics->add(sphere(point3( 1.8, 3.6, -1.8), 0.6, light1));
+    statics->add(sphere(point3(-1.8, 3.6, -1.8), 0.6, light2));
+
+    //Rect
+    auto light3 = make_arena_shared<material_light>(color(10,10,10));
+    statics->add(hittable_rect(point3(-1.75, 0.01, 1.25), point3( 1.75, 0.01, 1.75), light3));
+    //rect = make_arena_shared<hittable_rotated>(rect, axis_z, 30);
+    //rect = make_arena_shared<hittable_rotated>(rect, axis_x, 60);
+    //rect = make_arena_shared<hittable_rotated>(rect, axis_y, 30);
+    //rect = make_arena_shared<hittable_translated>(rect, vec3(-1, 0, -1));
+    //outputScene->objects.add(rect);
+
+    statics->build();
+    outputScene->objects.add(statics);
+    build_light_tree(*outputScene);
+}
+
+
+
+
+
+///Image and checker textures lit by a big area light
+void textured_scene(scene* outputScene){
+    arena_scope scope(outputScene->arena);
+    outputScene->background = color(0.05, 0.05, 0.08);
+    auto statics = make_arena_shared<static_objects>();
+
+    auto checker = make_arena_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    statics->add(sphere(point3(0,-1000,0), 1000, make_arena_shared<lambertian>(checker)));
+
+    auto earth = make_arena_shared<lambertian>(make_arena_shared<texture_image>("src/earthmap.jpg"));
+    statics->add(sphere(point3(0, 1, 0), 1.0, earth));
+    statics->add(sphere(point3(-2.5, 1, 0), 1.0, make_arena_shared<metal>(checker, 0.2)));
+    statics->add(sphere(point3( 2.5, 1, 0), 1.0, make_arena_shared<lambertian>(make_arena_shared<checker_texture>(color(0.8, 0.1, 0.1), color(0.9, 0.9, 0.9)))));
+
+    auto light = make_arena_shared<material_light>(color(6,6,6));
+    statics->add(hittable_rect(point3(-3, 5, -3), point3( 3, 5, 3), light));
+
+    statics->build();
+    outputScene->objects.add(statics);
+    build_light_tree(*outputScene);
+}
+
+
+///Procedural turbulence everywhere, stresses perlin::turb
+void noise_scene(scene* outputScene){
+    arena_scope scope(outputScene->arena);
+    outputScene->background = color(0.70, 0.80, 1.00);
+    auto statics = make_arena_shared<static_objects>();
+
+    statics->add(sphere(point3(0,-1000,0), 1000, make_arena_shared<lambertian>(make_arena_shared<texture_noise>(4))));
+    for (int i = 0; i < 5; i++) {
+        auto marble = make_arena_shared<lambertian>(make_arena_shared<texture_noise>(2 + 3*i));
+        statics->add(sphere(point3(-4 + 2*i, 0.8, 0), 0.8, marble));
+    }
+    statics->add(sphere(point3(0, 2.5, -2), 1.0, make_arena_shared<metal>(make_arena_shared<texture_noise>(8), 0.5)));
+
+    statics->build();
+    outputScene->objects.add(statics);
+}
+
+
+///Participating media inside and around the cornell box
+void volume_scene(scene* outputScene){
+    arena_scope scope(outputScene->arena);
+    cornell_box(outputScene);
+
+    auto white = make_arena_shared<lambertian>(color(.73, .73, .73));
+    outputScene->objects.add(make_arena_shared<hittable_constant_medium>(make_arena_shared<sphere>(point3(-0.8, 0.8, 0.5), 0.8, white), 2.0, color(0.9, 0.9, 0.9)));
+    outputScene->objects.add(make_arena_shared<hittable_constant_medium>(make_arena_shared<sphere>(point3( 0.9, 2.6, 0.0), 0.6, white), 4.0, color(0.2, 0.4, 0.9)));
+}
+
+
+
+
+///Turbulent smoke plume rising from the cornell box floor, only the blocks inside the plume are allocated
+void smoke_scene(scene* outputScene, int resolution = 64){
+    arena_scope scope(outputScene->arena);
+    cornell_box(outputScene);
+
+    const int nx = resolution, ny = resolution * 3 / 2, nz = resolution;
+    auto grid = make_arena_shared<density_grid>(nx, ny, nz);
+    perlin noise;
+    for (int z = 0; z < nz; z++) {
+        for (int y = 0; y < ny; y++) {
+            for (int x = 0; x < nx; x++) {
+                //Column widening with the height and fading out at the top
+                const double u = 2.0*(x + 0.5)/nx - 1.0, h = (y + 0.5)/ny, w = 2.0*(z + 0.5)/nz - 1.0;
+                const double falloff = 1.0 - sqrt(u*u + w*w) / (0.3 + 0.6*h);
+                if (falloff <= 0.0) continue;
+                const double value = falloff * (1.0 - h) * noise.turb(point3(3*u, 4*h, 3*w)) * 2.0 - 0.05;
+                if (value > 0.0) {grid->set(x, y, z, (float)value);}
+            }
+        }
+    }
+    grid->build_majorants();
+
+    outputScene->objects.add(make_arena_shared<hittable_grid_medium>(grid, aabb(point3(-1.5, 0, -1.5), point3(1.5, 3.6, 1.5)), 40.0, color(0.8, 0.8, 0.8)));
+}
+
+
+
+
+///Spheres bouncing with their own phase around a marble turntable, count small spheres.
+///Nothing is added or removed over time, so every frame only refits the BVH
+void bouncing_scene(scene* outputScene, animation& anim, int count = 64){
+    arena_scope scope(outputScene->arena);
+    outputScene->background = color(0.70, 0.80, 1.00);
+    auto statics = make_arena_shared<static_objects>();
+
+    auto checker = make_arena_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    statics->add(sphere(point3(0,-1000,0), 1000, make_arena_shared<lambertian>(checker)));
+
+    //One bounce per second, the phase and height of every sphere are random
+    const track<double> bounce = track<double>{{0.0, 0.0}, {0.5, 1.0}, {1.0, 0.0}}.looping();
+    const int side = (int)ceil(sqrt((double)count));
+    const double step = fmax(0.5, 12.0 / side);
+    vector<shared_ptr<material>> palette;
+    for (int i = 0; i < 64; i++) {palette.push_back(make_arena_shared<lambertian>(color::random() * color::random()));}
+    static_objects* s = statics.get();
+    for (int i = 0; i < count; i++) {
+        const point3 base(-side*step/2 + (i % side)*step, 0.2, -side*step/2 + (i / side)*step);
+        if ((base - point3(0, 0.2, 0)).length() < 1.5) continue;
+
+        const size_t index = statics->add(sphere(base, 0.2, palette[random_int(0, palette.size()-1)]));
+        const double phase = random_double(), height = random_double(0.5, 2.0);
+        anim.bind([s, index, base, bounce, phase, height](double time){
+            s->get<sphere>(index).set_center(base + vec3(0, height * bounce.at(time + phase), 0));
+        });
+    }
+
+    auto light = make_arena_shared<material_light>(color(4,4,4));
+    statics->add(hittable_rect(point3(-4, 6, -4), point3( 4, 6, 4), light));
+
+    statics->build();
+    outputScene->objects.add(statics);
+    build_light_tree(*outputScene);
+    anim.refit(statics);
+
+    //Marble ball turning once every 4 seconds, an instance outside the static BVH
+    auto marble = make_arena_shared<lambertian>(make_arena_shared<texture_noise>(4));
+    auto turntable = make_arena_shared<hittable_rotated>(make_arena_shared<sphere>(point3(0, 1, 0), 1.0, marble), axis_y, 0);
+    anim.bind(track<double>{{0.0, 0.0}, {4.0, 360.0}}.looping(), [turntable](const double& angle){turntable->set_angle(angle);});
+    outputScene->objects.add(turntable);
+}
+
+
+///Spheres outdoors under an HDR environment map, or a baked sky with a small bright sun when path is null
+void sky_scene(scene* outputScene, const char* path = nullptr){
+    arena_scope scope(outputScene->arena);
+    outputScene->background = color(0, 0, 0);
+    auto statics = make_arena_shared<static_objects>();
+
+    statics->add(sphere(point3(0,-1000,0), 1000, make_arena_shared<lambertian>(color(0.5, 0.5, 0.5))));
+    statics->add(sphere(point3(-2.2, 1, 0), 1.0, make_arena_shared<lambertian>(color(0.8, 0.3, 0.2))));
+    statics->add(sphere(point3( 0.0, 1, 0), 1.0, make_arena_shared<dielectric>(1.5)));
+    statics->add(sphere(point3( 2.2, 1, 0), 1.0, make_arena_shared<metal>(color(0.8, 0.8, 0.7), 0.1)));
+    statics->add(hittable_box(point3(-0.6, 0, 1.6), point3(0.6, 0.5, 2.4), make_arena_shared<lambertian>(color(0.2, 0.4, 0.8))));
+    statics->build();
+    outputScene->objects.add(statics);
+
+    //Sun 1.5 degrees wide, about 5000 times brighter than the sky around it
+    shared_ptr<environment_map> sky;
+    if (path){sky = make_arena_shared<environment_map>(path);}
+    else {
+        const vec3 sun = unit_vector(vec3(-0.4, 0.45, 0.6));
+        sky = make_arena_shared<environment_map>(1024, 512, [sun](const vec3& d){
+            if (dot(d, sun) > cos(0.75 * pi / 180)){return color(5000, 4600, 4000);}
+            const double up = fmax(d.y(), 0.0);
+            return d.y() < 0 ? color(0.3, 0.28, 0.25) : (1 - up) * color(1.0, 0.95, 0.9) + up * color(0.35, 0.55, 1.0);
+        });
+    }
+    if (sky->valid()){outputScene->environment = sky;}
+}
+
+
+///Night city of blocks lit by count small emitters, lamps (spheres) and LED panels (rects) in many colors
+void lights_scene(scene* outputScene, int count = 1000){
+    arena_scope scope(outputScene->arena);
+    outputScene->background = color(0.002, 0.002, 0.004);
+    auto statics = make_arena_shared<static_objects>();
+
+    statics->add(sphere(point3(0,-1000,0), 1000, make_arena_shared<lambertian>(color(0.4, 0.4, 0.4))));
+
+    //Blocks on a grid, streets between them
+    auto wall = make_arena_shared<lambertian>(color(0.6, 0.55, 0.5));
+    for (int i = -4; i < 4; i++) {
+        for (int j = -4; j < 4; j++) {
+            const double x = i*8 + 4, z = j*8 + 4;
+            statics->add(hittable_box(point3(x - 2.5, 0, z - 2.5), point3(x + 2.5, random_double(1.0, 6.0), z + 2.5), wall));
+        }
+    }
+
+    //Lights all over the city, a few dozen palettes so materials are shared.
+    //The total power doesn't change with count, only how finely it's split
+    vector<shared_ptr<material>> palette;
+    const double scale = 1000.0 / std::max(count, 1);
+    for (int i = 0; i < 32; i++) {palette.push_back(make_arena_shared<material_light>(color::random(0.3, 1.0) * random_double(20, 60) * scale));}
+    for (int i = 0; i < count; i++) {
+        const auto& m = palette[random_int(0, palette.size()-1)];
+        const double x = random_double(-32, 32), z = random_double(-32, 32);
+        if (i % 3 == 2){
+            //Panel facing along x
+            const double y = random_double(0.3, 3.0);
+            statics->add(hittable_rect(point3(x, y, z), point3(x, y + 0.1, z + 0.3), m));
+        }else{
+            statics->add(sphere(point3(x, random_double(0.1, 3.0), z), 0.05, m));
+        }
+    }
+
+    statics->build();
+    outputScene->objects.add(statics);
+    build_light_tree(*outputScene);
+}
+
+
+///Glass and mirror spheres in a box lit by a small lamp, the light on the floor is mostly caustics
+void caustics_scene(scene* outputScene){
+    arena_scope scope(outputScene->arena);
+    outputScene->background = color(0, 0, 0);
+    auto statics = make_arena_shared<static_objects>();
+
+    auto white = make_arena_shared<lambertian>(color(.73, .73, .73));
+    auto red   = make_arena_shared<lambertian>(color(.65, .05, .05));
+    auto green = make_arena_shared<lambertian>(color(.12, .45, .15));
+    statics->add(hittable_rect(point3(-2, 0, -2), point3( 2, 0, 2), white));
+    statics->add(hittable_rect(point3(-2, 0, -2), point3( 2, 4,-2), white));
+    statics->add(hittable_rect(point3(-2, 0, -2), point3(-2, 4, 2), red));
+    statics->add(hittable_rect(point3( 2, 0, -2), point3( 2, 4, 2), green));
+    statics->add(hittable_rect(point3(-2, 4, -2), point3( 2, 4, 2), white));
+
+    statics->add(sphere(point3(-0.7, 0.8, 0.2), 0.8, make_arena_shared<dielectric>(1.5)));
+    statics->add(sphere(point3( 1.1, 0.6,-0.9), 0.6, make_arena_shared<metal>(color(0.9, 0.9, 0.9), 0.0)));
+    statics->add(sphere(point3(-0.2, 2.8, 0.4), 0.08, make_arena_shared<material_light>(color(600, 570, 510))));
+
+    statics->build();
+    outputScene->objects.add(statics);
+    build_light_tree(*outputScene);
+}
+
+
+
+
+#endif // __SCENES_H_
@@ -10,7 +10,7 @@ class checker_texture : public texture{
   public:
     checker_texture() {}
     checker_texture(shared_ptr<texture> _even, shared_ptr<texture> _odd) : even(_even), odd(_odd) {}
-    checker_texture(color c1, color c2) : even(make_shared<solid_color>(c1)), odd(make_shared<solid_color>(c2)) {}
+    checker_texture(color c1, color c2) : even(make_arena_shared<solid_color>(c1)), odd(make_arena_shared<solid_color>(c2)) {}
 
     virtual color value(double u, double v, const point3& p) const override{
         auto sines = sin(10*p.x())*sin(10*p.y())*sin(10*p.z());
@@ -21,6 +21,7 @@ class texture_image : public texture{
     texture_image():data(nullptr),width(0),height(0),bytes_per_scanline(0) {}
 
     texture_image(const char* filename){
+        TRACE_SCOPE("texture load");
         auto components_per_pixel = bytes_per_pixel;
         data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
         if(!this->data){std::cerr << "ERROR: Could not load texture image file '"<<filename<<"'.\n"; width = height = 0;}
@@ -9,8 +9,15 @@ class texture_noise : public texture{
     texture_noise() {}
     texture_noise(double sc) : scale(sc) {}
 
+    ///Pre-bakes the turbulence over the bounds, lookups outside of it fall back to the procedural noise
+    texture_noise(double sc, const aabb& bounds, int resolution = 64) : scale(sc) {
+        baked = perlin_grid(noise, scale, bounds, resolution);
+    }
+
 
     virtual color value(double u, double v, const vec3& p) const override{
+        if (baked.baked() && baked.contains(p)){return color(1,1,1) * baked.value(p);}
+
         ////Uniform turbolence
         return color(1,1,1) * noise.turb(scale * p);
         //Marble like
@@ -19,6 +26,7 @@ class texture_noise : public texture{
 
   private:
     perlin noise;
+    perlin_grid baked;
     double scale;
 };
 
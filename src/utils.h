@@ -5,6 +5,8 @@
 #include <math.h>
 #include <limits>
 #include <memory>
+#include <atomic>
+#include <stdint.h>
 
 /*
 ** Usings
@@ -47,6 +49,14 @@ inline double deg_to_rad(double deg){
     return deg * pi / 180.0;
 }
 
+///Seed scrambler, turns any integer into a well mixed 64 bit value
+inline uint64_t splitmix64(uint64_t x){
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
 ///Clamp function
 inline double clamp(double x, double min, double max){
     if (x<min) return min;
@@ -57,11 +67,26 @@ inline double clamp(double x, double min, double max){
 
 
 /*
-** Common headers
+** Random numbers
 */
+///Per-thread generator state, every thread starts from a different stream
+inline uint64_t& random_state(){
+    static std::atomic<uint64_t> streams(0);
+    thread_local uint64_t state = splitmix64(0x9E3779B97F4A7C15ull * (++streams)) | 1;
+    return state;
+}
+
+///Reseeds the generator of the calling thread, used for reproducible scenes and renders
+inline void random_seed(uint64_t seed){
+    random_state() = splitmix64(seed) | 1;
+}
+
 ///Returns a random number in [0,1)
 inline double random_double(){
-    return rand()/(RAND_MAX + 1.0);
+    //xorshift64*, top 53 bits
+    uint64_t& x = random_state();
+    x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+    return ((x * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
 }
 
 ///Returns a random number between [min,max)
@@ -81,7 +106,11 @@ inline int random_int(int min, int max){
 #include "ray.h"
 #include "utils_vec3.h"
 #include "utils_aabb.h"
+#include "utils_sampler.h"
+#include "utils_arena.h"
 #include "utils_perlin.h"
+#include "utils_stats.h"
+#include "utils_trace.h"
 
 
 #endif // __UTILS_H_
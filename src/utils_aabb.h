@@ -8,7 +8,7 @@
 class aabb{
   public:
     aabb() {}
-    aabb(const point3& a, const point3& b) {}
+    aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
 
     point3 min() const {return minimum;}
     point3 max() const {return maximum;}
@@ -16,6 +16,11 @@ class aabb{
 
     bool hit(const ray& r, double t_min, double t_max) const;
 
+    double surface_area() const {
+        const vec3 d = maximum - minimum;
+        return 2.0 * (d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+    }
+
 
     point3 minimum;
     point3 maximum;
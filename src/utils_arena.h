@@ -0,0 +1,143 @@
+#ifndef __UTILS_ARENA_H_
+#define __UTILS_ARENA_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <utility>
+#include <algorithm>
+#include <new>
+
+//Include OpemMP for the per-thread chunks
+#include <omp.h>
+
+
+/*
+** Scene arena
+**
+** Bump allocator for the objects, materials and textures of one scene. Objects made with
+** make_arena_shared while an arena_scope is open are packed in the order they are built, so a
+** material sits next to its textures and a bvh_node next to its children.
+** The scope binds the arena for the whole process, so the OpenMP team of a parallel build sees it
+** too: inside a parallel region every thread bumps its own chunk, outside of one the calling
+** thread takes a lock. Scenes are built one at a time, before rendering starts.
+** Nothing is freed one by one: every allocation keeps the arena alive and the chunks go back all
+** at once when the last object of the scene is destroyed.
+ */
+
+class scene_arena{
+  public:
+    static const size_t chunk_size = 1 << 20;
+
+    //Constructors
+    scene_arena() : cursors(omp_get_max_threads() + 1) {}
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+    ~scene_arena(){
+        for (auto& c : cursors){for (void* chunk : c.chunks){free(chunk);}}
+    }
+
+    //Functionality
+    inline void* allocate(size_t bytes, size_t align);
+
+    ///Bytes handed out and bytes reserved in chunks
+    size_t used_bytes() const {size_t total = 0; for (const auto& c : cursors){total += c.used;} return total;}
+    size_t reserved_bytes() const {size_t total = 0; for (const auto& c : cursors){total += c.reserved;} return total;}
+
+  private:
+    //Own cache line each, threads never write to the same one
+    struct alignas(64) cursor{
+        char* next = nullptr;
+        char* end = nullptr;
+        size_t used = 0;
+        size_t reserved = 0;
+        std::vector<void*> chunks;
+    };
+
+    std::vector<cursor> cursors;    //Shared one first, then one per OpenMP thread
+    std::mutex shared_lock;
+
+    static inline void* bump(cursor& c, size_t bytes, size_t align);
+};
+
+
+///Next aligned block of the calling thread's chunk
+inline void* scene_arena::allocate(size_t bytes, size_t align){
+    const int thread = omp_in_parallel() ? omp_get_thread_num() + 1 : 0;
+    if (thread > 0 && thread < (int)cursors.size()) return bump(cursors[thread], bytes, align);
+
+    std::lock_guard<std::mutex> guard(shared_lock);
+    return bump(cursors[0], bytes, align);
+}
+
+
+inline void* scene_arena::bump(cursor& c, size_t bytes, size_t align){
+    char* p = (char*)(((uintptr_t)c.next + align - 1) & ~(uintptr_t)(align - 1));
+    if (c.next == nullptr || p + bytes > c.end){
+        //Big objects get a chunk of their own
+        const size_t size = ((std::max(bytes + align, chunk_size) + 63) / 64) * 64;
+        char* chunk = (char*)aligned_alloc(64, size);
+        if (!chunk) throw std::bad_alloc();
+        c.chunks.push_back(chunk);
+        c.reserved += size;
+        c.next = chunk;
+        c.end = chunk + size;
+        p = (char*)(((uintptr_t)c.next + align - 1) & ~(uintptr_t)(align - 1));
+    }
+    c.next = p + bytes;
+    c.used += bytes;
+    return p;
+}
+
+
+
+
+///Standard allocator over a scene_arena, deallocate is a no-op
+template<typename T>
+class arena_allocator{
+  public:
+    typedef T value_type;
+
+    arena_allocator(shared_ptr<scene_arena> a) : arena(std::move(a)) {}
+    template<typename U> arena_allocator(const arena_allocator<U>& o) : arena(o.arena) {}
+
+    T* allocate(size_t n){return (T*)arena->allocate(n * sizeof(T), alignof(T));}
+    void deallocate(T*, size_t) {}
+
+    template<typename U> bool operator==(const arena_allocator<U>& o) const {return arena == o.arena;}
+    template<typename U> bool operator!=(const arena_allocator<U>& o) const {return arena != o.arena;}
+
+    shared_ptr<scene_arena> arena;
+};
+
+
+
+
+///Arena make_arena_shared allocates from, on every thread. Only arena_scope writes it, outside parallel regions
+inline shared_ptr<scene_arena> active_arena;
+
+///Binds an arena until the scope ends, a null arena means the heap. Open it outside parallel regions
+class arena_scope{
+  public:
+    arena_scope(shared_ptr<scene_arena> arena) : previous(active_arena) {active_arena = std::move(arena);}
+    ~arena_scope(){active_arena = previous;}
+    arena_scope(const arena_scope&) = delete;
+    arena_scope& operator=(const arena_scope&) = delete;
+
+  private:
+    shared_ptr<scene_arena> previous;
+};
+
+
+///make_shared in the active arena, or on the heap when there's none
+template<typename T, typename... Args>
+inline shared_ptr<T> make_arena_shared(Args&&... args){
+    if (active_arena) return std::allocate_shared<T>(arena_allocator<T>(active_arena), std::forward<Args>(args)...);
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+
+
+#endif // __UTILS_ARENA_H_
@@ -0,0 +1,155 @@
+#ifndef __UTILS_DENSITY_GRID_H_
+#define __UTILS_DENSITY_GRID_H_
+
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "utils_vec3.h"
+
+
+/*
+** Sparse density grid
+**
+** Voxels are stored in blocks of block_size^3, a block is only allocated once one of its voxels
+** is non-zero, so empty space costs one table entry per block.
+** Every block also has a majorant, the highest density a trilinear lookup inside it can return,
+** which is what delta and ratio tracking step against.
+** Grid coordinates go from 0 to the voxel count on each axis, voxel centers are at i+0.5.
+ */
+
+class density_grid{
+  public:
+    static const int block_size = 8;
+
+    //Constructors
+    density_grid() {}
+    density_grid(int nx, int ny, int nz){resize(nx, ny, nz);}
+
+    //Voxels
+    void resize(int nx, int ny, int nz);
+    void set(int x, int y, int z, float value);
+    inline float voxel(int x, int y, int z) const;
+    inline double sample(const point3& g) const;
+
+    //Majorants, build them after the last set()
+    void build_majorants();
+    inline float majorant(int bx, int by, int bz) const {return majorants[block(bx, by, bz)];}
+
+    //Sizes
+    int size(int axis) const {return n[axis];}
+    int blocks(int axis) const {return nb[axis];}
+    size_t allocated_blocks() const {return block_data.size() / block_voxels;}
+    size_t memory_bytes() const {return block_table.size()*sizeof(int32_t) + (block_data.size() + majorants.size())*sizeof(float);}
+
+    ///Loads dense float32 voxels (x fastest, then y, then z), zeros stay unallocated
+    bool load_raw(const char* path, int nx, int ny, int nz);
+
+  private:
+    static const int block_voxels = block_size * block_size * block_size;
+
+    int n[3] = {0, 0, 0};
+    int nb[3] = {0, 0, 0};
+    std::vector<int32_t> block_table;   //Offset of every block in block_data, -1 while empty
+    std::vector<float> block_data;
+    std::vector<float> majorants;
+
+    inline int block(int bx, int by, int bz) const {return bx + nb[0]*(by + nb[1]*bz);}
+    static inline int local(int x, int y, int z){
+        return (x % block_size) + block_size*((y % block_size) + block_size*(z % block_size));
+    }
+};
+
+
+void density_grid::resize(int nx, int ny, int nz){
+    n[0] = nx; n[1] = ny; n[2] = nz;
+    for (int a = 0; a < 3; a++){nb[a] = (n[a] + block_size - 1) / block_size;}
+    block_table.assign((size_t)nb[0] * nb[1] * nb[2], -1);
+    block_data.clear();
+    majorants.assign(block_table.size(), 0.0f);
+}
+
+
+void density_grid::set(int x, int y, int z, float value){
+    int32_t& offset = block_table[block(x / block_size, y / block_size, z / block_size)];
+    if (offset < 0){
+        if (value == 0.0f) return;
+        offset = (int32_t)block_data.size();
+        block_data.resize(block_data.size() + block_voxels, 0.0f);
+    }
+    block_data[offset + local(x, y, z)] = value;
+}
+
+
+///Voxel value, indices are clamped to the grid
+inline float density_grid::voxel(int x, int y, int z) const{
+    x = std::min(std::max(x, 0), n[0]-1);
+    y = std::min(std::max(y, 0), n[1]-1);
+    z = std::min(std::max(z, 0), n[2]-1);
+    const int32_t offset = block_table[block(x / block_size, y / block_size, z / block_size)];
+    return offset < 0 ? 0.0f : block_data[offset + local(x, y, z)];
+}
+
+
+///Trilinear lookup at grid coordinates
+inline double density_grid::sample(const point3& g) const{
+    double f[3]; int i[3];
+    for (int a = 0; a < 3; a++){
+        const double c = g[a] - 0.5;
+        i[a] = (int)floor(c);
+        f[a] = c - i[a];
+    }
+
+    double accum = 0.0;
+    for (int c = 0; c < 8; c++){
+        const int di = (c >> 2) & 1, dj = (c >> 1) & 1, dk = c & 1;
+        const double w = (di ? f[0] : 1-f[0]) * (dj ? f[1] : 1-f[1]) * (dk ? f[2] : 1-f[2]);
+        accum += w * voxel(i[0]+di, i[1]+dj, i[2]+dk);
+    }
+    return accum;
+}
+
+
+///Max over each block grown by one voxel, the neighbours a trilinear lookup inside it reads
+void density_grid::build_majorants(){
+    #pragma omp parallel for
+    for (int bz = 0; bz < nb[2]; bz++){
+        for (int by = 0; by < nb[1]; by++){
+            for (int bx = 0; bx < nb[0]; bx++){
+                float m = 0.0f;
+                for (int z = bz*block_size - 1; z <= (bz+1)*block_size; z++){
+                    for (int y = by*block_size - 1; y <= (by+1)*block_size; y++){
+                        for (int x = bx*block_size - 1; x <= (bx+1)*block_size; x++){m = std::max(m, voxel(x, y, z));}
+                    }
+                }
+                majorants[block(bx, by, bz)] = m;
+            }
+        }
+    }
+}
+
+
+bool density_grid::load_raw(const char* path, int nx, int ny, int nz){
+    FILE* f = fopen(path, "rb");
+    if (!f){std::cerr << "ERROR: Could not load density grid '" << path << "'.\n"; return false;}
+
+    resize(nx, ny, nz);
+    std::vector<float> row(nx);
+    bool ok = true;
+    for (int z = 0; z < nz && ok; z++){
+        for (int y = 0; y < ny && ok; y++){
+            ok = fread(row.data(), sizeof(float), nx, f) == (size_t)nx;
+            for (int x = 0; x < nx && ok; x++){set(x, y, z, row[x]);}
+        }
+    }
+    fclose(f);
+    if (!ok){std::cerr << "ERROR: Density grid '" << path << "' is truncated.\n";}
+
+    build_majorants();
+    return ok;
+}
+
+
+
+#endif // __UTILS_DENSITY_GRID_H_
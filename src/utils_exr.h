@@ -0,0 +1,114 @@
+#ifndef __UTILS_EXR_H_
+#define __UTILS_EXR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+/*
+** Minimal OpenEXR writer
+**
+** Single part scanline image, one line per block, no compression, 32 bit float channels.
+** Channel names may carry a layer prefix ("albedo.R"), compositors show every prefix as a layer.
+** Channel data is row major with the first row at the bottom, like the render buffers.
+ */
+
+struct exr_channel{
+    std::string name;
+    const float* data;   //width*height values
+};
+
+
+namespace exr_detail{
+    inline void put_bytes(std::vector<unsigned char>& out, const void* p, size_t n){
+        const unsigned char* b = (const unsigned char*)p;
+        out.insert(out.end(), b, b + n);
+    }
+
+    //EXR is little endian, so is every target we build for
+    template<typename T> inline void put(std::vector<unsigned char>& out, T v){put_bytes(out, &v, sizeof(T));}
+
+    inline void put_string(std::vector<unsigned char>& out, const std::string& s){put_bytes(out, s.c_str(), s.size() + 1);}
+
+    inline void put_attribute(std::vector<unsigned char>& out, const char* name, const char* type, uint32_t size){
+        put_string(out, name);
+        put_string(out, type);
+        put<uint32_t>(out, size);
+    }
+}
+
+
+///Writes the channels as one multi-layer float image, returns false if the file can't be opened
+inline bool write_exr(const char* path, int width, int height, std::vector<exr_channel> channels){
+    using namespace exr_detail;
+
+    //Readers expect the channel list sorted by name
+    std::sort(channels.begin(), channels.end(), [](const exr_channel& a, const exr_channel& b){return a.name < b.name;});
+
+    std::vector<unsigned char> header;
+    put<uint32_t>(header, 20000630);  //Magic number
+    put<uint32_t>(header, 2);         //Version 2, single part scanline
+
+    uint32_t chlist_size = 1;
+    for (const auto& c : channels){chlist_size += c.name.size() + 1 + 16;}
+    put_attribute(header, "channels", "chlist", chlist_size);
+    for (const auto& c : channels){
+        put_string(header, c.name);
+        put<int32_t>(header, 2);        //FLOAT
+        put<uint8_t>(header, 0);        //pLinear
+        put<uint8_t>(header, 0); put<uint8_t>(header, 0); put<uint8_t>(header, 0);
+        put<int32_t>(header, 1);        //x sampling
+        put<int32_t>(header, 1);        //y sampling
+    }
+    put<uint8_t>(header, 0);
+
+    put_attribute(header, "compression", "compression", 1);
+    put<uint8_t>(header, 0);            //NO_COMPRESSION
+
+    const int32_t window[4] = {0, 0, width-1, height-1};
+    put_attribute(header, "dataWindow", "box2i", 16);
+    put_bytes(header, window, 16);
+    put_attribute(header, "displayWindow", "box2i", 16);
+    put_bytes(header, window, 16);
+
+    put_attribute(header, "lineOrder", "lineOrder", 1);
+    put<uint8_t>(header, 0);            //INCREASING_Y
+    put_attribute(header, "pixelAspectRatio", "float", 4);
+    put<float>(header, 1.0f);
+    put_attribute(header, "screenWindowCenter", "v2f", 8);
+    put<float>(header, 0.0f); put<float>(header, 0.0f);
+    put_attribute(header, "screenWindowWidth", "float", 4);
+    put<float>(header, 1.0f);
+    put<uint8_t>(header, 0);            //End of header
+
+    //Offset table then one block per line, EXR lines go top to bottom
+    const uint32_t line_size = (uint32_t)(channels.size() * width * sizeof(float));
+    const uint64_t first_block = header.size() + (uint64_t)height * sizeof(uint64_t);
+    for (int y=0; y<height; y++){put<uint64_t>(header, first_block + (uint64_t)y * (8 + line_size));}
+
+    FILE* f = fopen(path, "wb");
+    if (!f){fprintf(stderr, "ERROR: Could not open image file '%s'.\n", path); return false;}
+    fwrite(header.data(), 1, header.size(), f);
+
+    std::vector<unsigned char> block;
+    block.reserve(8 + line_size);
+    for (int y=0; y<height; y++){
+        block.clear();
+        put<int32_t>(block, y);
+        put<uint32_t>(block, line_size);
+        const size_t row = (size_t)(height-1-y) * width;
+        for (const auto& c : channels){put_bytes(block, c.data + row, width * sizeof(float));}
+        fwrite(block.data(), 1, block.size(), f);
+    }
+
+    fclose(f);
+    return true;
+}
+
+
+
+#endif // __UTILS_EXR_H_
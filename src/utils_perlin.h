@@ -13,80 +13,108 @@
 //==============================================================================================
 
 #include "utils_vec3.h"
+#include "utils_aabb.h"
+
+#include <vector>
+#include <algorithm>
 
 
 
 class perlin {
     public:
+        static const int max_octaves = 8;
+
         perlin() {
-            ranvec = new vec3[point_count];
+            //Gradients are stored as separate x/y/z arrays so the corner gathers land in simd lanes
             for (int i = 0; i < point_count; ++i) {
-                ranvec[i] = unit_vector(vec3::random(-1,1));
+                vec3 g = unit_vector(vec3::random(-1,1));
+                ranx[i] = g.x(); rany[i] = g.y(); ranz[i] = g.z();
             }
 
-            perm_x = perlin_generate_perm();
-            perm_y = perlin_generate_perm();
-            perm_z = perlin_generate_perm();
-        }
-
-        ~perlin() {
-            delete[] ranvec;
-            delete[] perm_x;
-            delete[] perm_y;
-            delete[] perm_z;
+            perlin_generate_perm(perm_x);
+            perlin_generate_perm(perm_y);
+            perlin_generate_perm(perm_z);
         }
 
         double noise(const point3& p) const {
-            auto u = p.x() - floor(p.x());
-            auto v = p.y() - floor(p.y());
-            auto w = p.z() - floor(p.z());
-            auto i = static_cast<int>(floor(p.x()));
-            auto j = static_cast<int>(floor(p.y()));
-            auto k = static_cast<int>(floor(p.z()));
-            vec3 c[2][2][2];
-
-            for (int di=0; di < 2; di++)
-                for (int dj=0; dj < 2; dj++)
-                    for (int dk=0; dk < 2; dk++)
-                        c[di][dj][dk] = ranvec[
-                            perm_x[(i+di) & 255] ^
-                            perm_y[(j+dj) & 255] ^
-                            perm_z[(k+dk) & 255]
-                        ];
-
-            return perlin_interp(c, u, v, w);
+            return octaves_sum(p, 1);
         }
 
         double turb(const point3& p, int depth=7) const {
-            auto accum = 0.0;
+            return fabs(octaves_sum(p, depth));
+        }
+
+    private:
+        static const int point_count = 256;
+        alignas(64) double ranx[point_count];
+        alignas(64) double rany[point_count];
+        alignas(64) double ranz[point_count];
+        int perm_x[point_count];
+        int perm_y[point_count];
+        int perm_z[point_count];
+
+        ///Sums depth octaves of noise, each octave is a simd lane holding its 8 lattice corners,
+        ///max_octaves at a time
+        double octaves_sum(const point3& p, int depth) const {
+            double accum = 0.0;
             auto temp_p = p;
             auto weight = 1.0;
+            for (int first = 0; first < depth; first += max_octaves) {
+                accum += octaves_block(temp_p, weight, std::min(depth - first, max_octaves));
+            }
+            return accum;
+        }
+
+        ///Sums depth <= max_octaves octaves from temp_p and weight, leaves them at the next octave
+        double octaves_block(point3& temp_p, double& weight, int depth) const {
+            alignas(64) double gx[8][max_octaves], gy[8][max_octaves], gz[8][max_octaves];
+            alignas(64) double fu[max_octaves], fv[max_octaves], fw[max_octaves], weights[max_octaves];
+
+            //Gather the corner gradients of every octave (scalar, the tables are tiny and stay in L1)
+            for (int o = 0; o < depth; o++) {
+                const double flx = floor(temp_p.x()), fly = floor(temp_p.y()), flz = floor(temp_p.z());
+                const int i = static_cast<int>(flx), j = static_cast<int>(fly), k = static_cast<int>(flz);
+                fu[o] = temp_p.x() - flx; fv[o] = temp_p.y() - fly; fw[o] = temp_p.z() - flz;
+                weights[o] = weight;
+
+                const int x0 = perm_x[i & 255], x1 = perm_x[(i+1) & 255];
+                const int y0 = perm_y[j & 255], y1 = perm_y[(j+1) & 255];
+                const int z0 = perm_z[k & 255], z1 = perm_z[(k+1) & 255];
+                const int h[8] = {x0^y0^z0, x0^y0^z1, x0^y1^z0, x0^y1^z1, x1^y0^z0, x1^y0^z1, x1^y1^z0, x1^y1^z1};
+                for (int c = 0; c < 8; c++) {
+                    gx[c][o] = ranx[h[c]]; gy[c][o] = rany[h[c]]; gz[c][o] = ranz[h[c]];
+                }
 
-            for (int i = 0; i < depth; i++) {
-                accum += weight * noise(temp_p);
                 weight *= 0.5;
                 temp_p *= 2;
             }
 
-            return fabs(accum);
+            //Dot products and smoothed trilinear interpolation for all octaves at once
+            double accum = 0.0;
+            #pragma omp simd reduction(+:accum)
+            for (int o = 0; o < depth; o++) {
+                const double u = fu[o], v = fv[o], w = fw[o];
+                const double uu = u*u*(3-2*u), vv = v*v*(3-2*v), ww = w*w*(3-2*w);
+
+                double d[8];
+                for (int c = 0; c < 8; c++) {
+                    const int di = c >> 2, dj = (c >> 1) & 1, dk = c & 1;
+                    d[c] = gx[c][o]*(u-di) + gy[c][o]*(v-dj) + gz[c][o]*(w-dk);
+                }
+
+                const double x00 = d[0] + uu*(d[4]-d[0]), x01 = d[1] + uu*(d[5]-d[1]);
+                const double x10 = d[2] + uu*(d[6]-d[2]), x11 = d[3] + uu*(d[7]-d[3]);
+                const double y0 = x00 + vv*(x10-x00), y1 = x01 + vv*(x11-x01);
+                accum += weights[o] * (y0 + ww*(y1-y0));
+            }
+            return accum;
         }
 
-    private:
-        static const int point_count = 256;
-        vec3* ranvec;
-        int* perm_x;
-        int* perm_y;
-        int* perm_z;
-
-        static int* perlin_generate_perm() {
-            auto p = new int[point_count];
-
+        static void perlin_generate_perm(int* p) {
             for (int i = 0; i < point_count; i++)
                 p[i] = i;
 
             permute(p, point_count);
-
-            return p;
         }
 
         static void permute(int* p, int n) {
@@ -97,24 +125,71 @@ class perlin {
                 p[target] = tmp;
             }
         }
+};
+
+
+
+
 
-        static double perlin_interp(vec3 c[2][2][2], double u, double v, double w) {
-            auto uu = u*u*(3-2*u);
-            auto vv = v*v*(3-2*v);
-            auto ww = w*w*(3-2*w);
-            auto accum = 0.0;
-
-            for (int i=0; i < 2; i++)
-                for (int j=0; j < 2; j++)
-                    for (int k=0; k < 2; k++) {
-                        vec3 weight_v(u-i, v-j, w-k);
-                        accum += (i*uu + (1-i)*(1-uu))*
-                            (j*vv + (1-j)*(1-vv))*
-                            (k*ww + (1-k)*(1-ww))*dot(c[i][j][k], weight_v);
+/*
+** Baked noise grid
+ */
+
+class perlin_grid {
+    public:
+        perlin_grid() : res(0) {}
+
+        ///Samples turb(scale*p) on a res^3 lattice spanning the bounds
+        perlin_grid(const perlin& noise, double scale, const aabb& bounds, int resolution, int depth=7)
+            : box(bounds), res(resolution < 2 ? 2 : resolution), values(res*res*res) {
+            const vec3 size = box.max() - box.min();
+            cell = vec3(size.x()/(res-1), size.y()/(res-1), size.z()/(res-1));
+
+            #pragma omp parallel for
+            for (int z = 0; z < res; z++) {
+                for (int y = 0; y < res; y++) {
+                    for (int x = 0; x < res; x++) {
+                        point3 p = box.min() + vec3(x*cell.x(), y*cell.y(), z*cell.z());
+                        values[index(x, y, z)] = (float)noise.turb(scale * p, depth);
                     }
+                }
+            }
+        }
+
+        bool baked() const {return res > 0;}
 
+        bool contains(const point3& p) const {
+            for (int a = 0; a < 3; a++){
+                if (p[a] < box.min()[a] || p[a] > box.max()[a]) return false;
+            }
+            return true;
+        }
+
+        ///Trilinear lookup, p must be inside the baked bounds
+        double value(const point3& p) const {
+            double g[3]; int i[3];
+            for (int a = 0; a < 3; a++){
+                g[a] = (cell[a] > 0) ? (p[a] - box.min()[a]) / cell[a] : 0.0;
+                i[a] = std::min(static_cast<int>(g[a]), res-2);
+                g[a] -= i[a];
+            }
+
+            double accum = 0.0;
+            for (int c = 0; c < 8; c++) {
+                const int di = (c >> 2) & 1, dj = (c >> 1) & 1, dk = c & 1;
+                const double w = (di ? g[0] : 1-g[0]) * (dj ? g[1] : 1-g[1]) * (dk ? g[2] : 1-g[2]);
+                accum += w * values[index(i[0]+di, i[1]+dj, i[2]+dk)];
+            }
             return accum;
         }
+
+    private:
+        aabb box;
+        vec3 cell;
+        int res;
+        std::vector<float> values;
+
+        inline int index(int x, int y, int z) const {return x + res*(y + res*z);}
 };
 
 
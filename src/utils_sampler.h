@@ -0,0 +1,333 @@
+#ifndef __UTILS_SAMPLER_H_
+#define __UTILS_SAMPLER_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "utils_vec3.h"
+
+
+/*
+** Samplers
+**
+** Every random decision of a camera path reads the next dimension of the current sample:
+** renderScene calls sampler_begin for each pixel sample, the camera takes the pixel and lens
+** dimensions and every bounce starts at a fixed dimension (sampler_bounce), so what a material
+** draws never shifts the dimensions of the bounces after it.
+** - random: independent uniform numbers, the old behaviour
+** - sobol: Owen scrambled Sobol (0,2) pairs, index and scramble hashed per pixel and dimension
+** - halton: radical inverses in the first primes, digits scrambled per pixel, random past them
+** - blue_noise: one Owen scrambled Sobol sequence shared by every pixel, each pixel shifted by a
+**   blue noise mask so the error left at low sample counts is high frequency
+** The index of a sample is the number of samples the pixel already has, so progressive passes
+** keep extending the same sequence. A pixel can also run several streams (sampler_begin_stream),
+** sequences of their own with independent scrambles.
+ */
+
+enum sampler_type{sampler_random, sampler_sobol, sampler_halton, sampler_blue_noise, sampler_types};
+
+const char* const sampler_names[sampler_types] = {"random", "sobol", "halton", "blue_noise"};
+
+//Sampler used by renderScene
+inline sampler_type active_sampler = sampler_sobol;
+
+//Scramble seed, fixed so every pass continues the same sequences
+const uint32_t sampler_seed = 0x5bd1e995u;
+
+//Dimensions of the camera sample (pixel jitter and lens) and of every bounce (material, light samples, path guiding)
+const int sampler_camera_dimensions = 2;
+const int sampler_bounce_dimensions = 6;
+
+
+///State of the sample traced by the calling thread
+struct sample_state{
+    sampler_type type = sampler_random;
+    uint32_t x = 0, y = 0;
+    uint32_t index = 0;
+    uint32_t pixel_hash = 0;
+    uint32_t stream = 0;    //Hash of the stream, 0 for the pixel's own sequence
+    int dimension = 0;
+    int bounce = 0;
+};
+
+inline thread_local sample_state current_sample;
+
+
+
+/*
+** Hashing and scrambling
+ */
+
+inline uint32_t hash_u32(uint32_t x){
+    x ^= x >> 16; x *= 0x7feb352du;
+    x ^= x >> 15; x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v){
+    return seed ^ (hash_u32(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+inline uint32_t reverse_bits(uint32_t x){
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+///Owen scrambling of the bits of x, every bit flipped depending on the bits above it (Laine-Karras hash)
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed){
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+inline double u32_to_unit(uint32_t x){return x * (1.0 / 4294967296.0);}
+
+
+
+/*
+** Sequences
+ */
+
+///First two Sobol dimensions, the van der Corput sequence and its (0,2) partner
+inline uint32_t sobol_0(uint32_t index){return reverse_bits(index);}
+inline uint32_t sobol_1(uint32_t index){
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1){
+        if (index & 1){result ^= v;}
+    }
+    return result;
+}
+
+const int halton_dimensions = 16;
+const uint32_t halton_primes[halton_dimensions] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53};
+
+///Radical inverse with the digits Owen scrambled, each one permuted by a hash of the digits above it.
+///The permutations are affine, a bijection since every base is prime, and unlike a plain shift
+///they spread the consecutive digits of the first indices over the whole base
+inline double scrambled_radical_inverse(uint32_t index, uint32_t base, uint32_t seed){
+    const double inv = 1.0 / base;
+    double f = inv, result = 0.0;
+    uint32_t prefix = seed;
+    while (f > 1e-10){
+        const uint32_t digit = index % base;
+        index /= base;
+        const uint32_t h = hash_u32(prefix);
+        const uint32_t scale = 1 + (h >> 16) % (base - 1), offset = (h & 0xffff) % base;
+        result += f * ((scale * digit + offset) % base);
+        prefix = hash_combine(prefix, digit);
+        f *= inv;
+    }
+    return result;
+}
+
+
+///Tileable blue noise mask made with void and cluster, values are the ranks in [0,1)
+class blue_noise_mask{
+  public:
+    static const int size = 64;
+
+    static const blue_noise_mask& get(){static blue_noise_mask mask; return mask;}
+    inline double value(uint32_t x, uint32_t y) const {return ranks[(x % size) + (y % size) * size];}
+
+  private:
+    std::vector<double> ranks;
+    blue_noise_mask();
+};
+
+
+blue_noise_mask::blue_noise_mask(){
+    const int n = size * size;
+    const double sigma = 1.5;
+    const int radius = 6;
+
+    //Gaussian energy of the set points on the torus, adding or removing a point updates its neighbourhood
+    std::vector<double> energy(n, 0.0);
+    std::vector<char> set(n, 0);
+    auto splat = [&](int p, double sign){
+        const int px = p % size, py = p / size;
+        for (int dy = -radius; dy <= radius; dy++){
+            for (int dx = -radius; dx <= radius; dx++){
+                const int q = ((px + dx + size) % size) + ((py + dy + size) % size) * size;
+                energy[q] += sign * exp(-(dx*dx + dy*dy) / (2 * sigma * sigma));
+            }
+        }
+    };
+    auto extreme = [&](bool of_set, bool highest){
+        int best = -1;
+        for (int p = 0; p < n; p++){
+            if ((bool)set[p] != of_set) continue;
+            if (best < 0 || (highest ? energy[p] > energy[best] : energy[p] < energy[best])){best = p;}
+        }
+        return best;
+    };
+
+    //Initial pattern, a tenth of the points spread out by moving the tightest cluster into the largest void
+    uint32_t h = 0x1234567u;
+    for (int i = 0; i < n / 10; i++){
+        int p;
+        do {h = hash_u32(h + i); p = h % n;} while (set[p]);
+        set[p] = 1; splat(p, 1.0);
+    }
+    while (true){
+        const int cluster = extreme(true, true);
+        set[cluster] = 0; splat(cluster, -1.0);
+        const int hole = extreme(false, false);
+        if (hole == cluster){set[cluster] = 1; splat(cluster, 1.0); break;}
+        set[hole] = 1; splat(hole, 1.0);
+    }
+
+    //Ranks: remove clusters from a copy of the initial pattern, then fill voids until it's full
+    ranks.assign(n, 0.0);
+    const std::vector<char> initial = set;
+    const std::vector<double> initial_energy = energy;
+    int count = (int)std::count(set.begin(), set.end(), 1);
+    for (int rank = count - 1; rank >= 0; rank--){
+        const int cluster = extreme(true, true);
+        set[cluster] = 0; splat(cluster, -1.0);
+        ranks[cluster] = rank;
+    }
+    set = initial;
+    energy = initial_energy;
+    for (int rank = count; rank < n; rank++){
+        const int hole = extreme(false, false);
+        set[hole] = 1; splat(hole, 1.0);
+        ranks[hole] = rank;
+    }
+    for (double& r : ranks){r = (r + 0.5) / n;}
+}
+
+
+
+/*
+** Sampling
+ */
+
+///Starts sample index of pixel (x, y), resets the dimensions
+inline void sampler_begin(uint32_t x, uint32_t y, uint32_t index, sampler_type type = active_sampler){
+    sample_state& s = current_sample;
+    s.type = type;
+    s.x = x; s.y = y;
+    s.index = index;
+    s.pixel_hash = hash_combine(hash_u32(x), y);
+    s.stream = 0;
+    s.dimension = 0;
+    s.bounce = 0;
+}
+
+///Starts sample index of stream of pixel (x, y), streams 1, 2... don't correlate with each other nor
+///with the pixel's own sequence (stream 0), every one stays stratified on its own
+inline void sampler_begin_stream(uint32_t x, uint32_t y, uint32_t index, uint32_t stream, sampler_type type = active_sampler){
+    sampler_begin(x, y, index, type);
+    sample_state& s = current_sample;
+    s.stream = stream ? hash_u32(stream) | 1 : 0;
+    s.pixel_hash ^= s.stream;
+}
+
+///Moves to the dimensions of the next bounce
+inline void sampler_bounce(){
+    sample_state& s = current_sample;
+    s.dimension = sampler_camera_dimensions + sampler_bounce_dimensions * s.bounce++;
+}
+
+///Component c of the current sample in dimension d
+inline double sample_component(const sample_state& s, int d, int c){
+    switch (s.type){
+        case sampler_sobol: {
+            const uint32_t seed = hash_combine(s.pixel_hash ^ sampler_seed, d);
+            const uint32_t index = nested_uniform_scramble(s.index, seed);
+            const uint32_t v = c == 0 ? sobol_0(index) : sobol_1(index);
+            return u32_to_unit(nested_uniform_scramble(v, hash_combine(seed, c + 1)));
+        }
+        case sampler_halton: {
+            const int k = 2*d + c;
+            if (k >= halton_dimensions) return random_double();
+            return scrambled_radical_inverse(s.index, halton_primes[k], hash_combine(s.pixel_hash ^ sampler_seed, k));
+        }
+        case sampler_blue_noise: {
+            const uint32_t seed = hash_combine(sampler_seed ^ s.stream, d);
+            const uint32_t index = nested_uniform_scramble(s.index, seed);
+            const uint32_t v = c == 0 ? sobol_0(index) : sobol_1(index);
+            const uint32_t offset = hash_combine(seed, c + 1);
+            const double shift = blue_noise_mask::get().value(s.x + (offset & 0xff), s.y + (offset >> 8 & 0xff));
+            const double u = u32_to_unit(nested_uniform_scramble(v, offset)) + shift;
+            return u - floor(u);
+        }
+        default:
+            return random_double();
+    }
+}
+
+///Next dimension of the current sample
+inline double sample_1d(){
+    sample_state& s = current_sample;
+    return sample_component(s, s.dimension++, 0);
+}
+
+///Next two dimensions of the current sample, stratified together for sobol and blue noise
+inline void sample_2d(double& u, double& v){
+    sample_state& s = current_sample;
+    const int d = s.dimension++;
+    u = sample_component(s, d, 0);
+    v = sample_component(s, d, 1);
+}
+
+
+
+/*
+** Warps, closed form so every sample costs the same
+ */
+
+///Concentric mapping of the square on the unit disk (z = 0)
+inline vec3 warp_disk(double u, double v){
+    const double a = 2*u - 1, b = 2*v - 1;
+    if (a == 0 && b == 0) return vec3(0, 0, 0);
+    double r, phi;
+    if (fabs(a) > fabs(b)){r = a; phi = (pi/4) * (b/a);}
+    else {r = b; phi = (pi/2) - (pi/4) * (a/b);}
+    return vec3(r*cos(phi), r*sin(phi), 0);
+}
+
+///Uniform direction
+inline vec3 warp_sphere(double u, double v){
+    const double z = 1 - 2*u;
+    const double r = sqrt(fmax(0.0, 1 - z*z));
+    const double phi = 2*pi*v;
+    return vec3(r*cos(phi), r*sin(phi), z);
+}
+
+///Uniform point in the unit ball
+inline vec3 warp_ball(double u, double v, double w){
+    return cbrt(w) * warp_sphere(u, v);
+}
+
+///Tangent frame around a unit normal (Duff et al. 2017)
+inline void orthonormal_basis(const vec3& n, vec3& t, vec3& b){
+    const double sign = copysign(1.0, n.z());
+    const double a = -1.0 / (sign + n.z());
+    const double c = n.x() * n.y() * a;
+    t = vec3(1 + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+    b = vec3(c, sign + n.y() * n.y() * a, -n.y());
+}
+
+///Cosine weighted direction around a unit normal
+inline vec3 warp_cosine_hemisphere(const vec3& normal, double u, double v){
+    const vec3 d = warp_disk(u, v);
+    const double z = sqrt(fmax(0.0, 1 - d.x()*d.x() - d.y()*d.y()));
+    vec3 t, b;
+    orthonormal_basis(normal, t, b);
+    return d.x()*t + d.y()*b + z*normal;
+}
+
+
+
+#endif // __UTILS_SAMPLER_H_
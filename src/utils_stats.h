@@ -0,0 +1,158 @@
+#ifndef __UTILS_STATS_H_
+#define __UTILS_STATS_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+//STB
+#include "extern_stb_image.h"
+
+
+/*
+** Render statistics
+**
+** Every thread counts into its own thread_local render_stats, renderScene merges them
+** once the pass is done, so there are no atomics in the hot path.
+** Counters are compiled in only with -DTRACCIA_STATS (make STATS=1), otherwise the
+** macros expand to nothing.
+ */
+
+enum stat_ray_type{stat_ray_camera, stat_ray_bounce, stat_ray_shadow, stat_ray_types};
+enum stat_prim_type{stat_prim_sphere, stat_prim_rect, stat_prim_box, stat_prim_medium, stat_prim_types};
+
+const char* const stat_ray_names[stat_ray_types] = {"camera", "bounce", "shadow"};
+const char* const stat_prim_names[stat_prim_types] = {"sphere", "rect", "box", "medium"};
+
+struct render_stats{
+    static const int max_bounces = 64;
+
+    uint64_t rays[stat_ray_types];
+    uint64_t nodes_visited;
+    uint64_t box_tests;
+    uint64_t prim_tests[stat_prim_types];
+    uint64_t depth_histogram[max_bounces+1];
+
+    //Bounces of the path being traced
+    int path_bounces;
+
+    render_stats(){reset();}
+    void reset(){memset(this, 0, sizeof(render_stats));}
+
+    uint64_t paths() const {
+        uint64_t total = 0;
+        for (int i=0; i<=max_bounces; i++){total += depth_histogram[i];}
+        return total;
+    }
+
+    ///Traversal work, used as the per-pixel cost
+    uint64_t work() const {
+        uint64_t total = nodes_visited;
+        for (int i=0; i<stat_prim_types; i++){total += prim_tests[i];}
+        return total;
+    }
+
+    void merge(const render_stats& o){
+        for (int i=0; i<stat_ray_types; i++){rays[i] += o.rays[i];}
+        nodes_visited += o.nodes_visited;
+        box_tests += o.box_tests;
+        for (int i=0; i<stat_prim_types; i++){prim_tests[i] += o.prim_tests[i];}
+        for (int i=0; i<=max_bounces; i++){depth_histogram[i] += o.depth_histogram[i];}
+    }
+
+    void print() const {
+        const uint64_t n_paths = paths();
+        printf("Stats:\n");
+        for (int i=0; i<stat_ray_types; i++){printf("  rays %-8s %llu\n", stat_ray_names[i], (unsigned long long)rays[i]);}
+        printf("  nodes visited  %llu\n", (unsigned long long)nodes_visited);
+        printf("  box tests      %llu\n", (unsigned long long)box_tests);
+        for (int i=0; i<stat_prim_types; i++){printf("  tests %-8s %llu\n", stat_prim_names[i], (unsigned long long)prim_tests[i]);}
+
+        //Bounces per path and its histogram
+        double mean = 0.0;
+        int last = 0;
+        for (int i=0; i<=max_bounces; i++){
+            mean += i * (double)depth_histogram[i];
+            if (depth_histogram[i]) last = i;
+        }
+        printf("  bounces/path   %.3f\n", n_paths ? mean / n_paths : 0.0);
+        for (int i=0; i<=last; i++){
+            printf("    %2d | %-40.*s %llu\n", i, n_paths ? (int)(40 * depth_histogram[i] / n_paths) : 0,
+                   "########################################", (unsigned long long)depth_histogram[i]);
+        }
+    }
+};
+
+//Counters of the calling thread
+inline thread_local render_stats thread_stats;
+
+#ifdef TRACCIA_STATS
+    #define STAT_INC(field) (thread_stats.field++)
+    #define STAT_RAY(type) (thread_stats.rays[type]++)
+    #define STAT_PRIM(type) (thread_stats.prim_tests[type]++)
+    #define STAT_PATH_BEGIN() (thread_stats.path_bounces = 0)
+    #define STAT_PATH_BOUNCE() (thread_stats.path_bounces++)
+    #define STAT_PATH_END() (thread_stats.depth_histogram[std::min(thread_stats.path_bounces, (int)render_stats::max_bounces)]++)
+    #define STAT_PATH_END_AT(bounces) (thread_stats.depth_histogram[std::min((int)(bounces), (int)render_stats::max_bounces)]++)
+#else
+    #define STAT_INC(field) ((void)0)
+    #define STAT_RAY(type) ((void)0)
+    #define STAT_PRIM(type) ((void)0)
+    #define STAT_PATH_BEGIN() ((void)0)
+    #define STAT_PATH_BOUNCE() ((void)0)
+    #define STAT_PATH_END() ((void)0)
+    #define STAT_PATH_END_AT(bounces) ((void)0)
+#endif
+
+
+///Measures the cost of a pixel: traversal work when the counters are compiled in, nanoseconds otherwise
+struct cost_probe{
+#ifdef TRACCIA_STATS
+    uint64_t start = 0;
+    inline void begin(){start = thread_stats.work();}
+    inline double end() const {return (double)(thread_stats.work() - start);}
+#else
+    std::chrono::steady_clock::time_point start;
+    inline void begin(){start = std::chrono::steady_clock::now();}
+    inline double end() const {return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();}
+#endif
+};
+
+
+
+
+/*
+** Cost heatmap
+ */
+
+///Writes the per-pixel cost as a log-scaled false color png (black, blue, red, yellow, white)
+inline void write_cost_heatmap(const char* path, const double* cost, int width, int height){
+    const int n = width * height;
+
+    //Normalize on the 99th percentile so a few outliers don't flatten the image
+    std::vector<double> sorted(cost, cost + n);
+    std::nth_element(sorted.begin(), sorted.begin() + (n-1)*99/100, sorted.end());
+    const double top = log1p(fmax(sorted[(n-1)*99/100], 1e-9));
+
+    const double stops[5][3] = {{0,0,0}, {0,0,1}, {1,0,0}, {1,1,0}, {1,1,1}};
+    std::vector<unsigned char> pixels(n * 3);
+    for (int i=0; i<n; i++){
+        double x = fmin(log1p(fmax(cost[i], 0.0)) / top, 1.0) * 4;
+        int s = std::min((int)x, 3);
+        double f = x - s;
+        for (int c=0; c<3; c++){
+            pixels[i*3+c] = (unsigned char)(255.0 * (stops[s][c] * (1-f) + stops[s+1][c] * f));
+        }
+    }
+
+    stbi_flip_vertically_on_write(1);
+    stbi_write_png(path, width, height, 3, pixels.data(), width * 3);
+}
+
+
+
+#endif // __UTILS_STATS_H_
@@ -0,0 +1,141 @@
+#ifndef __UTILS_TRACE_H_
+#define __UTILS_TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+
+
+/*
+** Timeline tracing
+**
+** Scoped events are pushed into a ring buffer owned by the calling thread, the owner is the
+** only writer so recording is a couple of stores and a release. trace_dump() writes every
+** buffer as Chrome trace / Perfetto JSON (load it in chrome://tracing or ui.perfetto.dev).
+** Threads are numbered in the order they record their first event, TRACE_THREAD_NAME labels the
+** calling one (the main thread registers itself first this way).
+** Events are compiled in only with -DTRACCIA_TRACE (make TRACE=1).
+ */
+
+struct trace_event{
+    const char* name;   //Must be a string literal
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    int64_t arg;        //Shown as args.value, -1 for none
+};
+
+class trace_buffer{
+  public:
+    static const uint64_t capacity = 1 << 16;
+
+    trace_buffer(int id) : tid(id), name(nullptr), head(0), events(new trace_event[capacity]) {}
+
+    ///Single writer, oldest events are overwritten when the buffer wraps
+    inline void push(const trace_event& e){
+        const uint64_t h = head.load(std::memory_order_relaxed);
+        events[h & (capacity-1)] = e;
+        head.store(h+1, std::memory_order_release);
+    }
+
+    int tid;
+    const char* name;   //String literal, null shows "thread"
+    std::atomic<uint64_t> head;
+    std::unique_ptr<trace_event[]> events;
+};
+
+
+///Time since the first trace call
+inline uint64_t trace_now_ns(){
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+///Every buffer ever created, only touched when a thread records its first event and when dumping
+inline std::mutex trace_registry_mutex;
+inline std::vector<std::unique_ptr<trace_buffer>> trace_registry;
+
+inline trace_buffer& trace_thread_buffer(){
+    thread_local trace_buffer* buffer = nullptr;
+    if (!buffer){
+        std::lock_guard<std::mutex> lock(trace_registry_mutex);
+        trace_registry.emplace_back(new trace_buffer((int)trace_registry.size()));
+        buffer = trace_registry.back().get();
+    }
+    return *buffer;
+}
+
+
+///Labels the calling thread in the trace, registering it if it hasn't recorded anything yet
+inline void trace_thread_name(const char* name){trace_thread_buffer().name = name;}
+
+
+///Records the lifetime of the scope as one complete event
+class trace_scope{
+  public:
+    trace_scope(const char* n, int64_t a = -1) : name(n), arg(a), begin(trace_now_ns()) {}
+    ~trace_scope(){trace_thread_buffer().push({name, begin, trace_now_ns(), arg});}
+
+  private:
+    const char* name;
+    int64_t arg;
+    uint64_t begin;
+};
+
+
+///Writes all the recorded events as Chrome trace JSON. Call it once rendering has stopped: events
+///pushed while it runs are left out, and the ones they may have overwritten are dropped
+inline bool trace_dump(const char* path){
+    FILE* f = fopen(path, "w");
+    if (!f){fprintf(stderr, "ERROR: Could not open trace file '%s'.\n", path); return false;}
+
+    std::lock_guard<std::mutex> lock(trace_registry_mutex);
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (const auto& buffer : trace_registry){
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+                first ? "" : ",\n", buffer->tid, buffer->name ? buffer->name : "thread", buffer->tid);
+        first = false;
+
+        //Copy up to the head, then drop the slots the owner reused while copying
+        const uint64_t head = buffer->head.load(std::memory_order_acquire);
+        const uint64_t first = (head > trace_buffer::capacity) ? head - trace_buffer::capacity : 0;
+        std::vector<trace_event> events(head - first);
+        for (uint64_t i = first; i < head; i++){events[i - first] = buffer->events[i & (trace_buffer::capacity-1)];}
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t written = buffer->head.load(std::memory_order_relaxed);
+        const uint64_t valid = (written > first + trace_buffer::capacity) ? written - trace_buffer::capacity : first;
+
+        for (uint64_t i = valid; i < head; i++){
+            const trace_event& e = events[i - first];
+            fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                    e.name, buffer->tid, e.begin_ns * 1e-3, (e.end_ns - e.begin_ns) * 1e-3);
+            if (e.arg >= 0){fprintf(f, ", \"args\": {\"value\": %lld}", (long long)e.arg);}
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return true;
+}
+
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef TRACCIA_TRACE
+    #define TRACE_SCOPE(name) trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+    #define TRACE_SCOPE_ARG(name, arg) trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(name, arg)
+    #define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#else
+    #define TRACE_SCOPE(name) ((void)0)
+    #define TRACE_SCOPE_ARG(name, arg) ((void)0)
+    #define TRACE_THREAD_NAME(name) ((void)0)
+#endif
+
+
+
+#endif // __UTILS_TRACE_H_
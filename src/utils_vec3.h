@@ -85,16 +85,22 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
-vec3 random_in_unit_sphere(){
-    while(true){
-        auto p = vec3::random(-1, 1);
-        if(p.length_squared() >= 1) continue;
-        return p;
-    }
+///Rec. 709 luminance of a linear color
+inline double luminance(const color& c) {
+    return 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
 }
 
+///Uniform direction, closed form
 vec3 random_unit_vector(){
-    return unit_vector(random_in_unit_sphere());
+    const double z = 1 - 2*random_double();
+    const double r = sqrt(fmax(0.0, 1 - z*z));
+    const double phi = 2*pi*random_double();
+    return vec3(r*cos(phi), r*sin(phi), z);
+}
+
+///Uniform point in the unit ball, closed form
+vec3 random_in_unit_sphere(){
+    return cbrt(random_double()) * random_unit_vector();
 }
 
 vec3 random_in_hemisphere(const vec3& normal){
@@ -115,12 +121,11 @@ inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat){
 
 
 
+///Uniform point in the unit disk (z = 0), closed form
 vec3 random_in_unit_disk(){
-    while(true){
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+    const double r = sqrt(random_double());
+    const double phi = 2*pi*random_double();
+    return vec3(r*cos(phi), r*sin(phi), 0);
 }
 
 